@@ -3,6 +3,64 @@
 // IMPORTANT: Replace with your actual Google Spreadsheet ID
 const SPREADSHEET_ID = "1u6qhpIC5tHcCrUh8WNYn-tRyFY-UWu1i-ibd34V7cA0"; // <<< YOUR SPREADSHEET ID HERE
 
+// Ingest mode. When true, doPost only validates and buffers the row in Script
+// Properties and drainIngestQueue() (1-minute trigger, see installIngestTrigger)
+// writes the buffer with one setValues per device tab. When false, doPost
+// writes to the sheet itself.
+const INGEST_QUEUED = true;
+const QUEUE_KEY_PREFIX = "q_";          // one Script Property per buffered row
+const DRAIN_MAX_ROWS = 500;             // per trigger run, well inside the 6 min limit
+const QUEUE_MAX_BYTES = 350 * 1024;     // of the 500 KB property store; ~1.5 KB per row
+const QUEUE_MAX_AGE_MS = 3 * 24 * 3600 * 1000;  // older rows are dropped (logged)
+const QUEUE_LOCK_WAIT_MS = 3000;        // doPost gives up well inside the device's 10 s timeout
+const QUEUE_BYTES_CACHE_KEY = "queueBytes";  // queue size, kept by doPost and each drain
+const TAB_FAIL_MAX_RUNS = 60;           // a tab failing this many runs in a row has its rows dropped (logged)
+const TAB_FAILURES_KEY = "tabFailures"; // Script Property: { thing: consecutive failed runs }
+const DRAIN_LEASE_KEY = "draining";     // set while a drain writes, so runs never overlap
+const DRAIN_LEASE_SECONDS = 6 * 60;
+const TAB_CACHE_KEY = "tabs";           // known sheet names, refreshed by each drain
+const TAB_CACHE_SECONDS = 6 * 3600;
+const GZIP_CONTENT_TYPE = "application/x-kambingpro-gzip-base64";  // see UPLOAD_GZIP_CONTENT_TYPE in the sketch
+
+// Read API (doGet): recent hourly rows per device, kept in CacheService and
+// updated on every ingest, so reads normally cost no Sheets calls.
+const RECENT_CACHE_PREFIX = "recent_";
+const RECENT_CACHE_SECONDS = 6 * 3600;  // CacheService maximum; a miss rebuilds from the sheet
+const RECENT_HOURS_MAX = 14 * 24;       // enough for a 14-day daily summary
+const RECENT_FIELDS = [
+  "timestamp", "ammonia", "temperature", "humidity", "storageTank",
+  "ammoniaP90", "pumpDuration", "flushLiters"
+];
+
+// Extra payload fields appended after column I, in this order (J, K, ...).
+// New fields go at the END so existing sheets keep their column layout.
+const EXTRA_COLUMNS = [
+  "flushInterval", "pumpDuration", "sirenDuration", "cctvDuration", "auxDuration",
+  "flushCount", "flushLiters", "lastFlushLiters", "flowLpm", "refillLpm",
+  "nh3SlopePerHour", "predictiveFlushes",
+  "flushEvents", "pumpOnSeconds", "flushDropMean", "flushDropPctP50",
+  "flushRecoverMinP50", "flushRecoverMinP90", "flushLitersMean",
+  "tempHealth", "humHealth", "nh3Health", "tankHealth", "sensorFaults",
+  "ammoniaP50", "ammoniaP90", "ammoniaP99",
+  "temperatureP50", "temperatureP90", "temperatureP99",
+  "humidityP50", "humidityP90", "humidityP99",
+  "storageTankP50", "storageTankP90", "storageTankP99",
+  "sensors",  // extra sensors as JSON: { "t2": [hourly mean, health], ... }
+  "acqMeanMs", "acqMaxMs", "acqSavedPct",
+  "uploadBacklog", "uploadRetries", "uploadDropped", "uploadRejected",
+  "uploadConnectMs", "uploadPostMs", "uploadWarm",
+  "uploadRawBytes", "uploadBytesSaved",
+  "fwBuild", "otaResult", "otaKind", "otaFromBuild", "otaToBuild", "otaBytes", "otaMs",
+  "crashCount", "crashReason", "crashTask", "crashStage", "crashPc", "crashTrail", "crashUptimeS",
+  "flushUnrecovered"
+];
+
+// Payload key of every sheet column, in column order (A, B, ...).
+const ROW_KEYS = [
+  "timestamp", "ammonia", "temperature", "humidity", "storageTank",
+  "storagePump", "siren", "cctv", "auxiliarySocket"
+].concat(EXTRA_COLUMNS);
+
 /**
  * Handles HTTP POST requests. This function is triggered when the ESP32 sends data.
  * @param {Object} e The event parameter for a POST request.
@@ -10,17 +68,39 @@ const SPREADSHEET_ID = "1u6qhpIC5tHcCrUh8WNYn-tRyFY-UWu1i-ibd34V7cA0"; // <<< YO
  */
 function doPost(e) {
   try {
-    // Parse the JSON payload from the ESP32
-    const payload = JSON.parse(e.postData.contents);
+    // Parse the JSON payload from the ESP32: one report, or an array of queued
+    // reports (possibly gzip + base64, see readPayloads)
+    const payloads = readPayloads(e);
 
     // The "thing" field in the JSON (e.g., "RAB001") must exactly match a sheet name (tab name) in your spreadsheet.
-    const deviceName = payload.thing;
-    if (!deviceName) {
+    const deviceName = payloads.length ? payloads[0].thing : null;
+    if (!deviceName || payloads.some(function (p) { return p.thing !== deviceName; })) {
       Logger.log("Error: 'thing' field missing in payload.");
       return ContentService.createTextOutput("Error: 'thing' field missing in payload.")
                            .setMimeType(ContentService.MimeType.TEXT);
     }
 
+    const rows = payloads.map(buildRow);
+
+    if (INGEST_QUEUED) {
+      // Reject unknown devices only once a drain has cached the tab list
+      const tabs = CacheService.getScriptCache().get(TAB_CACHE_KEY);
+      if (tabs && JSON.parse(tabs).indexOf(deviceName) < 0) {
+        return ContentService.createTextOutput("Error: No sheet named '" + deviceName + "' found.")
+                             .setMimeType(ContentService.MimeType.TEXT);
+      }
+      // A unique key per row: concurrent doPosts never read-modify-write a shared value
+      const stamp = Date.now();
+      const entries = {};
+      rows.forEach(function (row, i) {
+        const key = QUEUE_KEY_PREFIX + stamp + "_" + ("0" + i).slice(-2) + Utilities.getUuid().slice(0, 8);
+        entries[key] = JSON.stringify({ thing: deviceName, row: row });
+      });
+      enqueueRows(entries);
+      return ContentService.createTextOutput("OK: Queued " + rows.length + " for " + deviceName)
+                           .setMimeType(ContentService.MimeType.TEXT);
+    }
+
     const ss = SpreadsheetApp.openById(SPREADSHEET_ID);
     const sheet = ss.getSheetByName(deviceName);
 
@@ -30,38 +110,17 @@ function doPost(e) {
                            .setMimeType(ContentService.MimeType.TEXT);
     }
 
-    // Ensure the sheet has a header row or is prepared for data.
-    // The order of elements in this 'row' array MUST match the column order in your sheet.
-    // Assumed Column Order:
-    // A: Timestamp
-    // B: Ammonia (ppm)
-    // C: Temperature (°C)
-    // D: Humidity (%)
-    // E: Storage Tank Volume (L)
-    // F: Pump Status (0 or 1)
-    // G: Siren Status (0 or 1)
-    // H: CCTV Status (0 or 1)
-    // I: AUX Socket Status (0 or 1)
-    
-    const rowData = [
-      payload.timestamp ? new Date(payload.timestamp) : null, // Convert ISO string to Date object; use null if timestamp is missing
-      payload.ammonia,         // Will be 'undefined' if not in payload, resulting in a blank cell
-      payload.temperature,
-      payload.humidity,
-      payload.storageTank,
-      payload.storagePump,
-      payload.siren,
-      payload.cctv,
-      payload.auxiliarySocket  // ESP32 sends 'auxiliarySocket'
-    ];
-
-    sheet.appendRow(rowData);
-    Logger.log("Data appended to sheet: " + deviceName + ", Row: " + rowData.join(", "));
+    appendRows(sheet, rows.map(toSheetRow));
+    updateRecentCache(deviceName, rows, sheet);
+    Logger.log("Data appended to sheet: " + deviceName + ", " + rows.length + " row(s)");
 
     return ContentService.createTextOutput("OK: Data received for " + deviceName)
                          .setMimeType(ContentService.MimeType.TEXT);
 
   } catch (err) {
+    // Nothing was stored: fail the request itself. Apps Script then answers with
+    // an HTML error page instead of the redirect, which the device retries.
+    if (err.retry) throw err;
     Logger.log("Error processing POST request: " + err.toString() + "\nStack: " + err.stack);
     // It's good to log the actual error content as well if possible, from e.postData.contents, in case of JSON parsing errors
     if (e && e.postData && e.postData.contents) {
@@ -72,6 +131,422 @@ function doPost(e) {
   }
 }
 
+/**
+ * Decodes a POST body into a list of reports. The device gzips larger batches
+ * and sends them base64-encoded (content type GZIP_CONTENT_TYPE); "H4sI" is
+ * the base64 form of the gzip magic, so such bodies are also recognised if a
+ * proxy rewrote the type.
+ * @param {Object} e The event parameter for a POST request.
+ * @return {Array<Object>} Parsed reports.
+ */
+function readPayloads(e) {
+  let text = e.postData.contents;
+  if (e.postData.type === GZIP_CONTENT_TYPE || text.indexOf("H4sI") === 0) {
+    const blob = Utilities.newBlob(Utilities.base64Decode(text), "application/x-gzip");
+    text = Utilities.ungzip(blob).getDataAsString();
+  }
+  const parsed = JSON.parse(text);
+  return Array.isArray(parsed) ? parsed : [parsed];
+}
+
+/**
+ * Builds the sheet row for a payload. The timestamp stays an ISO string here so
+ * the row can be buffered as JSON; toSheetRow() turns it into a Date.
+ *
+ * Column Order (must match the sheet):
+ * A: Timestamp
+ * B: Ammonia (ppm)
+ * C: Temperature (°C)
+ * D: Humidity (%)
+ * E: Storage Tank Volume (L)
+ * F: Pump Status (0 or 1)
+ * G: Siren Status (0 or 1)
+ * H: CCTV Status (0 or 1)
+ * I: AUX Socket Status (0 or 1)
+ * J onwards: EXTRA_COLUMNS (durations, flush analytics, sensor health, hourly percentiles)
+ * @param {Object} payload Parsed ESP32 JSON.
+ * @return {Array} Row values; missing fields are null (blank cells).
+ */
+function buildRow(payload) {
+  return [
+    payload.timestamp || null,
+    payload.ammonia,
+    payload.temperature,
+    payload.humidity,
+    payload.storageTank,
+    payload.storagePump,
+    payload.siren,
+    payload.cctv,
+    payload.auxiliarySocket  // ESP32 sends 'auxiliarySocket'
+  ].concat(EXTRA_COLUMNS.map(function (key) {
+    const v = payload[key];
+    return (v !== null && typeof v === "object") ? JSON.stringify(v) : v;
+  })).map(function (v) { return v === undefined ? null : v; });
+}
+
+/**
+ * Converts a buffered row to sheet values (timestamp string to Date, null to "").
+ * @param {Array} row Row from buildRow().
+ * @return {Array} Values for setValues/appendRow.
+ */
+function toSheetRow(row) {
+  return row.map(function (v, i) {
+    if (i === 0) return v ? new Date(v) : "";
+    return v === null ? "" : v;
+  });
+}
+
+/**
+ * Writes rows below the last used row with one setValues. Unlike appendRow,
+ * getRange does not grow the sheet, so missing rows and columns are inserted
+ * first (tabs filled by appendRow have no spare rows; new tabs have 26 columns).
+ * @param {Sheet} sheet Device tab.
+ * @param {Array<Array>} values Rows of equal length.
+ */
+function appendRows(sheet, values) {
+  const start = sheet.getLastRow() + 1;
+  const needRows = start + values.length - 1 - sheet.getMaxRows();
+  if (needRows > 0) sheet.insertRowsAfter(sheet.getMaxRows(), needRows);
+  const needCols = values[0].length - sheet.getMaxColumns();
+  if (needCols > 0) sheet.insertColumnsAfter(sheet.getMaxColumns(), needCols);
+  sheet.getRange(start, 1, values.length, values[0].length).setValues(values);
+}
+
+/**
+ * @param {string} message Reason.
+ * @return {Error} An error doPost rethrows, so the device sees a failed POST.
+ */
+function retryLater(message) {
+  const err = new Error(message);
+  err.retry = true;
+  return err;
+}
+
+/**
+ * @param {Object} entries Queue keys and values.
+ * @return {number} Bytes they take in the property store.
+ */
+function queueBytes(entries) {
+  return Object.keys(entries).reduce(function (n, k) { return n + k.length + entries[k].length; }, 0);
+}
+
+/**
+ * Adds rows to the queue unless that would pass QUEUE_MAX_BYTES. Takes the
+ * script lock, which a drain holds only while it reads or rewrites the queue.
+ * @param {Object} entries Queue keys and values.
+ */
+function enqueueRows(entries) {
+  const lock = LockService.getScriptLock();
+  if (!lock.tryLock(QUEUE_LOCK_WAIT_MS)) throw retryLater("Ingest queue busy");
+  try {
+    const props = PropertiesService.getScriptProperties();
+    const cache = CacheService.getScriptCache();
+    const cached = cache.get(QUEUE_BYTES_CACHE_KEY);
+    const used = cached !== null ? Number(cached) : queueBytes(pickQueueEntries(props.getProperties()));
+    const size = queueBytes(entries);
+    if (used + size > QUEUE_MAX_BYTES) throw retryLater("Ingest queue full (" + used + " bytes)");
+    try {
+      props.setProperties(entries);
+    } catch (err) {
+      throw retryLater("Ingest queue write failed: " + err);
+    }
+    cache.put(QUEUE_BYTES_CACHE_KEY, String(used + size), TAB_CACHE_SECONDS);
+  } finally {
+    lock.releaseLock();
+  }
+}
+
+/**
+ * @param {Object} all Script Properties.
+ * @return {Object} Only the queue entries.
+ */
+function pickQueueEntries(all) {
+  const out = {};
+  Object.keys(all).forEach(function (k) { if (k.indexOf(QUEUE_KEY_PREFIX) === 0) out[k] = all[k]; });
+  return out;
+}
+
+/**
+ * Time-driven trigger: moves buffered rows into their device tabs, oldest
+ * first, with one setValues per tab. Rows for a missing tab, rows older than
+ * QUEUE_MAX_AGE_MS and rows of a tab that failed TAB_FAIL_MAX_RUNS runs in a
+ * row are logged and discarded; other failing tabs keep their rows for the
+ * next run. The script lock is held only to snapshot the queue and to remove
+ * the handled keys in one setProperties, so doPost is never kept waiting by
+ * the sheet writes; a lease in CacheService keeps runs from overlapping.
+ */
+function drainIngestQueue() {
+  const lock = LockService.getScriptLock();
+  if (!lock.tryLock(5000)) return;
+  const props = PropertiesService.getScriptProperties();
+  const cache = CacheService.getScriptCache();
+  let all;
+  try {
+    if (cache.get(DRAIN_LEASE_KEY)) return;  // the previous run is still writing
+    all = props.getProperties();
+    cache.put(DRAIN_LEASE_KEY, "1", DRAIN_LEASE_SECONDS);
+  } finally {
+    lock.releaseLock();
+  }
+
+  const done = {};  // queue keys to remove
+  let failures = {};
+  try {
+    failures = JSON.parse(all[TAB_FAILURES_KEY] || "{}");
+  } catch (err) {
+    failures = {};
+  }
+  try {
+    const keys = Object.keys(all).filter(function (k) { return k.indexOf(QUEUE_KEY_PREFIX) === 0; });
+    if (keys.length === 0) return;
+    keys.sort(function (a, b) {  // q_<millis>_<id>: numeric time order
+      return Number(a.split("_")[1]) - Number(b.split("_")[1]) || (a < b ? -1 : 1);
+    });
+    const oldest = Date.now() - QUEUE_MAX_AGE_MS;
+    const fresh = keys.filter(function (k) {
+      if (Number(k.split("_")[1]) >= oldest) return true;
+      Logger.log("Dropping expired queue entry " + k + ": " + all[k]);
+      done[k] = true;
+      return false;
+    });
+    const batch = fresh.slice(0, DRAIN_MAX_ROWS);
+
+    const byThing = {};
+    const keysByThing = {};
+    batch.forEach(function (k) {
+      try {
+        const entry = JSON.parse(all[k]);
+        (byThing[entry.thing] = byThing[entry.thing] || []).push(toSheetRow(entry.row));
+        (keysByThing[entry.thing] = keysByThing[entry.thing] || []).push(k);
+      } catch (err) {
+        Logger.log("Dropping unreadable queue entry " + k + ": " + err);
+        done[k] = true;
+      }
+    });
+
+    const ss = SpreadsheetApp.openById(SPREADSHEET_ID);
+    const tabNames = ss.getSheets().map(function (sh) { return sh.getName(); });
+    cache.put(TAB_CACHE_KEY, JSON.stringify(tabNames), TAB_CACHE_SECONDS);
+
+    let drained = 0;
+    Object.keys(byThing).forEach(function (thing) {
+      const rows = byThing[thing];
+      const sheet = ss.getSheetByName(thing);
+      try {
+        if (sheet) {
+          appendRows(sheet, rows);
+          SpreadsheetApp.flush();
+          updateRecentCache(thing, rows, sheet);
+          drained += rows.length;
+        } else {
+          Logger.log("Error: No sheet named '" + thing + "' found, " + rows.length + " row(s) discarded.");
+        }
+        delete failures[thing];
+      } catch (err) {
+        failures[thing] = (failures[thing] || 0) + 1;
+        Logger.log("Error writing " + rows.length + " row(s) to '" + thing + "' (run " + failures[thing] + "): " + err);
+        if (failures[thing] < TAB_FAIL_MAX_RUNS) return;  // kept for the next run; the other tabs still go through
+        keysByThing[thing].forEach(function (k) { Logger.log("Dropping queue entry " + k + ": " + all[k]); });
+        delete failures[thing];
+      }
+      keysByThing[thing].forEach(function (k) { done[k] = true; });
+    });
+    Logger.log("Drained " + drained + " of " + batch.length + " row(s), " + (keys.length - batch.length) + " left.");
+  } finally {
+    // Rows queued by doPost since the snapshot are in the fresh read and kept
+    const failuresText = Object.keys(failures).length ? JSON.stringify(failures) : undefined;
+    const unchanged = Object.keys(done).length === 0 && failuresText === all[TAB_FAILURES_KEY];
+    lock.waitLock(30000);
+    try {
+      if (!unchanged) {
+        const current = props.getProperties();
+        Object.keys(done).forEach(function (k) { delete current[k]; });
+        if (failuresText) current[TAB_FAILURES_KEY] = failuresText;
+        else delete current[TAB_FAILURES_KEY];
+        props.setProperties(current, true);  // one write instead of a deleteProperty per row
+        cache.put(QUEUE_BYTES_CACHE_KEY, String(queueBytes(pickQueueEntries(current))), TAB_CACHE_SECONDS);
+      }
+      cache.remove(DRAIN_LEASE_KEY);
+    } finally {
+      lock.releaseLock();
+    }
+  }
+}
+
+/**
+ * Handles HTTP GET requests: recent data for one device as compact JSON.
+ *   ?thing=RAB001&hours=24           last N hourly rows (default 24)
+ *   ?thing=RAB001&view=daily&days=7  per-day summary (default 7 days)
+ * Rows are arrays in the order given by "fields".
+ * @param {Object} e The event parameter for a GET request.
+ * @return {ContentService.TextOutput} JSON.
+ */
+function doGet(e) {
+  try {
+    const p = (e && e.parameter) || {};
+    const thing = p.thing;
+    if (!thing) return jsonOutput({ error: "'thing' parameter missing" });
+    const recent = getRecentRows(thing);
+    if (!recent) return jsonOutput({ error: "No sheet named '" + thing + "' found." });
+
+    if (p.view === "daily") {
+      const days = Math.max(1, Math.min(14, parseInt(p.days, 10) || 7));
+      return jsonOutput(dailySummary(thing, recent, days));
+    }
+    const hours = Math.max(1, Math.min(RECENT_HOURS_MAX, parseInt(p.hours, 10) || 24));
+    return jsonOutput({ thing: thing, fields: RECENT_FIELDS, hours: recent.slice(-hours) });
+
+  } catch (err) {
+    // Without this, Apps Script answers with an HTML error page the clients cannot parse
+    Logger.log("Error processing GET request: " + err.toString() + "\nStack: " + err.stack);
+    return jsonOutput({ error: "Error processing request: " + err.toString() });
+  }
+}
+
+/**
+ * @param {Object} obj Response object.
+ * @return {ContentService.TextOutput} Compact JSON output.
+ */
+function jsonOutput(obj) {
+  return ContentService.createTextOutput(JSON.stringify(obj))
+                       .setMimeType(ContentService.MimeType.JSON);
+}
+
+/**
+ * Normalizes a timestamp cell (Date from the sheet, or the device's ISO string)
+ * to "yyyy-MM-ddTHH:mm:ss" in the script time zone.
+ */
+function toLocalIso(v) {
+  if (!v) return null;
+  if (v instanceof Date) return Utilities.formatDate(v, Session.getScriptTimeZone(), "yyyy-MM-dd'T'HH:mm:ss");
+  return String(v).slice(0, 19);
+}
+
+/**
+ * Picks RECENT_FIELDS out of a full sheet row.
+ * @param {Array} row Values in ROW_KEYS order.
+ * @return {Array} Compact record.
+ */
+function toRecentRecord(row) {
+  return RECENT_FIELDS.map(function (key, i) {
+    const v = row[ROW_KEYS.indexOf(key)];
+    if (i === 0) return toLocalIso(v);
+    return (v === "" || v === undefined) ? null : v;
+  });
+}
+
+/**
+ * Reads the newest RECENT_HOURS_MAX rows of a device tab (one Sheets call).
+ * Older tabs may have fewer than ROW_KEYS.length columns; the missing ones read as null.
+ */
+function loadRecentFromSheet(sheet) {
+  const last = sheet.getLastRow();
+  const first = Math.max(2, last - RECENT_HOURS_MAX + 1);  // row 1 is the header
+  if (last < first) return [];
+  const width = Math.min(ROW_KEYS.length, sheet.getLastColumn());
+  return sheet.getRange(first, 1, last - first + 1, width).getValues().map(toRecentRecord);
+}
+
+/**
+ * Appends newly written rows to a device's cached recent list. On a cache miss
+ * the list is rebuilt from the sheet, which already holds the new rows.
+ * @param {string} thing Device tab name.
+ * @param {Array} rows Rows just written (ROW_KEYS order).
+ * @param {Sheet} sheet The device tab.
+ */
+function updateRecentCache(thing, rows, sheet) {
+  const cache = CacheService.getScriptCache();
+  const cached = cache.get(RECENT_CACHE_PREFIX + thing);
+  let recent;
+  if (cached) {
+    recent = JSON.parse(cached).concat(rows.map(toRecentRecord));
+  } else {
+    SpreadsheetApp.flush();
+    recent = loadRecentFromSheet(sheet);
+  }
+  putRecent(cache, thing, recent);
+}
+
+/**
+ * Stores the newest RECENT_HOURS_MAX records, trimming further to fit the
+ * 100 KB CacheService value limit.
+ */
+function putRecent(cache, thing, recent) {
+  recent = recent.slice(-RECENT_HOURS_MAX);
+  let json = JSON.stringify(recent);
+  while (json.length > 100000 && recent.length > 1) {
+    recent = recent.slice(Math.ceil(recent.length / 4));
+    json = JSON.stringify(recent);
+  }
+  cache.put(RECENT_CACHE_PREFIX + thing, json, RECENT_CACHE_SECONDS);
+}
+
+/**
+ * Cached recent records of a device, rebuilt from its tab on a miss.
+ * @return {Array|null} Records, or null if the tab does not exist.
+ */
+function getRecentRows(thing) {
+  const cache = CacheService.getScriptCache();
+  const cached = cache.get(RECENT_CACHE_PREFIX + thing);
+  if (cached) return JSON.parse(cached);
+  const sheet = SpreadsheetApp.openById(SPREADSHEET_ID).getSheetByName(thing);
+  if (!sheet) return null;
+  const recent = loadRecentFromSheet(sheet);
+  putRecent(cache, thing, recent);
+  return recent;
+}
+
+/**
+ * Per-day summary of the cached hourly records: hour count, ammonia mean/max,
+ * temperature and humidity means, lowest tank volume, pump seconds and flush liters.
+ */
+function dailySummary(thing, recent, days) {
+  const col = {};
+  RECENT_FIELDS.forEach(function (k, i) { col[k] = i; });
+  const byDay = {};
+  const order = [];
+  recent.forEach(function (r) {
+    if (!r[0]) return;
+    const day = r[0].slice(0, 10);
+    let d = byDay[day];
+    if (!d) {
+      d = byDay[day] = { n: 0, nh3: [0, 0], nh3Max: null, temp: [0, 0], hum: [0, 0], tankMin: null, pump: 0, liters: 0 };
+      order.push(day);
+    }
+    d.n++;
+    const nh3 = r[col.ammonia], t = r[col.temperature], h = r[col.humidity], tank = r[col.storageTank];
+    if (typeof nh3 === "number") { d.nh3[0] += nh3; d.nh3[1]++; d.nh3Max = d.nh3Max === null ? nh3 : Math.max(d.nh3Max, nh3); }
+    if (typeof t === "number") { d.temp[0] += t; d.temp[1]++; }
+    if (typeof h === "number") { d.hum[0] += h; d.hum[1]++; }
+    if (typeof tank === "number") d.tankMin = d.tankMin === null ? tank : Math.min(d.tankMin, tank);
+    if (typeof r[col.pumpDuration] === "number") d.pump += r[col.pumpDuration];
+    if (typeof r[col.flushLiters] === "number") d.liters += r[col.flushLiters];
+  });
+  const mean = function (a) { return a[1] ? Math.round(a[0] / a[1] * 10) / 10 : null; };
+  return {
+    thing: thing,
+    fields: ["date", "hours", "ammoniaMean", "ammoniaMax", "temperatureMean", "humidityMean",
+             "storageTankMin", "pumpSeconds", "flushLiters"],
+    days: order.slice(-days).map(function (day) {
+      const d = byDay[day];
+      return [day, d.n, mean(d.nh3), d.nh3Max, mean(d.temp), mean(d.hum), d.tankMin, d.pump,
+              Math.round(d.liters * 10) / 10];
+    })
+  };
+}
+
+/**
+ * Run once from the editor: installs the 1-minute drainIngestQueue trigger
+ * (replacing any previous one).
+ */
+function installIngestTrigger() {
+  ScriptApp.getProjectTriggers().forEach(function (t) {
+    if (t.getHandlerFunction() === "drainIngestQueue") ScriptApp.deleteTrigger(t);
+  });
+  ScriptApp.newTrigger("drainIngestQueue").timeBased().everyMinutes(1).create();
+  Logger.log("drainIngestQueue trigger installed.");
+}
+
 // Optional: A simple function to test deployment and permissions from the Apps Script editor
 function testScript() {
   const ss = SpreadsheetApp.openById(SPREADSHEET_ID);
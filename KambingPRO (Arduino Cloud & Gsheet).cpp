@@ -13,14 +13,34 @@
 #include <ArduinoHttpClient.h>
 #include <ArduinoJson.h>
 #include <math.h>            // For M_PI in volume calculation
+#include <tuple>             // Compile-time sensor registry
+#include <atomic>            // Seqlock-published sensor snapshot
+#include <Preferences.h>     // NVS storage for relay schedules
+#include <LittleFS.h>        // On-flash rollup rings
+#include <WebServer.h>       // Local read API
+#include <unistd.h>          // truncate() for torn-write recovery
+#include "KambingPRO_LogFormat.h" // Columnar log block layout, shared with tools/
+#include "KambingPRO_BoardProfiles.h" // Per-barn pins, tank and calibration (BOARD)
+#include "KambingPRO_Gzip.h"     // Upload payload compression
+#include "KambingPRO_Delta.h"    // OTA delta patches, shared with tools/kpdelta
+#include "KambingPRO_Trace.h"    // Event trace dump format, shared with tools/kptrace2json
+#include <Update.h>              // Writes the inactive OTA partition
+#include <esp_ota_ops.h>         // Running partition, rollback state
+#include <esp_task_wdt.h>        // Task watchdog
+#include <esp_system.h>          // esp_reset_reason()
+#include <soc/gpio_struct.h>     // GPIO registers, for the watchdog ISR's relay cut-off
+#include <stdarg.h>              // consolePrintf
 
 // ==== Project Configuration ====
-const char* THING_UID_NAME = "RAB001"; // Unique identifier for this device
+constexpr const char* THING_UID_NAME = BOARD.thingName; // Unique identifier for this device
 
 // ---- Google Apps Script Webhook ----
-const char* GOOGLE_SHEET_WEBHOOK_URL = "https://script.google.com/macros/s/AKfycbxaygP3nPks_jBGWjEhmRce7UESrxxHb1cGK65Nhnxpc4L663tCWeSaVKkdExZya0oc/exec";
+const char* GOOGLE_SCRIPT_PATH       = "/macros/s/AKfycbxaygP3nPks_jBGWjEhmRce7UESrxxHb1cGK65Nhnxpc4L663tCWeSaVKkdExZya0oc/exec";
 const char* GOOGLE_SCRIPT_HOST       = "script.google.com";
 const int   GOOGLE_SCRIPT_PORT       = 443;  // HTTPS
+// doPost runs before /exec answers 302 to this host; the redirect target only
+// echoes the script's reply, so it is fetched only to verify.
+const char* GOOGLE_ECHO_HOST         = "script.googleusercontent.com";
 
 // ---- NTP Configuration ----
 const long  GMT_OFFSET_SECONDS       = 8L * 3600L; // GMT+8
@@ -32,61 +52,916 @@ const unsigned long NTP_SYNC_INTERVAL_MS = 12UL * 3600UL * 1000UL; // every 12 h
 const int NTP_SYNC_MAX_TRIES         = 20;
 const int NTP_SYNC_RETRY_DELAY_MS    = 500;
 
-// ---- Hardware Pin Definitions (New Setup) ----
-const int RELAY_PUMP_PIN     = 5;
-const int RELAY_AUX_PIN      = 25;
-const int RELAY_CCTV_PIN     = 33;
-const int RELAY_SIREN_PIN    = 32;
+// ---- Hardware Pin Definitions (from the board profile) ----
+constexpr int RELAY_PUMP_PIN      = BOARD.relayPumpPin;
+constexpr int RELAY_AUX_PIN       = BOARD.relayAuxPin;
+constexpr int RELAY_CCTV_PIN      = BOARD.relayCctvPin;
+constexpr int RELAY_SIREN_PIN     = BOARD.relaySirenPin;
 
-const int DHT_SENSOR_PIN     = 15;
-const int ULTRASONIC_TRIG_PIN = 13;
-const int ULTRASONIC_ECHO_PIN = 14;
-const int MQ137_ANALOG_PIN   = 34;   // ESP32 ADC1 pin
+constexpr int DHT_SENSOR_PIN      = BOARD.dhtPin;
+constexpr int ULTRASONIC_TRIG_PIN = BOARD.ultrasonicTrigPin;
+constexpr int ULTRASONIC_ECHO_PIN = BOARD.ultrasonicEchoPin;
+constexpr int MQ137_ANALOG_PIN    = BOARD.mq137Pin;
 
 // ---- Sensor Specifics ----
-#define DHT_SENSOR_TYPE DHT22
-const float MQ137_LOAD_RESISTOR_KOHM = 22.0f;
+constexpr uint8_t DHT_SENSOR_TYPE          = BOARD.dhtType;
 const float ADC_VOLTAGE_REFERENCE    = 3.3f;
 const float ADC_MAX_VALUE            = 4095.0f;
-const float MQ137_AMMONIA_OFFSET_PPM = 7.0f;
-const float MQ137_AMMONIA_SCALING_DIV= 10.0f;
 
-const unsigned long ULTRASONIC_TIMEOUT_US = 30000UL; // 30 ms ≈ 5 m
-const float SPEED_OF_SOUND_CM_PER_US = 0.0343f;
+constexpr unsigned long ULTRASONIC_TIMEOUT_US = 30000UL; // 30 ms ≈ 5 m
+constexpr float SPEED_OF_SOUND_CM_PER_US = 0.0343f;
 
 // ---- Tank Geometry (Frustum of a Cone) ----
-const float TANK_HEIGHT_CM           = 38.0f;
-const float TANK_RADIUS_TOP_CM       = 18.5f;
-const float TANK_RADIUS_BOTTOM_CM = 14.0f;
-const float TANK_MAX_VOLUME_LITERS = (M_PI * TANK_HEIGHT_CM / 3.0f) *
-                                     (pow(TANK_RADIUS_TOP_CM, 2) + TANK_RADIUS_TOP_CM * TANK_RADIUS_BOTTOM_CM + pow(TANK_RADIUS_BOTTOM_CM, 2)) / 1000.0f;
+constexpr float TANK_HEIGHT_CM        = BOARD.tank.heightCm;
+constexpr float TANK_RADIUS_TOP_CM    = BOARD.tank.radiusTopCm;
+constexpr float TANK_RADIUS_BOTTOM_CM = BOARD.tank.radiusBottomCm;
+constexpr float TANK_MAX_VOLUME_LITERS = frustumVolumeLiters(BOARD.tank, TANK_HEIGHT_CM);
+
+// Height → volume lookup, built by the compiler and kept in flash; the
+// ultrasonic path interpolates it instead of evaluating the cone formula.
+constexpr float TANK_TABLE_STEP_CM = 0.5f;
+constexpr int   TANK_TABLE_SIZE    = (int)(TANK_HEIGHT_CM / TANK_TABLE_STEP_CM) + 2;
+constexpr auto  TANK_VOLUME_TABLE  = tankVolumeTable<TANK_TABLE_SIZE>(BOARD.tank, TANK_TABLE_STEP_CM);
+
+struct TankModel {
+  float        heightCm;
+  float        stepCm;
+  const float* table;       // volume at i × stepCm, liters
+  int          tableSize;
+};
+constexpr TankModel PRIMARY_TANK = { TANK_HEIGHT_CM, TANK_TABLE_STEP_CM, TANK_VOLUME_TABLE.data(), TANK_TABLE_SIZE };
+
+// ---- Board Profile Validation ----
+constexpr int BOARD_PINS[] = {
+  RELAY_PUMP_PIN, RELAY_AUX_PIN, RELAY_CCTV_PIN, RELAY_SIREN_PIN,
+  DHT_SENSOR_PIN, ULTRASONIC_TRIG_PIN, ULTRASONIC_ECHO_PIN, MQ137_ANALOG_PIN
+};
+
+static_assert(pinsDistinct(BOARD_PINS), "Board profile: two functions share a GPIO");
+static_assert(isAdc1Pin(MQ137_ANALOG_PIN), "Board profile: MQ-137 must be on ADC1 (GPIO 32-39); ADC2 is unavailable with WiFi");
+static_assert(isValidOutputPin(RELAY_PUMP_PIN) && isValidOutputPin(RELAY_AUX_PIN) &&
+              isValidOutputPin(RELAY_CCTV_PIN) && isValidOutputPin(RELAY_SIREN_PIN),
+              "Board profile: relay pins must be output-capable (not 6-11 flash, not 34-39 input-only)");
+static_assert(isValidOutputPin(ULTRASONIC_TRIG_PIN) && isValidOutputPin(DHT_SENSOR_PIN),
+              "Board profile: ultrasonic trigger and DHT data pins must be output-capable");
+static_assert(!isFlashPin(ULTRASONIC_ECHO_PIN) && ULTRASONIC_ECHO_PIN >= 0 && ULTRASONIC_ECHO_PIN <= 39,
+              "Board profile: invalid ultrasonic echo pin");
+static_assert(DHT_SENSOR_TYPE == 11 || DHT_SENSOR_TYPE == 21 || DHT_SENSOR_TYPE == 22, "Board profile: unknown DHT type");
+static_assert(TANK_HEIGHT_CM > 0 && TANK_RADIUS_TOP_CM > 0 && TANK_RADIUS_BOTTOM_CM > 0, "Board profile: bad tank geometry");
+static_assert(ULTRASONIC_TIMEOUT_US * SPEED_OF_SOUND_CM_PER_US / 2.0f > TANK_HEIGHT_CM + 10.0f,
+              "Ultrasonic timeout too short for this tank");
+
+// ---- Tank Protection & Flow Estimation ----
+const float TANK_RESERVE_LITERS              = 5.0f;     // flushes are blocked/aborted below this volume
+const unsigned long ULTRASONIC_IDLE_PERIOD_MS = 2000UL;  // tank sampling period while pumps are idle
+const unsigned long ULTRASONIC_FAST_PERIOD_MS = 100UL;   // while pumping and settling
+const unsigned long TANK_SETTLE_MS           = 3000UL;   // let the surface settle before the "after" level
+const unsigned long REFILL_WINDOW_MS         = 5UL * 60UL * 1000UL; // level delta window for refill rate
+const float REFILL_MIN_RISE_LITERS           = 0.2f;     // ignore rises within ultrasonic noise
+const float REFILL_EWMA_ALPHA                = 0.3f;
+#define TANK_FILTER_SIZE 5                               // median window for level readings
+const unsigned long DHT_PERIOD_MS            = 2000UL;   // DHT22 needs ≥2 s between frames
+const int     MQ137_BURST_SAMPLES            = 8;        // ADC reads averaged per ammonia sample
+const unsigned long ACQ_MAX_WAIT_US          = ULTRASONIC_TIMEOUT_US + 5000UL; // bound on one acquisition cycle
+
+// ---- Predictive Flushing (Kalman trend over the ammonia stream) ----
+const bool  PREDICTIVE_FLUSH_ENABLED      = true;
+const float AMMONIA_FLUSH_THRESHOLD_PPM   = 25.0f;   // flush before the filtered level crosses this
+const float PREDICTIVE_FLUSH_LEAD_S       = 120.0f;  // act when the crossing is forecast within this time
+const unsigned long PREDICTIVE_MIN_GAP_MS = 10UL * 60UL * 1000UL; // give a flush time to take effect
+const float NH3_MEASUREMENT_VAR           = 0.5f;    // MQ-137 noise, ppm²
+const float NH3_LEVEL_PROCESS_VAR         = 0.01f;   // ppm² per second
+const float NH3_SLOPE_PROCESS_VAR         = 1e-7f;   // (ppm/s)² per second
+const float NH3_MIN_SLOPE_PPM_PER_S       = 1e-4f;   // ≈0.36 ppm/h, flatter trends are ignored
+
+// ---- Flush Efficacy Analytics & Pump Duration Auto-Tune ----
+const unsigned long FLUSH_EVENT_WINDOW_MS = 60UL * 60UL * 1000UL; // stop tracking recovery after 1 h
+const bool  PUMP_AUTO_TUNE_ENABLED        = true;
+const unsigned long PUMP_MIN_DURATION_MS  = 10000UL;
+const unsigned long PUMP_MAX_DURATION_MS  = 60000UL;
+const unsigned long PUMP_TUNE_STEP_MS     = 2000UL;
+const int   PUMP_TUNE_EVENTS              = 6;      // events averaged per tuning decision
+const float PUMP_TUNE_DROP_LOW            = 0.25f;  // mean relative NH3 drop below this → lengthen
+const float PUMP_TUNE_DROP_HIGH           = 0.60f;  // above this → shorten to save water
+const float PUMP_TUNE_MIN_BASELINE_PPM    = 3.0f;   // relative drop is meaningless near zero
+
+// Streaming quantile estimator (P² algorithm, Jain & Chlamtac 1985): five
+// markers track one quantile in constant memory without storing samples.
+struct P2Quantile {
+  float    p;
+  uint32_t count;
+  float    q[5];   // marker heights
+  int32_t  n[5];   // actual marker positions
+  float    np[5];  // desired marker positions
+  float    dn[5];  // desired position increments
+};
+
+// Welford running mean/variance.
+struct RunningStat {
+  uint32_t n;
+  float    mean;
+  float    m2;
+};
+
+// ---- Sensor Health Monitoring ----
+enum SensorChannel : uint8_t { SENSOR_TEMP, SENSOR_HUM, SENSOR_NH3, SENSOR_TANK, SENSOR_COUNT };
+
+enum SensorFault : uint8_t {
+  FAULT_MISSING = 1 << 0, // NaN / timeout streak
+  FAULT_STUCK   = 1 << 1, // identical value for too long
+  FAULT_RANGE   = 1 << 2, // outside physical range or ADC saturated
+  FAULT_NOISE   = 1 << 3, // sample-to-sample jitter too high
+  FAULT_SPIKE   = 1 << 4, // recent z-score spike against the EWMA baseline
+};
+const char* SENSOR_FAULT_NAMES[] = { "MISSING", "STUCK", "RANGE", "NOISE", "SPIKE" };
+
+// Per-channel detector limits; the valid raw range is set per reading by its sensor.
+// Detectors watch the raw value, so noiseLimit is in raw units, which for NH3
+// and the tank are not the units shown on the LCD.
+struct SensorHealthConfig {
+  const char*   unit;               // of the engineering value, for the LCD only
+  float         noiseLimit;         // max EWMA of |x[n] - x[n-1]| (raw units)
+  unsigned long stuckMs;            // unchanged value for this long → stuck
+};
+const SensorHealthConfig SENSOR_HEALTH_CONFIG[SENSOR_COUNT] = {
+  { "C",   1.0f,  30UL * 60UL * 1000UL },   // raw = °C
+  { "%",   3.0f,  30UL * 60UL * 1000UL },   // raw = %RH
+  { "ppm", 80.0f, 10UL * 60UL * 1000UL },   // raw = MQ-137 ADC counts (0..4095), not ppm
+  { "L",   2.0f,  6UL * 3600UL * 1000UL },  // raw = ultrasonic distance in cm, not liters
+};
+const int   HEALTH_MISSING_STREAK = 5;     // consecutive NaN/timeouts
+const float HEALTH_EWMA_ALPHA     = 0.05f;
+const float HEALTH_SPIKE_Z        = 4.0f;
+const int   HEALTH_WARMUP_SAMPLES = 30;    // no z-scores before the baseline settles
+const int   HEALTH_SPIKE_HOLD     = 20;    // samples a spike keeps FAULT_SPIKE raised
+
+struct SensorHealth {
+  float         last;
+  unsigned long lastChangeMillis;
+  uint16_t      missStreak;
+  uint16_t      spikeHold;
+  uint32_t      samples;
+  float         mean, var;     // EWMA baseline
+  float         jitter;        // EWMA of |x[n] - x[n-1]|
+  uint8_t       faults;        // SensorFault bits
+  uint8_t       score;         // 0 (dead) .. 100 (healthy)
+  uint8_t       hourMinScore;
+};
+
+// ---- Sensor Registry ----
+// Each physical sensor is one object in sensorRegistry (a std::tuple, so all
+// dispatch is resolved at compile time). Sensor types derive from
+// Sensor<Derived, N> and provide onBegin/onStart/onPoll/onPeriodMs; each owns N
+// readings. The first reading of every SensorChannel is its "primary" one and
+// drives the cloud variables and sheet columns; further readings (a second DHT,
+// a second tank) are reported under their label.
+struct SensorReading {
+  const char*   label;          // log/telemetry/LCD name, e.g. "t2"
+  SensorChannel channel;
+  float         minValid, maxValid; // raw range for the health check
+  float         raw;            // last raw value (NAN = failed read)
+  float         value;          // last good engineering value, NAN until the first
+  bool          fresh;          // the last completed cycle produced 'value'
+  float         hourSum;        // hourly mean of every reading
+  uint16_t      hourCount;
+  SensorHealth  health;
+};
+
+void  resetSensorHealth(SensorHealth& s);
+void  updateSensorHealth(SensorReading& r, float x, unsigned long nowMillis);
+float calculateWaterVolumeLiters(const TankModel& tank, float h_cm);
+float mq137RawToPpm(int raw, const Mq137Calibration& cal);
+
+template <typename Derived, int N>
+class Sensor {
+ public:
+  static constexpr int  READINGS = N;
+  static constexpr bool ASYNC    = false;  // true: start() returns at once and the
+                                           // hardware completes in the background
+  SensorReading readings[N];
+  unsigned long lastStartMillis = 0;
+  bool          started = false;   // at least one cycle was started
+  bool          busy    = false;   // started, result not collected yet
+  uint32_t      startUs = 0;
+  uint32_t      busyUs  = 0;       // start → completion of the last cycle
+
+  /** @brief One-time hardware setup. */
+  void begin() {
+    for (auto& r : readings) resetSensorHealth(r.health);
+    self().onBegin();
+  }
+  /** @brief Kicks off a measurement cycle. */
+  void start(unsigned long nowMillis) {
+    busy = true; started = true; lastStartMillis = nowMillis;
+    startUs = micros(); doneUs = 0;
+    self().onStart(nowMillis);
+    if (!Derived::ASYNC) busyUs = micros() - startUs;  // blocking work happened in onStart
+  }
+  /** @brief Advances a running cycle. @return true once, when results are ready. */
+  bool poll(unsigned long nowMillis) {
+    if (!busy || !self().onPoll(nowMillis)) return false;
+    busy = false;
+    if (Derived::ASYNC) busyUs = (doneUs ? doneUs : micros()) - startUs;
+    return true;
+  }
+  /** @brief True if a new cycle is due (period may shorten while flushing). */
+  bool due(unsigned long nowMillis, bool flushing) const {
+    return !busy && (!started || nowMillis - lastStartMillis >= self().onPeriodMs(flushing));
+  }
+  const SensorReading& result(int i) const { return readings[i]; }
+  /** @brief Lowest health score over this sensor's readings. */
+  uint8_t health() const {
+    uint8_t s = 100;
+    for (const auto& r : readings) if (r.health.score < s) s = r.health.score;
+    return s;
+  }
+
+ protected:
+  void define(int i, const char* label, SensorChannel ch, float minValid, float maxValid) {
+    SensorReading& r = readings[i];
+    memset(&r, 0, sizeof r);
+    r.label = label; r.channel = ch; r.minValid = minValid; r.maxValid = maxValid;
+    r.raw = NAN; r.value = NAN;
+  }
+  void publish(int i, float raw, float value, unsigned long nowMillis) {
+    SensorReading& r = readings[i];
+    r.raw = raw;
+    updateSensorHealth(r, raw, nowMillis);
+    r.fresh = !isnan(value);
+    if (r.fresh) r.value = value;
+  }
+  Derived&       self()       { return static_cast<Derived&>(*this); }
+  const Derived& self() const { return static_cast<const Derived&>(*this); }
+  uint32_t doneUs = 0;             // completion time if the hardware reports it
+};
+
+// DHT11/21/22: temperature + humidity from one frame.
+class DhtSensor : public Sensor<DhtSensor, 2> {
+ public:
+  DhtSensor(const char* tempLabel, const char* humLabel, uint8_t pin, uint8_t type) : dht(pin, type) {
+    define(0, tempLabel, SENSOR_TEMP, -40.0f, 80.0f);
+    define(1, humLabel,  SENSOR_HUM,    0.0f, 100.0f);
+  }
+  void onBegin() { dht.begin(); }
+  void onStart(unsigned long) { dht.read(); }  // ~5 ms frame capture; overlaps an ultrasonic ping in flight
+  bool onPoll(unsigned long nowMillis) {
+    float t = dht.readTemperature();           // decoded from the frame captured in onStart
+    float h = dht.readHumidity();
+    publish(0, t, t, nowMillis);
+    publish(1, h, h, nowMillis);
+    return true;
+  }
+  unsigned long onPeriodMs(bool) const { return DHT_PERIOD_MS; }
+ private:
+  DHT dht;
+};
+
+// MQ-137 on an ADC1 pin; health runs on raw counts, the reading is ppm.
+class Mq137Sensor : public Sensor<Mq137Sensor, 1> {
+ public:
+  Mq137Sensor(const char* label, uint8_t pin, const Mq137Calibration& cal) : pin(pin), cal(cal) {
+    define(0, label, SENSOR_NH3, 5.0f, 4090.0f);
+  }
+  void onBegin() {}
+  void onStart(unsigned long) {              // ADC burst, averaged against MQ heater ripple
+    uint32_t sum = 0;
+    for (int i = 0; i < MQ137_BURST_SAMPLES; i++) sum += analogRead(pin);
+    raw = (int)((sum + MQ137_BURST_SAMPLES / 2) / MQ137_BURST_SAMPLES);
+  }
+  bool onPoll(unsigned long nowMillis) {
+    publish(0, raw, mq137RawToPpm(raw, cal), nowMillis);
+    return true;
+  }
+  unsigned long onPeriodMs(bool) const { return 0; } // every loop, feeds the trend filter
+  /** @brief Curve constants in use; the serial console adjusts them in the field. */
+  Mq137Calibration& calibration() { return cal; }
+ private:
+  uint8_t          pin;
+  Mq137Calibration cal;
+  int              raw = 0;
+};
+
+// Ultrasonic level over a frustum tank; health runs on the echo distance, the
+// reading is the median-filtered volume in liters. The echo pulse is timed by
+// a GPIO interrupt instead of pulseIn(), so other sensors run while the ping
+// is in flight.
+class UltrasonicTankSensor : public Sensor<UltrasonicTankSensor, 1> {
+ public:
+  static constexpr bool ASYNC = true;
+
+  UltrasonicTankSensor(const char* label, uint8_t trigPin, uint8_t echoPin, const TankModel& tank)
+      : trigPin(trigPin), echoPin(echoPin), tank(tank) {
+    define(0, label, SENSOR_TANK, 2.0f, tank.heightCm + 10.0f);
+  }
+  void onBegin() {
+    pinMode(trigPin, OUTPUT);
+    digitalWrite(trigPin, LOW);
+    pinMode(echoPin, INPUT);
+    attachInterruptArg(echoPin, echoIsr, this, CHANGE);
+  }
+  void onStart(unsigned long) {
+    riseUs = 0; fallUs = 0; armed = true;
+    digitalWrite(trigPin, HIGH);
+    delayMicroseconds(10);
+    digitalWrite(trigPin, LOW);
+    pingUs = micros();
+  }
+  bool onPoll(unsigned long nowMillis) {
+    float dist_cm = NAN;
+    if (fallUs) {
+      dist_cm = (fallUs - riseUs) * SPEED_OF_SOUND_CM_PER_US / 2.0f;
+      doneUs  = fallUs;
+    } else if (micros() - pingUs < ULTRASONIC_TIMEOUT_US) {
+      return false;                            // echo still in flight
+    }
+    armed = false;
+    float liters  = NAN;
+    if (!isnan(dist_cm)) {
+      float water_h = constrain(tank.heightCm - dist_cm, 0.0f, tank.heightCm);
+      liters = pushMedian(calculateWaterVolumeLiters(tank, water_h));
+    }
+    publish(0, dist_cm, liters, nowMillis);
+    return true;
+  }
+  /** @brief Switches to another tank model (runtime geometry); the median window restarts. */
+  void setModel(const TankModel& m) {
+    tank = m;
+    readings[0].maxValid = m.heightCm + 10.0f;
+    windowCount = 0;
+    windowNext  = 0;
+  }
+  // Sampled fast while a flush runs or settles, and retried until the first echo.
+  unsigned long onPeriodMs(bool flushing) const {
+    return (flushing || isnan(readings[0].value)) ? ULTRASONIC_FAST_PERIOD_MS : ULTRASONIC_IDLE_PERIOD_MS;
+  }
+ private:
+  /** @brief Median of the last TANK_FILTER_SIZE volumes; rejects single-echo outliers from ripples. */
+  float pushMedian(float liters) {
+    window[windowNext] = liters;
+    windowNext = (windowNext + 1) % TANK_FILTER_SIZE;
+    if (windowCount < TANK_FILTER_SIZE) windowCount++;
+    float sorted[TANK_FILTER_SIZE];
+    for (int i = 0; i < windowCount; i++) {
+      float v = window[i]; int j = i;
+      while (j > 0 && sorted[j - 1] > v) { sorted[j] = sorted[j - 1]; j--; }
+      sorted[j] = v;
+    }
+    return sorted[windowCount / 2];
+  }
+  /** @brief Timestamps the echo edges while a ping is armed. */
+  static void IRAM_ATTR echoIsr(void* arg) {
+    UltrasonicTankSensor* s = static_cast<UltrasonicTankSensor*>(arg);
+    if (!s->armed) return;
+    uint32_t now = micros();
+    if (digitalRead(s->echoPin)) s->riseUs = now;
+    else if (s->riseUs && !s->fallUs) s->fallUs = now;
+  }
+  uint8_t   trigPin, echoPin;
+  TankModel tank;
+  uint32_t  pingUs = 0;
+  volatile uint32_t riseUs = 0, fallUs = 0;
+  volatile bool     armed  = false;
+  float     window[TANK_FILTER_SIZE];
+  int       windowCount = 0;
+  int       windowNext  = 0;
+};
+
+// Single-writer seqlock. The writer never blocks; a reader copies the payload
+// and retries if the sequence number shows a write overlapped the copy. The
+// payload is stored as relaxed atomic words so the copy is race-free C++.
+template <typename T>
+class Seqlock {
+ public:
+  /** @brief Publishes a new value (one writer only). */
+  void write(const T& v) {
+    uint32_t buf[WORDS] = {};
+    memcpy(buf, &v, sizeof(T));
+    uint32_t s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);           // odd: write in progress
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < WORDS; i++) words[i].store(buf[i], std::memory_order_relaxed);
+    seq.store(s + 2, std::memory_order_release);
+  }
+  /**
+   * @brief Returns a consistent copy. Lock-free; after a few collisions the
+   * reader sleeps a tick so a preempted writer on the same core can finish.
+   */
+  T read() const {
+    uint32_t buf[WORDS];
+    for (int attempt = 0; ; attempt++) {
+      uint32_t s1 = seq.load(std::memory_order_acquire);
+      for (size_t i = 0; i < WORDS; i++) buf[i] = words[i].load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint32_t s2 = seq.load(std::memory_order_relaxed);
+      if (!(s1 & 1) && s1 == s2) break;
+      if (attempt >= 8) delay(1);
+    }
+    T v;
+    memcpy(&v, buf, sizeof(T));
+    return v;
+  }
+  /** @brief Number of completed writes. */
+  uint32_t version() const { return seq.load(std::memory_order_acquire) / 2; }
+
+ private:
+  static constexpr size_t WORDS = (sizeof(T) + 3) / 4;
+  std::atomic<uint32_t> seq{0};
+  std::atomic<uint32_t> words[WORDS] = {};
+};
+
+// Consistent view of the primary sensor values, published once per
+// acquisition cycle. Readers (LCD, sampler, report builder, local API, cloud
+// variables) take a copy instead of reading state that is being rewritten.
+struct SensorSnapshot {
+  uint32_t takenMillis;
+  float    value[SENSOR_COUNT];      // last good value per channel, NAN until the first
+  float    nh3SlopePerHour;          // NAN until the trend filter is ready
+  uint32_t acqCycleUs;
+  uint8_t  staleMask;                // bit c: the latest read of channel c failed
+  uint8_t  health[SENSOR_COUNT];
+
+  /** @brief Value of the latest read, NAN if that read failed. */
+  float current(SensorChannel c) const { return (staleMask & (1 << c)) ? NAN : value[c]; }
+  bool  tankValid() const { return !isnan(value[SENSOR_TANK]); }
+};
+
+#define MAX_SENSOR_READINGS 16
+const unsigned long LCD_PAGE_MS = 4000UL;  // extra-reading pages rotate at this rate
 
 // ---- Data Sampling & Averaging ----
 #define MAX_HOURLY_SAMPLES 6  // 1 sample / 10 min → six per hour
-float hourlyAmmoniaSamples    [MAX_HOURLY_SAMPLES];
-float hourlyTemperatureSamples[MAX_HOURLY_SAMPLES];
-float hourlyHumiditySamples   [MAX_HOURLY_SAMPLES];
-float hourlyStorageTankSamples[MAX_HOURLY_SAMPLES];
-int   currentHourlySampleCount = 0;
+// Hourly p50/p90/p99 per metric, fed at the full loop rate so short ammonia
+// peaks between the 10-minute samples are not averaged away (~270 bytes per metric).
+enum HourlyMetric : uint8_t { METRIC_AMMONIA, METRIC_TEMPERATURE, METRIC_HUMIDITY, METRIC_STORAGE_TANK, METRIC_COUNT };
+const char* HOURLY_METRIC_KEYS[METRIC_COUNT] = { "ammonia", "temperature", "humidity", "storageTank" };
+struct MetricQuantiles {
+  P2Quantile p50, p90, p99;
+};
+
+// Everything accumulated over one clock hour. Two buffers: at the hour boundary
+// the open one becomes the closing buffer and the other starts empty, so
+// sampling never waits on the report.
+struct HourlyAggregate {
+  float           ammoniaSamples    [MAX_HOURLY_SAMPLES];
+  float           temperatureSamples[MAX_HOURLY_SAMPLES];
+  float           humiditySamples   [MAX_HOURLY_SAMPLES];
+  float           storageTankSamples[MAX_HOURLY_SAMPLES];
+  int             sampleCount;
+  MetricQuantiles quantiles[METRIC_COUNT];
+  unsigned long   pumpSeconds, sirenSeconds, cctvSeconds, auxSeconds; // relay ON time
+  float           flushLiters;
+  int             flushCount;
+  int             predictiveFlushCount;
+  int             flushEventCount;
+  int             flushUnrecoveredCount; // events whose NH3 did not return to baseline within the window
+  int             sensorFaultEvents;
+  uint32_t        acqCycles;            // acquisition cycle timing
+  uint64_t        acqCycleUs;
+  uint64_t        acqSerialUs;
+  uint32_t        acqMaxUs;
+  // Per-reading hour statistics, copied out of the registry when the hour closes
+  uint8_t         primaryHealth[SENSOR_COUNT];
+  float           extraMean[MAX_SENSOR_READINGS];   // NAN if no reading this hour
+  uint8_t         extraHealth[MAX_SENSOR_READINGS];
+};
+HourlyAggregate  hourlyBuffers[2];
+HourlyAggregate* hourly        = &hourlyBuffers[0]; // open hour, written by loop()
+HourlyAggregate* closingHourly = &hourlyBuffers[1]; // last closed hour
+
+// ---- Background Upload Queue ----
+// Closed hours are serialized into a small ring and POSTed by a separate task
+// on core 0. A slot is released only after Apps Script confirms it; failures
+// retry with backoff. When the ring is full the oldest report is dropped.
+#define UPLOAD_QUEUE_SLOTS 8
+const size_t        UPLOAD_PAYLOAD_MAX    = 2048;  // a post-crash report with extra sensors runs ~1.6 KB
+const unsigned long UPLOAD_RETRY_MIN_MS   = 30UL * 1000UL;
+const unsigned long UPLOAD_RETRY_MAX_MS   = 15UL * 60UL * 1000UL;
+const uint32_t      UPLOADER_STACK_BYTES  = 8192;
+const UBaseType_t   UPLOADER_PRIORITY     = 1;
+const BaseType_t    UPLOADER_CORE         = 0;   // loop() and Arduino Cloud run on core 1
+const int           UPLOAD_VERIFY_EVERY   = 24;  // follow the redirect for the first and every Nth upload
+const int           UPLOAD_DRAIN_MAX_BYTES = 2048; // larger or chunked bodies close the socket instead
+const unsigned long UPLOAD_DRAIN_TIMEOUT_MS = 2000;
+#define UPLOAD_LOCATION_MAX 512
+const int           UPLOAD_PREWARM_LEAD_S = 20;    // open DNS+TCP+TLS this long before the hourly report
+#define UPLOAD_BATCH_MAX 4                           // queued reports sent together as one JSON array
+const size_t        UPLOAD_BATCH_BYTES    = UPLOAD_BATCH_MAX * UPLOAD_PAYLOAD_MAX + 8;
+// Bodies at least this long are gzipped and sent base64-encoded (about where the
+// saving outweighs ~2 ms of compression); smaller ones, or ones that would not
+// shrink, go out as plain JSON.
+const size_t        UPLOAD_COMPRESS_MIN_BYTES = 1024;
+const char*         UPLOAD_GZIP_CONTENT_TYPE  = "application/x-kambingpro-gzip-base64";
+const unsigned long DNS_CACHE_TTL_MS      = 5UL * 60UL * 1000UL;
+// Once-only records a slot carries; their NVS "report" flag is cleared only
+// after the slot is confirmed, so eviction or a reboot cannot lose them.
+#define UPLOAD_CARRIES_CRASH 0x01
+#define UPLOAD_CARRIES_OTA   0x02
+struct UploadSlot {
+  uint32_t hourEpoch;                  // start of the reported hour, for logs
+  uint16_t length;
+  uint8_t  attempts;
+  uint8_t  carries;                    // UPLOAD_CARRIES_* bits
+  char     payload[UPLOAD_PAYLOAD_MAX];
+};
+
+// ---- Flush Planner (wall-clock aligned, multi-zone) ----
+// Zone 0 is the cloud-controlled storagePump relay. Extra zones are driven
+// only by the planner; add one line per additional pump relay.
+struct PumpZone {
+  const char* name;
+  int         relayPin;
+};
+constexpr PumpZone PUMP_ZONES[] = {
+  { "main", RELAY_PUMP_PIN },
+  // { "pen2", 26 },
+};
+constexpr int PUMP_ZONE_COUNT  = sizeof(PUMP_ZONES) / sizeof(PUMP_ZONES[0]);
+const int MAX_CONCURRENT_PUMPS = 1;   // protects water pressure and the 12 V supply
+#define MAX_FLUSH_SLOTS_PER_DAY 1440  // one slot per minute at most
+static_assert(PUMP_ZONES[0].relayPin == RELAY_PUMP_PIN, "Zone 0 must be the storagePump relay");
+static_assert(extraRelayPinsValid(PUMP_ZONES, BOARD_PINS), "Pump zone relay pins clash with the board profile or are not output-capable");
+static_assert(PUMP_ZONE_COUNT <= 32, "pendingZoneMask holds at most 32 zones");
+
+// Relay outputs per GPIO register bank, for the watchdog ISR (no digitalWrite there)
+DRAM_ATTR const uint32_t RELAY_GPIO_MASK_LO = relayBankMask(BOARD, PUMP_ZONES, 0);
+DRAM_ATTR const uint32_t RELAY_GPIO_MASK_HI = relayBankMask(BOARD, PUMP_ZONES, 1);
+
+uint16_t      flushPlan[MAX_FLUSH_SLOTS_PER_DAY]; // minute-of-day of each planned slot, ascending
+int           flushPlanLength   = 0;
+int           flushPlanCursor   = 0;   // next slot to fire
+int           flushPlanDay      = -1;  // tm_yday the plan was built for
+int           flushPlanInterval = 0;   // flushInterval the plan was built with
+uint32_t      pendingZoneMask   = 0;   // zones waiting for a free pump slot
+bool          zoneRunning[PUMP_ZONE_COUNT];
+unsigned long zoneOnMillis[PUMP_ZONE_COUNT];
+
+// ---- Rollup Pyramid (minute/hour/day rings on LittleFS) ----
+// Each level is a fixed-size ring file; the slot for a period is
+// (period index % capacity), so writes and range reads need no index.
+struct RollupLevel {
+  const char* path;
+  uint32_t    periodSeconds;
+  uint32_t    capacity;       // records kept
+};
+const RollupLevel ROLLUP_LEVELS[] = {
+  { "/rollup_min.bin",  60,    1440 },  // 1 day of minutes
+  { "/rollup_hour.bin", 3600,  2160 },  // 90 days of hours
+  { "/rollup_day.bin",  86400, 1000 },  // ~2.7 years of days
+};
+const int ROLLUP_LEVEL_COUNT = sizeof(ROLLUP_LEVELS) / sizeof(ROLLUP_LEVELS[0]);
+#define ROLLUP_STREAM_CHUNK 16      // ring slots read per pass by /api/rollups
+const int LOCAL_API_PORT     = 80;
+
+// ---- Relay Scheduler (cron-like entries, persisted in NVS) ----
+#define MAX_RELAY_SCHEDULES 16
+const char* RELAY_SCHEDULE_NVS_NAMESPACE = "relaysched";
+const long  CLOCK_STEP_REPLAN_THRESHOLD_S = 120; // wall-clock jump (e.g. NTP step) that forces a re-plan
+
+enum RelayId : uint8_t { RELAY_ID_PUMP, RELAY_ID_AUX, RELAY_ID_CCTV, RELAY_ID_SIREN, RELAY_ID_COUNT };
+const char* RELAY_NAMES[RELAY_ID_COUNT] = { "pump", "aux", "cctv", "siren" };
+
+// One cron entry. Each field is a bitmask so the next fire time is found with
+// a handful of bit scans instead of walking the calendar minute by minute.
+struct RelaySchedule {
+  uint64_t minuteMask; // bit n → minute n (0-59)
+  uint32_t hourMask;   // bit n → hour n (0-23)
+  uint8_t  dowMask;    // bit n → weekday n (0 = Sunday)
+  uint8_t  relay;      // RelayId
+  uint8_t  turnOn;     // 1 = switch ON, 0 = switch OFF
+  uint8_t  reserved;
+};
+
+// Min-heap node keyed by the precomputed next-fire epoch.
+struct RelayScheduleSlot {
+  time_t  nextFire;
+  uint8_t entry;       // index into relaySchedules[]
+};
+
+RelaySchedule     relaySchedules[MAX_RELAY_SCHEDULES];
+int               relayScheduleCount = 0;
+RelayScheduleSlot relayScheduleHeap[MAX_RELAY_SCHEDULES];
+int               relayScheduleHeapSize = 0;
+time_t            scheduleRefEpoch  = 0; // wall clock at the last plan/check, used to detect clock steps
+unsigned long     scheduleRefMillis = 0;
+
+// One rollup record (84 bytes). Higher levels are folded from the level below.
+struct RollupRecord {
+  uint32_t epoch;                   // period start, UTC seconds (0 = empty slot)
+  uint32_t count[METRIC_COUNT];     // readings folded in, per metric
+  float    mean[METRIC_COUNT];
+  float    min[METRIC_COUNT];
+  float    max[METRIC_COUNT];
+  uint32_t dutyMs[RELAY_ID_COUNT];  // relay ON time within the period
+};
+
+// Open period of one level; 'sum' becomes 'mean' when the period closes.
+struct RollupAccumulator {
+  uint32_t epoch;
+  uint32_t count[METRIC_COUNT];
+  float    sum[METRIC_COUNT];
+  float    min[METRIC_COUNT];
+  float    max[METRIC_COUNT];
+  uint32_t dutyMs[RELAY_ID_COUNT];
+};
+
+RollupAccumulator rollupAcc[ROLLUP_LEVEL_COUNT];
+bool              rollupStorageReady = false;
+unsigned long     rollupLastMillis   = 0;
+
+// ---- Columnar Flash Log (hourly blocks, see KambingPRO_LogFormat.h) ----
+const char*  KPLOG_PATH           = "/kplog.bin";
+const char*  KPLOG_INDEX_PATH     = "/kplog.idx";
+const char*  KPLOG_OLD_PATH       = "/kplog.old.bin";   // previous generation after rotation
+const char*  KPLOG_OLD_INDEX_PATH = "/kplog.old.idx";
+const char*  LITTLEFS_VFS_PREFIX  = "/littlefs";        // LittleFS mount point for POSIX calls
+const size_t KPLOG_MAX_BYTES      = 256UL * 1024UL;    // cap per generation, ~10 days
+const size_t KPLOG_FS_RESERVE_BYTES = 64UL * 1024UL;   // LittleFS metadata, index files, copy-on-write headroom
+const int    KPLOG_BOOT_CLOSE_MAX_HOURS = 24;          // minute ring span: older hours cannot be rebuilt
+
+int16_t  kplogColumns[KPLOG_COLUMN_COUNT][KPLOG_ROWS_PER_BLOCK]; // open block, column-major
+uint32_t kplogBlockEpoch  = 0;      // start of the open block, 0 = none
+uint32_t kplogLastEpoch   = 0;      // start of the last block on flash, 0 = none
+size_t   kplogGenerationBytes = KPLOG_MAX_BYTES; // rotation size, fitted to the partition at boot
+uint32_t kplogAppendOffset = 0;     // end of the last valid block
+uint32_t kplogIndexCount  = 0;
+bool     kplogReady       = false;
+
+// ---- Task Watchdog & Crash Records ----
+// loop(), the uploader and an OTA download are subscribed to the ESP-IDF task
+// watchdog. Each marks the stage it enters (markStage), which also feeds the
+// watchdog, so a single stage that hangs longer than WDT_TIMEOUT_S (pulseIn,
+// a DHT read, a TLS connect or POST) switches every relay off and reboots.
+// Stage markers and the loop's last CRASH_TRAIL_LEN stages live in RTC memory,
+// which survives the reset; setup() turns them into a crash record in NVS that
+// the next hourly report carries once.
+const uint32_t      WDT_TIMEOUT_S          = 30;
+const uint32_t      UPLOAD_RESPONSE_TIMEOUT_MS = 10000;  // HttpClient default is 30 s, too close to the watchdog
+const uint32_t      UPLOAD_TLS_HANDSHAKE_S = 10;
+const char*         CRASH_NVS_NAMESPACE    = "crash";
+const uint32_t      CRASH_TRAIL_MAGIC      = 0x4B505354;   // "TSPK": RTC trail written by this firmware
+#define CRASH_TRAIL_LEN 8
+
+enum WatchedTask : uint8_t { WATCH_LOOP, WATCH_UPLOADER, WATCH_OTA, WATCH_TASK_COUNT };
+const char* const WATCHED_TASK_NAMES[WATCH_TASK_COUNT] = { "loop", "uploader", "ota" };
+
+enum WatchStage : uint8_t {
+  STAGE_NONE, STAGE_CLOUD, STAGE_NTP, STAGE_SENSORS, STAGE_LCD, STAGE_SCHEDULES, STAGE_LOCAL_API,
+  STAGE_HOURLY, STAGE_FLUSH, STAGE_TANK, STAGE_IDLE,
+  STAGE_UP_WAIT, STAGE_UP_CONNECT, STAGE_UP_POST, STAGE_UP_VERIFY,
+  STAGE_OTA_MANIFEST, STAGE_OTA_WAIT_IDLE, STAGE_OTA_DOWNLOAD, STAGE_CONSOLE,  // append only: crash records store these
+  STAGE_COUNT
+};
+const char* const WATCH_STAGE_NAMES[STAGE_COUNT] = {
+  "none", "cloud", "ntp", "sensors", "lcd", "schedules", "localApi",
+  "hourly", "flush", "tank", "idle",
+  "upWait", "upConnect", "upPost", "upVerify",
+  "otaManifest", "otaWaitIdle", "otaDownload", "console"
+};
+
+// Last stage of each watched task, plus the loop's recent stages (RTC, not cleared on reset)
+struct WatchMark {
+  uint32_t pc;         // return address into the code that entered the stage
+  uint32_t ms;         // millis() at entry
+  uint8_t  stage;
+};
+struct CrashTrail {
+  uint32_t  magic;
+  WatchMark task[WATCH_TASK_COUNT];
+  WatchMark loopTrail[CRASH_TRAIL_LEN];
+  uint8_t   loopTrailHead;
+  int8_t    stalledTask;  // set by the watchdog handler, -1 = none
+};
+
+// Decoded on the next boot, kept in NVS until reported
+struct CrashRecord {
+  bool     pending;
+  char     reason[10];    // "taskWdt", "intWdt", "wdt", "panic", "brownout"
+  uint8_t  task;          // WatchedTask, WATCH_TASK_COUNT = unknown
+  uint8_t  stage;         // WatchStage of that task
+  uint32_t pc;
+  uint32_t uptimeS;
+  uint32_t count;         // abnormal resets since the NVS namespace was created
+  uint8_t  trailStage[CRASH_TRAIL_LEN];  // loop stages, oldest first
+  uint32_t trailPc[CRASH_TRAIL_LEN];
+};
+
+// ---- Event Trace ----
+// Stage changes (markStage), relay switching, cloud callbacks and upload results
+// go into a RAM ring of fixed-size events with microsecond timestamps. Dump it
+// from http://<device>/api/trace or over serial (console "trace") and convert
+// with tools/kptrace2json for chrome://tracing or ui.perfetto.dev. The serial
+// dump is ~33 KB of base64, 3 s at 115200 baud, so it goes out a few lines per
+// loop pass while recording is paused; /api/trace is the faster path.
+#define TRACE_EVENTS 2048    // 24 KB; at the normal loop rate ~35 s of history
+#define TRACE_SERIAL_LINES_PER_PASS 12   // ~80 ms of serial output per loop pass
+
+enum TraceEventId : uint16_t {
+  TRACE_EV_CLOUD_PUMP, TRACE_EV_CLOUD_SIREN, TRACE_EV_CLOUD_CCTV, TRACE_EV_CLOUD_AUX, TRACE_EV_CLOUD_INTERVAL,
+  TRACE_EV_FLUSH_QUEUED, TRACE_EV_HOURLY_QUEUED, TRACE_EV_UPLOAD_RESULT,
+  TRACE_EVENT_ID_COUNT
+};
+const char* const TRACE_EVENT_NAMES[TRACE_EVENT_ID_COUNT] = {
+  "cloud storagePump", "cloud siren", "cloud cCTV", "cloud auxilliarySocket", "cloud flushInterval",
+  "flush queued", "hourly report queued", "upload status"
+};
+
+// ---- Serial Console ----
+// Field diagnostics on the USB serial port (115200 baud, type "help"). Input is
+// read without blocking, at most CONSOLE_READ_BUDGET bytes per loop pass, split
+// in place and dispatched through CONSOLE_COMMANDS; nothing is allocated.
+#define CONSOLE_LINE_MAX    96
+#define CONSOLE_MAX_ARGS    9   // "sched add cctv on 0 19 * * *"
+#define CONSOLE_READ_BUDGET 64
+#define CONSOLE_OUT_MAX     192   // longest console line; Serial.printf would malloc above 64
+
+enum LogLevel : uint8_t { LOG_INFO, LOG_DEBUG };
+const char* const LOG_LEVEL_NAMES[] = { "info", "debug" };  // debug adds the per-loop status lines
+
+struct ConsoleCommand {
+  const char* name;
+  const char* usage;
+  void      (*run)(int argc, char** argv);
+};
+
+// ---- Runtime Parameters (NVS) ----
+// Tunables that used to need a reflash. Defaults are the constants above;
+// a changed value is saved in NVS and applied at once by its onChange hook,
+// which copies it into the variable the control code already reads, so hot
+// paths never touch NVS. Set from the serial console ("param"), the local API
+// (POST /api/params with key, value and token) or the Arduino Cloud String
+// variable parameterCommand ("key=value", "key=default" or "key").
+const char*     PARAM_NVS_NAMESPACE      = "params";
+const char*     PARAM_API_TOKEN          = "";       // shared secret for POST /api/params; empty = read-only API
+constexpr float TANK_PARAM_MAX_HEIGHT_CM = 200.0f;   // runtime tank table size; within ULTRASONIC_TIMEOUT_US range
+constexpr int   TANK_PARAM_TABLE_MAX     = (int)(TANK_PARAM_MAX_HEIGHT_CM / TANK_TABLE_STEP_CM) + 2;
+#define PARAM_REPLY_MAX 96
+
+enum ParamId : uint8_t {
+  PARAM_PUMP_ON_MS, PARAM_MQ_RL, PARAM_MQ_OFFSET, PARAM_MQ_DIV,
+  PARAM_TANK_HEIGHT, PARAM_TANK_R_TOP, PARAM_TANK_R_BOTTOM, PARAM_TANK_RESERVE,
+  PARAM_NTP_SYNC_H,
+  PARAM_COUNT
+};
+enum ParamType : uint8_t { PARAM_UINT, PARAM_FLOAT };
+union ParamValue { uint32_t u; float f; };
+
+struct ParamDef {
+  const char* key;          // NVS key and external name (max 15 characters)
+  ParamType   type;
+  float       minValue, maxValue;
+  ParamValue  defaultValue;
+  const char* unit;
+  void      (*onChange)();  // pushes the cached value into the code that uses it
+};
+
+// ---- Firmware & OTA Updates (A/B partitions, local update server) ----
+// The device polls a manifest on the barn LAN (see tools/kpdelta.cpp). If a
+// newer build is staged for it, it fetches a delta patch against the running
+// image when one is listed (else the full image) into the other OTA partition
+// and reboots. A new image must prove healthy within OTA_HEALTH_WINDOW_MS or it
+// is rolled back; a crash before that rolls back in the bootloader.
+const char*         FIRMWARE_VERSION      = "1.0.0";
+const uint32_t      FIRMWARE_BUILD        = 100;    // bump for every release; manifests compare builds
+const bool          OTA_ENABLED           = true;
+const char*         OTA_MANIFEST_HOST     = "192.168.1.10";
+const int           OTA_MANIFEST_PORT     = 8080;
+const char*         OTA_MANIFEST_PATH     = "/manifest.json";
+const char*         OTA_NVS_NAMESPACE     = "ota";
+const unsigned long OTA_FIRST_CHECK_MS    = 5UL * 60UL * 1000UL;
+const unsigned long OTA_CHECK_INTERVAL_MS = 6UL * 3600UL * 1000UL;
+const unsigned long OTA_HEALTH_WINDOW_MS  = 10UL * 60UL * 1000UL;
+const unsigned long OTA_HEALTH_SETTLE_MS  = 60UL * 1000UL;     // minimum uptime before a new image counts as healthy
+const unsigned long OTA_IDLE_WAIT_MS      = 15UL * 60UL * 1000UL; // longest wait for the pumps to stop
+const unsigned long OTA_IO_TIMEOUT_MS     = 15000;
+const uint32_t      OTA_STACK_BYTES       = 8192;
+#define OTA_CHUNK_BYTES  1024
+#define OTA_MANIFEST_MAX 2048
+
+// Outcome of the last update, persisted across the reboot and reported once
+struct OtaOutcome {
+  bool     pending;        // not yet sent in an hourly report
+  char     result[12];     // "ok", "unhealthy", "unconfirmed", "rolledBack", "failed", "staged" (not reported)
+  char     kind[6];        // "delta" or "full"
+  uint32_t fromBuild;
+  uint32_t toBuild;
+  uint32_t bytes;          // transferred
+  uint32_t ms;             // download + flash
+};
 
 // ---- Global Objects ----
 LiquidCrystal_I2C lcd(0x27, 16, 2);
-DHT dht(DHT_SENSOR_PIN, DHT_SENSOR_TYPE);
+
+// Sensors on this board. Add a line per extra sensor, e.g.
+//   DhtSensor("t2", "h2", 26, 22),
+//   UltrasonicTankSensor("tank2", 18, 19, PRIMARY_TANK),
+auto sensorRegistry = std::make_tuple(
+  DhtSensor("temperature", "humidity", DHT_SENSOR_PIN, DHT_SENSOR_TYPE),
+  Mq137Sensor("nh3", MQ137_ANALOG_PIN, BOARD.mq137),
+  UltrasonicTankSensor("tank", ULTRASONIC_TRIG_PIN, ULTRASONIC_ECHO_PIN, PRIMARY_TANK)
+);
+SensorReading* primaryReading[SENSOR_COUNT];        // first reading of each channel
+SensorReading* extraReadings[MAX_SENSOR_READINGS];  // all others, in registry order
+int            extraReadingCount = 0;
+Seqlock<SensorSnapshot> sensorSnapshot;              // written only by serviceSensors()
+
+// Runtime parameter cache (loop() only) and the state it feeds
+ParamValue    paramValues[PARAM_COUNT];
+float         tankReserveLiters = TANK_RESERVE_LITERS;
+unsigned long ntpSyncIntervalMs = NTP_SYNC_INTERVAL_MS;
+float         tankParamTable[TANK_PARAM_TABLE_MAX];   // used when the tank differs from the board profile
+
+// Serial console input, owned by loop()
+char          consoleLine[CONSOLE_LINE_MAX];
+int           consoleLength   = 0;
+bool          consoleOverflow = false;  // rest of an over-long line is discarded
+LogLevel      logLevel        = LOG_DEBUG;
+
+// Trace ring: slot i % TRACE_EVENTS holds event i
+KpTraceEvent          traceRing[TRACE_EVENTS];
+std::atomic<uint32_t> traceHead{0};
+std::atomic<bool>     traceFrozen{false};   // recording paused while a serial dump is running
+bool                  traceSerialActive = false;
+uint32_t              traceSerialHead   = 0;    // dump snapshot: events recorded and micros()
+uint32_t              traceSerialNowUs  = 0;
+size_t                traceSerialOffset = 0;    // dump bytes already printed
+size_t                traceSerialLength = 0;
+
+// Watchdog state
+RTC_NOINIT_ATTR CrashTrail crashTrail;
+bool              watchSubscribed[WATCH_TASK_COUNT];
+CrashRecord       crashRecord;               // loaded in setup, reported by queueHourlyReport
+portMUX_TYPE      crashMux = portMUX_INITIALIZER_UNLOCKED;
+
+// OTA state: otaHealthy is set by loop(), read by the OTA task
+bool              otaPendingVerify = false;  // this image booted from an OTA and is not yet confirmed
+std::atomic<bool> otaHealthy{false};
+TaskHandle_t      otaTask = nullptr;
+OtaOutcome        otaOutcome;                // loaded in setup, reported by queueHourlyReport
+portMUX_TYPE      otaMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Acquisition cycle timing: wall time of the overlapped cycle vs. the sum of
+// each sensor's busy time (what sequential reads would have taken).
+uint32_t acqLastCycleUs  = 0;
+uint32_t acqLastSerialUs = 0;
+
+// Upload ring shared by loop() (producer) and the uploader task (consumer)
+UploadSlot    uploadQueue[UPLOAD_QUEUE_SLOTS];
+int           uploadHead     = 0;       // oldest unconfirmed report
+int           uploadCount    = 0;
+bool          uploadInFlight = false;   // head is being sent; never dropped while set
+uint32_t      uploadsConfirmed = 0;
+uint32_t      uploadRetries    = 0;     // failed attempts since the last report
+uint32_t      uploadsDropped   = 0;     // since boot
+uint32_t      uploadsRejected  = 0;     // since boot: verified replies that were not "OK"
+uint32_t      uploadLastConnectMs = 0;  // DNS + TCP + TLS of the last opened connection
+uint32_t      uploadLastPostMs    = 0;  // request to status line of the last POST
+bool          uploadLastWarm      = false; // last POST went out on an already open socket
+uint32_t      uploadRawBytes      = 0;  // JSON bytes confirmed since the last report
+uint32_t      uploadSentBytes     = 0;  // bytes actually sent for them
+
+// Uploader-task buffers: the batched JSON (reused for the base64 text) and the gzip stream
+char          uploadBatch[UPLOAD_BATCH_BYTES];
+uint8_t       uploadGzip[UPLOAD_BATCH_BYTES];
+KpGzipWork    uploadGzipWork;
+
+// Webhook host address, owned by the uploader task
+IPAddress     uploadDnsIp;
+unsigned long uploadDnsMillis = 0;
+bool          uploadDnsValid  = false;
+portMUX_TYPE  uploadMux      = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t  uploaderTask   = nullptr;
+
+/**
+ * @brief Calls f(sensor) for every sensor in sensorRegistry (expanded at compile time).
+ */
+template <typename Fn>
+void forEachSensor(Fn&& f) {
+  std::apply([&](auto&... s) { (f(s), ...); }, sensorRegistry);
+}
+
+/**
+ * @brief Calls f(reading) for every reading of every sensor.
+ */
+template <typename Fn>
+void forEachReading(Fn&& f) {
+  forEachSensor([&](auto& s) { for (auto& r : s.readings) f(r); });
+}
 WiFiClientSecure clientSecure;
-HttpClient         googleSheetsClient = HttpClient(clientSecure, GOOGLE_SCRIPT_HOST, GOOGLE_SCRIPT_PORT);
+Preferences      prefs;
+WebServer        localApi(LOCAL_API_PORT);
+HttpClient         googleSheetsClient = HttpClient(clientSecure, GOOGLE_SCRIPT_HOST, GOOGLE_SCRIPT_PORT); // uploader task only
+WiFiClientSecure   echoClientSecure;
+HttpClient         googleEchoClient   = HttpClient(echoClientSecure, GOOGLE_ECHO_HOST, GOOGLE_SCRIPT_PORT);   // uploader task only
 
 // ---- Timing Variables ----
 unsigned long lastNtpSyncMillis      = 0;
 unsigned long lastSuccessfulSampleMillis = 0;
 unsigned long pumpTurnedOnMillis     = 0; // Timestamp when the pump was turned on (for auto-off duration)
 unsigned long lastAutoFlushMillis    = 0;
-const long    PUMP_ON_DURATION_MS    = 20000L; // 20 seconds
+const long    PUMP_ON_DURATION_MS    = 20000L; // 20 seconds (default; auto-tuned within bounds below)
+unsigned long pumpOnDurationMs       = PUMP_ON_DURATION_MS;
 
-// New variables for tracking relay ON durations
-unsigned long totalPumpOnSeconds = 0;
-unsigned long totalSirenOnSeconds = 0;
-unsigned long totalCCTVOnSeconds = 0;
-unsigned long totalAuxOnSeconds = 0; // For the auxiliary socket
+// Relay ON durations accumulate in hourly->pumpSeconds etc.
 
 // Variables to store the millis() timestamp when a relay last turned ON
 unsigned long pumpLastOnMillis = 0;
@@ -94,6 +969,45 @@ unsigned long sirenLastOnMillis = 0;
 unsigned long cctvLastOnMillis = 0;
 unsigned long auxLastOnMillis = 0; // For the auxiliary socket
 
+// Per-flush flow estimation (tank level comes from sensorSnapshot)
+
+bool          flushSessionActive   = false; // any pump ran since the last completed estimate
+bool          flushSessionSettling = false;
+float         flushStartLiters     = NAN;
+unsigned long flushStartMillis     = 0;
+unsigned long flushEndMillis       = 0;
+float         lastFlushLiters      = NAN;
+float         lastFlushLpm         = NAN;   // delivery rate of the last flush
+float         refillLpm            = NAN;   // EWMA of the tank refill rate while idle
+float         refillWindowLiters   = NAN;
+unsigned long refillWindowMillis   = 0;
+
+unsigned long lastPredictiveFlushMillis = 0; // last forecast trigger, 0 = none since boot
+
+// Ammonia trend filter: state [level ppm, slope ppm/s] with 2x2 covariance
+bool          nh3TrendReady   = false;
+float         nh3TrendLevel   = 0;
+float         nh3TrendSlope   = 0;
+float         nh3P00 = 0, nh3P01 = 0, nh3P11 = 0;
+unsigned long nh3TrendMillis  = 0;
+
+// Flush event being observed, and per-event statistics since boot
+bool          flushEventActive   = false;
+unsigned long flushEventMillis   = 0;
+float         flushEventBaseline = NAN; // filtered NH3 at pump start
+float         flushEventMin      = NAN; // lowest filtered NH3 after pump start
+float         flushEventLiters   = NAN;
+RunningStat   flushDropStat;            // ppm
+RunningStat   flushRecoverStat;         // minutes
+RunningStat   flushLitersStat;          // liters
+P2Quantile    flushDropPctP50;
+P2Quantile    flushRecoverP50;
+P2Quantile    flushRecoverP90;
+float         tuneDropSum   = 0;
+int           tuneDropCount = 0;
+
+// Sensor health: detectors live in each SensorReading, fault counts in hourly
+
 // prevStoragePumpState is no longer needed as logic is moved to callback
 // bool prevStoragePumpState = false;
 
@@ -106,16 +1020,22 @@ void setup() {
   while (!Serial && millis() < 3000); // wait for USB-CDC
   Serial.println("\n\nKambingPRO ESP32 booting…");
 
-  // --- Relays ---
-  pinMode(RELAY_PUMP_PIN,  OUTPUT); digitalWrite(RELAY_PUMP_PIN,  LOW);
-  pinMode(RELAY_AUX_PIN,   OUTPUT); digitalWrite(RELAY_AUX_PIN,   LOW);
-  pinMode(RELAY_CCTV_PIN,  OUTPUT); digitalWrite(RELAY_CCTV_PIN,  LOW);
-  pinMode(RELAY_SIREN_PIN, OUTPUT); digitalWrite(RELAY_SIREN_PIN, LOW);
+  // --- Relays (level latched before the pin becomes an output, so active-LOW boards don't click on) ---
+  relayWrite(RELAY_PUMP_PIN,  false); pinMode(RELAY_PUMP_PIN,  OUTPUT);
+  relayWrite(RELAY_AUX_PIN,   false); pinMode(RELAY_AUX_PIN,   OUTPUT);
+  relayWrite(RELAY_CCTV_PIN,  false); pinMode(RELAY_CCTV_PIN,  OUTPUT);
+  relayWrite(RELAY_SIREN_PIN, false); pinMode(RELAY_SIREN_PIN, OUTPUT);
+  for (int z = 1; z < PUMP_ZONE_COUNT; z++) { relayWrite(PUMP_ZONES[z].relayPin, false); pinMode(PUMP_ZONES[z].relayPin, OUTPUT); }
 
-  // --- Sensors ---
-  pinMode(ULTRASONIC_TRIG_PIN, OUTPUT);
-  pinMode(ULTRASONIC_ECHO_PIN, INPUT);
-  dht.begin();
+  // --- Watchdog: record why the last boot ended, arm the task watchdog ---
+  initWatchdog();
+
+  // --- OTA: rollback state and health supervision (starts before anything that can hang) ---
+  initOta();
+
+  // --- Sensors, with tunables from NVS ---
+  beginSensors();
+  loadParams();
 
   // --- LCD ---
   lcd.init(); lcd.backlight();
@@ -133,8 +1053,30 @@ void setup() {
   // --- Time sync ---
   synchronizeNTPTime();
 
-  // --- Clear sample buffers ---
-  clearHourlySampleArrays();
+  // --- Relay schedules ---
+  loadRelaySchedules();
+  planRelaySchedules();
+  applyScheduledRelayStates();  // no-op until the clock is set; serviceRelaySchedules() repeats it then
+
+  // --- Flush analytics ---
+  p2Init(flushDropPctP50, 0.5f);
+  p2Init(flushRecoverP50, 0.5f);
+  p2Init(flushRecoverP90, 0.9f);
+
+  // --- Rollup storage & local API ---
+  initRollupStorage();
+  recoverColumnarLog();
+  localApi.on("/api/rollups", HTTP_GET, handleRollupsRequest);
+  localApi.on("/api/log", HTTP_GET, handleLogDownload);
+  localApi.on("/api/snapshot", HTTP_GET, handleSnapshotRequest);
+  localApi.on("/api/trace", HTTP_GET, handleTraceRequest);
+  localApi.on("/api/params", HTTP_GET, handleParamsRequest);
+  localApi.on("/api/params", HTTP_POST, handleParamsRequest);
+  localApi.begin();
+
+  // --- Hourly aggregation & background upload ---
+  resetHourlyAggregate(*hourly);
+  startUploader();
   
   // --- Initialize auto-flush timer ---
   lastAutoFlushMillis = millis(); 
@@ -143,6 +1085,9 @@ void setup() {
   lcd.clear(); lcd.print(THING_UID_NAME); lcd.setCursor(0,1); lcd.print("System Ready");
   Serial.println("Setup complete. System is running.");
 
+  // --- Watchdog from here on: the first cloud connect above may legitimately take minutes ---
+  watchdogSubscribe(WATCH_LOOP);
+
   // prevStoragePumpState is no longer needed
   // prevStoragePumpState = storagePump;
 }
@@ -151,58 +1096,78 @@ void setup() {
 //                      LOOP
 // ===================================================================================
 void loop() {
+  markStage(WATCH_LOOP, STAGE_CLOUD);
   ArduinoCloud.update();
   unsigned long nowMillis = millis();
 
   // Calculate intervalMillis here to use in the debug print
   unsigned long intervalMillis = (unsigned long)flushInterval * 60UL * 1000UL;
 
-  Serial.printf("\n[Loop] Time: %lu | LastFlush: %lu | Interval: %d (%lu ms) | Diff: %lu | PumpCloud: %s | PumpPhysical: %s | PumpAutoOffTimer: %lu | PumpLastOn: %lu\n",
-                  nowMillis, lastAutoFlushMillis, flushInterval, intervalMillis, (nowMillis - lastAutoFlushMillis), storagePump ? "ON" : "OFF", (digitalRead(RELAY_PUMP_PIN) == HIGH ? "ON" : "OFF"), pumpTurnedOnMillis, pumpLastOnMillis);
-  Serial.printf("[Loop] PumpDur: %lu s | SirenDur: %lu s | CCTV_Dur: %lu s | AuxDur: %lu s\n",
-                  totalPumpOnSeconds, totalSirenOnSeconds, totalCCTVOnSeconds, totalAuxOnSeconds);
+  int nextSlot = flushPlanCursor < flushPlanLength ? flushPlan[flushPlanCursor] : -1;
+  if (logLevel >= LOG_DEBUG) {
+    char next[8];
+    if (nextSlot < 0) snprintf(next, sizeof next, "--:--");
+    else              snprintf(next, sizeof next, "%02d:%02d", nextSlot / 60, nextSlot % 60);
+    Serial.printf("\n[Loop] Time: %lu | LastFlush: %lu | Interval: %d (%lu ms) | NextSlot: %s | PumpCloud: %s | PumpPhysical: %s | PumpAutoOffTimer: %lu | PumpLastOn: %lu\n",
+                    nowMillis, lastAutoFlushMillis, flushInterval, intervalMillis, next, storagePump ? "ON" : "OFF", (relayIsOn(RELAY_PUMP_PIN) ? "ON" : "OFF"), pumpTurnedOnMillis, pumpLastOnMillis);
+    Serial.printf("[Loop] PumpDur: %lu s | SirenDur: %lu s | CCTV_Dur: %lu s | AuxDur: %lu s\n",
+                    hourly->pumpSeconds, hourly->sirenSeconds, hourly->cctvSeconds, hourly->auxSeconds);
+    Serial.printf("[Loop] Acquisition: %lu us (sequential would be %lu us)\n", (unsigned long)acqLastCycleUs, (unsigned long)acqLastSerialUs);
+  }
 
 
   // NTP resync every 12 h
-  if (nowMillis - lastNtpSyncMillis > NTP_SYNC_INTERVAL_MS || lastNtpSyncMillis == 0) {
+  if (nowMillis - lastNtpSyncMillis > ntpSyncIntervalMs || lastNtpSyncMillis == 0) {
+    markStage(WATCH_LOOP, STAGE_NTP);
     synchronizeNTPTime();
     lastNtpSyncMillis = nowMillis;
   }
 
   // ---------- Sensor reads ----------
-  float t = dht.readTemperature();
-  float h = dht.readHumidity();
-  if (!isnan(t)) temperature = t;
-  if (!isnan(h)) humidity    = h;
-
-  int   mqRaw   = analogRead(MQ137_ANALOG_PIN);
-  float mqVolt  = mqRaw * (ADC_VOLTAGE_REFERENCE / ADC_MAX_VALUE);
-  float rs_kOhm = mqVolt > 0.001f ? (ADC_VOLTAGE_REFERENCE - mqVolt) * MQ137_LOAD_RESISTOR_KOHM / mqVolt : 1e5f;
-  ammonia = max(0.0f, MQ137_AMMONIA_OFFSET_PPM + (-rs_kOhm / MQ137_AMMONIA_SCALING_DIV));
-
-  float dist_cm = measureDistanceCM(ULTRASONIC_TRIG_PIN, ULTRASONIC_ECHO_PIN);
-  if (!isnan(dist_cm)) {
-    float water_h = constrain(TANK_HEIGHT_CM - dist_cm, 0.0f, TANK_HEIGHT_CM);
-    storageTank = calculateWaterVolumeLiters(water_h);
-  }
+  // Each sensor runs on its own period; the tank is sampled fast while a flush
+  // is running or settling so the before/after levels and the reserve cut-off
+  // are taken from fresh data.
+  markStage(WATCH_LOOP, STAGE_SENSORS);
+  serviceSensors(nowMillis);
+  const SensorSnapshot snap = sensorSnapshot.read();
+  float t = snap.current(SENSOR_TEMP);
+  float h = snap.current(SENSOR_HUM);
+  float nh3  = snap.value[SENSOR_NH3];
+  float tank = snap.value[SENSOR_TANK];
 
   // LCD Update
-  lcd.setCursor(0,0); lcd.printf("T:%.1fC H:%2.0f%%", temperature, humidity);
-  lcd.setCursor(0,1); lcd.printf("NH3:%.1f S:%5.1fL", ammonia, storageTank);
+  markStage(WATCH_LOOP, STAGE_LCD);
+  updateLcd(nowMillis, snap);
+
+  // A freshly updated image confirms itself once it is demonstrably working
+  serviceOtaHealth(nowMillis, snap);
 
   // ---------- Timed sampling (every 10 min, on the minute) ----------
   time_t epoch = time(nullptr);
   struct tm tmNow; localtime_r(&epoch, &tmNow);
 
+  // ---------- Scheduled relay switching ----------
+  markStage(WATCH_LOOP, STAGE_SCHEDULES);
+  serviceRelaySchedules(epoch, nowMillis);
+
+  // ---------- Minute/hour/day rollups and local API ----------
+  addRollupSample(epoch, nowMillis, t, h, nh3, tank);
+  markStage(WATCH_LOOP, STAGE_LOCAL_API);
+  localApi.handleClient();
+
+  // ---------- Serial console (never waits for input) ----------
+  markStage(WATCH_LOOP, STAGE_CONSOLE);
+  serviceConsole();
+
   if (tmNow.tm_min % 10 == 0 && tmNow.tm_sec == 0 && (nowMillis - lastSuccessfulSampleMillis > 1000)) {
-    if (currentHourlySampleCount < MAX_HOURLY_SAMPLES &&
-        t > -40 && t < 80 && h >= 0 && h <= 100 && ammonia >= 0 && storageTank >= 0) {
-      hourlyTemperatureSamples[currentHourlySampleCount] = t;
-      hourlyHumiditySamples   [currentHourlySampleCount] = h;
-      hourlyAmmoniaSamples    [currentHourlySampleCount] = ammonia;
-      hourlyStorageTankSamples[currentHourlySampleCount] = storageTank;
-      currentHourlySampleCount++;
-      Serial.printf("Sample %d stored (%02d:%02d)\n", currentHourlySampleCount, tmNow.tm_hour, tmNow.tm_min);
+    if (hourly->sampleCount < MAX_HOURLY_SAMPLES &&
+        t > -40 && t < 80 && h >= 0 && h <= 100 && nh3 >= 0 && tank >= 0) {
+      hourly->temperatureSamples[hourly->sampleCount] = t;
+      hourly->humiditySamples   [hourly->sampleCount] = h;
+      hourly->ammoniaSamples    [hourly->sampleCount] = nh3;
+      hourly->storageTankSamples[hourly->sampleCount] = tank;
+      hourly->sampleCount++;
+      Serial.printf("Sample %d stored (%02d:%02d)\n", hourly->sampleCount, tmNow.tm_hour, tmNow.tm_min);
     }
     lastSuccessfulSampleMillis = nowMillis;
   }
@@ -210,109 +1175,82 @@ void loop() {
   // ---------- Hourly report to Google Sheet ----------
   if (tmNow.tm_min == 0 && tmNow.tm_sec == 0) {
     static int lastHour = -1;
-    if (tmNow.tm_hour != lastHour && currentHourlySampleCount > 0) {
-      Serial.printf("[Hourly Report] Sending data for %02d:00\n", tmNow.tm_hour);
+    if (tmNow.tm_hour != lastHour && hourly->sampleCount > 0) {
+      markStage(WATCH_LOOP, STAGE_HOURLY);
+      Serial.printf("[Hourly Report] Closing hour, report for %02d:00\n", tmNow.tm_hour);
 
       // --- Before reporting, add any ongoing durations to the total ---
       if (storagePump && pumpLastOnMillis != 0) { // If pump is currently ON
-          totalPumpOnSeconds += (nowMillis - pumpLastOnMillis) / 1000;
+          hourly->pumpSeconds += (nowMillis - pumpLastOnMillis) / 1000;
           pumpLastOnMillis = nowMillis; // Reset start time for the next hour
           Serial.printf("[Hourly Report] Pump was ON at hour change, added %lu s. New start time: %lu\n", (nowMillis - pumpLastOnMillis) / 1000, pumpLastOnMillis);
       }
       if (siren && sirenLastOnMillis != 0) { // If siren is currently ON
-          totalSirenOnSeconds += (nowMillis - sirenLastOnMillis) / 1000;
+          hourly->sirenSeconds += (nowMillis - sirenLastOnMillis) / 1000;
           sirenLastOnMillis = nowMillis; // Reset start time for the next hour
           Serial.printf("[Hourly Report] Siren was ON at hour change, added %lu s. New start time: %lu\n", (nowMillis - sirenLastOnMillis) / 1000, sirenLastOnMillis);
       }
       if (cCTV && cctvLastOnMillis != 0) { // If CCTV is currently ON
-          totalCCTVOnSeconds += (nowMillis - cctvLastOnMillis) / 1000;
+          hourly->cctvSeconds += (nowMillis - cctvLastOnMillis) / 1000;
           cctvLastOnMillis = nowMillis; // Reset start time for the next hour
           Serial.printf("[Hourly Report] CCTV was ON at hour change, added %lu s. New start time: %lu\n", (nowMillis - cctvLastOnMillis) / 1000, cctvLastOnMillis);
       }
       if (auxilliarySocket && auxLastOnMillis != 0) { // If Aux is currently ON
-          totalAuxOnSeconds += (nowMillis - auxLastOnMillis) / 1000;
+          hourly->auxSeconds += (nowMillis - auxLastOnMillis) / 1000;
           auxLastOnMillis = nowMillis; // Reset start time for the next hour
           Serial.printf("[Hourly Report] Aux was ON at hour change, added %lu s. New start time: %lu\n", (nowMillis - auxLastOnMillis) / 1000, auxLastOnMillis);
       }
 
-      // Calculate averages of collected samples.
-      float aTemp = averageArray(hourlyTemperatureSamples, currentHourlySampleCount);
-      float aHum  = averageArray(hourlyHumiditySamples,     currentHourlySampleCount);
-      float aNH3  = averageArray(hourlyAmmoniaSamples,      currentHourlySampleCount);
-      float aTank = averageArray(hourlyStorageTankSamples, currentHourlySampleCount);
-      
-      StaticJsonDocument<512> doc;
-      doc["thing"]           = THING_UID_NAME;
-      char iso[25]; strftime(iso, sizeof iso, "%Y-%m-%dT%H:00:00", &tmNow); doc["timestamp"] = iso;
-      if (!isnan(aNH3 )) doc["ammonia"]     = round(aNH3  * 10) / 10.0f;
-      if (!isnan(aTemp)) doc["temperature"] = round(aTemp * 10) / 10.0f;
-      if (!isnan(aHum )) doc["humidity"]    = round(aHum  * 10) / 10.0f;
-      if (!isnan(aTank)) doc["storageTank"] = round(aTank * 10) / 10.0f;
-      doc["flushInterval"]   = flushInterval;
-      // Add new duration fields
-      doc["pumpDuration"] = totalPumpOnSeconds;
-      doc["sirenDuration"] = totalSirenOnSeconds;
-      doc["cctvDuration"] = totalCCTVOnSeconds;
-      doc["auxDuration"] = totalAuxOnSeconds; // Add auxiliary socket duration
-
-      String out; serializeJson(doc, out);
-      Serial.printf("[Hourly Report] JSON Payload: %s\n", out.c_str());
-
-      if (WiFi.status() == WL_CONNECTED) {
-        clientSecure.setInsecure();
-        googleSheetsClient.post(String(GOOGLE_SHEET_WEBHOOK_URL), "application/json", out);
-        Serial.printf("Google Sheet POST status code: %d\n", googleSheetsClient.responseStatusCode());
-        Serial.printf("Google Sheet POST response: %s\n", googleSheetsClient.responseBody().c_str());
-      } else {
-        Serial.println("WiFi down – hourly report skipped");
-      }
-      clearHourlySampleArrays();
+      // Swap buffers first: the fresh hour starts accumulating before anything slow runs.
+      closeHourlyAggregate();
+      queueHourlyReport(*closingHourly, tmNow);
       lastHour = tmNow.tm_hour;
-
-      // --- Reset duration counters for the new hour ---
-      Serial.println("[Hourly Report] Resetting relay duration counters.");
-      totalPumpOnSeconds = 0;
-      totalSirenOnSeconds = 0;
-      totalCCTVOnSeconds = 0;
-      totalAuxOnSeconds = 0;
     }
   }
 
   // ---------- Automatic Flushing & Pump Control Logic ----------
   // 1. Automatic flush trigger: This code decides WHEN to flush.
-  if (flushInterval > 0 && !storagePump) {
-    // intervalMillis is already calculated above for the debug print
-    if (nowMillis - lastAutoFlushMillis >= intervalMillis) {
-      Serial.printf("TIMER: Auto-flush triggered by %d minute interval. Current millis: %lu\n", flushInterval, nowMillis);
-      // Directly perform the turn-on actions.
-      digitalWrite(RELAY_PUMP_PIN, HIGH);
-      // Use nowMillis for pumpTurnedOnMillis to ensure consistency
-      pumpTurnedOnMillis = nowMillis; // Start the 20-second auto-off timer
-      storagePump = true; // Update the cloud variable to reflect the new state.
-      Serial.printf("  >> ACTION: Relay ON. pumpTurnedOnMillis set to %lu. storagePump set to TRUE. Calling ArduinoCloud.update()\n", pumpTurnedOnMillis);
-      lastAutoFlushMillis = nowMillis; // Reset the timer for the next flush
-      ArduinoCloud.update(); // Immediately update Cloud to reflect pump status.
-
-      // Also record the start time for pump duration tracking
-      pumpLastOnMillis = nowMillis;
-      Serial.println("[AUTO-FLUSH] Pump ON, recording start time for duration tracking.");
+  //    Slots are aligned to the wall clock (e.g. :00/:30 for a 30 min interval).
+  //    Until NTP has set the clock, fall back to an interval measured from boot.
+  markStage(WATCH_LOOP, STAGE_FLUSH);
+  if (flushInterval > 0) {
+    if (epoch >= 946684800L) {
+      serviceFlushPlan(tmNow);
+    } else if (nowMillis - lastAutoFlushMillis >= intervalMillis) {
+      Serial.printf("TIMER: Auto-flush triggered by %d minute interval (clock not set). Current millis: %lu\n", flushInterval, nowMillis);
+      queueFlushAllZones();
+      lastAutoFlushMillis = nowMillis;
     }
   }
 
+  // 1a. Predictive flush: act shortly before the ammonia trend crosses the threshold.
+  //     The interval plan above still guarantees flushInterval as the maximum gap.
+  if (PREDICTIVE_FLUSH_ENABLED && flushInterval > 0) servicePredictiveFlush(nowMillis);
+
+  // 1b. Start queued zones while respecting MAX_CONCURRENT_PUMPS, stop finished extra zones.
+  serviceFlushZones(nowMillis);
+
   // 2. Automatic pump turn-off timer: This code decides WHEN to stop.
-  if (storagePump && (nowMillis - pumpTurnedOnMillis >= PUMP_ON_DURATION_MS)) {
-    Serial.printf("TIMER: Auto-off condition met! nowMillis: %lu, pumpTurnedOnMillis: %lu, Diff: %lu, PUMP_ON_DURATION_MS: %lu\n",
-                   nowMillis, pumpTurnedOnMillis, (nowMillis - pumpTurnedOnMillis), PUMP_ON_DURATION_MS);
-    digitalWrite(RELAY_PUMP_PIN, LOW);
+  if (storagePump && (nowMillis - pumpTurnedOnMillis >= pumpOnDurationMs)) {
+    Serial.printf("TIMER: Auto-off condition met! nowMillis: %lu, pumpTurnedOnMillis: %lu, Diff: %lu, pumpOnDurationMs: %lu\n",
+                   nowMillis, pumpTurnedOnMillis, (nowMillis - pumpTurnedOnMillis), pumpOnDurationMs);
+    relayWrite(RELAY_PUMP_PIN, false);
     storagePump = false; // Update the cloud variable.
     Serial.println("  >> ACTION: Relay OFF. storagePump set to FALSE. Calling ArduinoCloud.update()");
     ArduinoCloud.update(); // Immediately update Cloud to reflect pump status.
 
-    totalPumpOnSeconds += PUMP_ON_DURATION_MS / 1000;
+    hourly->pumpSeconds += pumpOnDurationMs / 1000;
     pumpLastOnMillis = 0; // Reset as pump is now off
-    Serial.printf("[AUTO-FLUSH] Added %lu seconds to total pump ON duration. Total: %lu s\n", PUMP_ON_DURATION_MS / 1000, totalPumpOnSeconds);
+    Serial.printf("[AUTO-FLUSH] Added %lu seconds to total pump ON duration. Total: %lu s\n", pumpOnDurationMs / 1000, hourly->pumpSeconds);
   }
 
+  // 3. Tank protection and flow estimation: abort below the reserve, measure liters per flush.
+  markStage(WATCH_LOOP, STAGE_TANK);
+  serviceTankMonitor(nowMillis);
+
+  // 4. Flush efficacy: follow the ammonia response until it recovers to the pre-flush baseline.
+  serviceFlushEvent(nowMillis);
+
   // --- Handle manual storagePump changes from Cloud Dashboard ---
   // This block ensures that if storagePump is changed from the dashboard,
   // the physical relay is updated and the auto-off timer is correctly started.
@@ -333,15 +1271,16 @@ void loop() {
   //     digitalWrite(RELAY_PUMP_PIN, LOW); // Turn physical pump OFF
   //     // Calculate and add duration if it was running
   //     if (pumpLastOnMillis != 0) {
-  //         totalPumpOnSeconds += (nowMillis - pumpLastOnMillis) / 1000;
-  //         Serial.printf("[Pump Control] Added %lu seconds to total pump ON duration. Total: %lu s\n", (nowMillis - pumpLastOnMillis) / 1000, totalPumpOnSeconds);
+  //         hourly->pumpSeconds += (nowMillis - pumpLastOnMillis) / 1000;
+  //         Serial.printf("[Pump Control] Added %lu seconds to total pump ON duration. Total: %lu s\n", (nowMillis - pumpLastOnMillis) / 1000, hourly->pumpSeconds);
   //         pumpLastOnMillis = 0; // Reset duration tracking
   //     }
   //     pumpTurnedOnMillis = 0; // Reset auto-off timer
   // }
 
 
-  delay(200);
+  markStage(WATCH_LOOP, STAGE_IDLE);
+  delay(flushSessionActive ? 50 : 200); // shorter tick keeps tank sampling dense during flushes
 }
 
 // ===================================================================================
@@ -363,164 +1302,3230 @@ void synchronizeNTPTime() {
 }
 
 /**
- * @brief Clears all hourly sample arrays and resets the sample count.
- * Fills arrays with NAN (Not A Number) to ensure valid averaging.
+ * @brief Empties an hourly aggregate: samples to NAN, counters to zero and
+ * fresh percentile sketches.
+ * @param a Buffer to reset.
  */
-void clearHourlySampleArrays() {
+void resetHourlyAggregate(HourlyAggregate& a) {
+  a = HourlyAggregate{};
   for (int i = 0; i < MAX_HOURLY_SAMPLES; i++) {
-    hourlyAmmoniaSamples     [i] = NAN;
-    hourlyTemperatureSamples[i] = NAN;
-    hourlyHumiditySamples   [i] = NAN;
-    hourlyStorageTankSamples[i] = NAN;
+    a.ammoniaSamples    [i] = NAN;
+    a.temperatureSamples[i] = NAN;
+    a.humiditySamples   [i] = NAN;
+    a.storageTankSamples[i] = NAN;
+  }
+  for (int m = 0; m < METRIC_COUNT; m++) {
+    p2Init(a.quantiles[m].p50, 0.50f);
+    p2Init(a.quantiles[m].p90, 0.90f);
+    p2Init(a.quantiles[m].p99, 0.99f);
   }
-  currentHourlySampleCount = 0;
-  Serial.println("Hourly sample arrays cleared.");
+  for (int i = 0; i < MAX_SENSOR_READINGS; i++) a.extraMean[i] = NAN;
 }
 
 /**
- * @brief Calculates the average of an array of floats, ignoring NAN values.
- * @param arr Pointer to the float array.
- * @param n Number of elements to consider in the array.
- * @return The average of valid (non-NAN) numbers, or NAN if no valid numbers.
+ * @brief Ends the hour: the open aggregate becomes closingHourly and the other
+ * buffer starts empty. Runs in loop(), the only writer, so no sample can land
+ * between the swap and the reset.
  */
-float averageArray(float* arr, int n) {
-  if (n == 0) return NAN;
-  float sum = 0; int valid_count = 0;
-  for (int i = 0; i < n; i++) {
-    if (!isnan(arr[i])) {
-      sum += arr[i];
-      valid_count++;
+void closeHourlyAggregate() {
+  for (int c = 0; c < SENSOR_COUNT; c++) {
+    if (primaryReading[c]) hourly->primaryHealth[c] = primaryReading[c]->health.hourMinScore;  // no sensor on the board
+  }
+  for (int i = 0; i < extraReadingCount; i++) {
+    const SensorReading& r = *extraReadings[i];
+    hourly->extraMean[i]   = r.hourCount > 0 ? r.hourSum / r.hourCount : NAN;
+    hourly->extraHealth[i] = r.health.hourMinScore;
+  }
+  std::swap(hourly, closingHourly);
+  resetHourlyAggregate(*hourly);
+  forEachReading([](SensorReading& r) { r.hourSum = 0; r.hourCount = 0; r.health.hourMinScore = r.health.score; });
+  Serial.println("[Hourly Report] Hour closed, new aggregate started.");
+}
+
+/**
+ * @brief Clears the NVS "report" flag of the crash record and/or OTA outcome
+ * once a report carrying them is confirmed. A record that became pending again
+ * meanwhile (a newer OTA outcome, or an evicted slot) keeps its flag.
+ * @param carries UPLOAD_CARRIES_* bits of the confirmed slots.
+ */
+void releaseReportedRecords(uint8_t carries) {
+  bool crashAgain, otaAgain;
+  portENTER_CRITICAL(&crashMux);
+  crashAgain = crashRecord.pending;
+  portEXIT_CRITICAL(&crashMux);
+  portENTER_CRITICAL(&otaMux);
+  otaAgain = otaOutcome.pending;
+  portEXIT_CRITICAL(&otaMux);
+  Preferences p;
+  if ((carries & UPLOAD_CARRIES_CRASH) && !crashAgain) {
+    p.begin(CRASH_NVS_NAMESPACE, false);
+    p.putUChar("report", 0);
+    p.end();
+  }
+  if ((carries & UPLOAD_CARRIES_OTA) && !otaAgain) {
+    p.begin(OTA_NVS_NAMESPACE, false);
+    p.putUChar("report", 0);
+    p.end();
+  }
+}
+
+/**
+ * @brief Serializes a closed hour and appends it to the upload ring. The
+ * uploader task sends it and releases the slot once Apps Script confirms.
+ * @param a Closed hourly aggregate.
+ * @param tmNow Local time at the hour boundary (the report timestamp).
+ */
+void queueHourlyReport(const HourlyAggregate& a, const struct tm& tmNow) {
+  float aTemp = averageArray(a.temperatureSamples, a.sampleCount);
+  float aHum  = averageArray(a.humiditySamples,     a.sampleCount);
+  float aNH3  = averageArray(a.ammoniaSamples,      a.sampleCount);
+  float aTank = averageArray(a.storageTankSamples, a.sampleCount);
+
+  static StaticJsonDocument<3072> doc;   // ~85 members plus copied strings; off the loop stack
+  doc.clear();
+  doc["thing"]           = THING_UID_NAME;
+  char iso[25]; strftime(iso, sizeof iso, "%Y-%m-%dT%H:00:00", &tmNow); doc["timestamp"] = iso;
+  if (!isnan(aNH3 )) doc["ammonia"]     = round(aNH3  * 10) / 10.0f;
+  if (!isnan(aTemp)) doc["temperature"] = round(aTemp * 10) / 10.0f;
+  if (!isnan(aHum )) doc["humidity"]    = round(aHum  * 10) / 10.0f;
+  if (!isnan(aTank)) doc["storageTank"] = round(aTank * 10) / 10.0f;
+  // Percentiles over every reading this hour, e.g. "ammoniaP90"
+  for (int m = 0; m < METRIC_COUNT; m++) {
+    char key[24];
+    const P2Quantile* qs[3] = { &a.quantiles[m].p50, &a.quantiles[m].p90, &a.quantiles[m].p99 };
+    const char* suffix[3]   = { "P50", "P90", "P99" };
+    for (int i = 0; i < 3; i++) {
+      float v = p2Value(*qs[i]);
+      if (isnan(v)) continue;
+      snprintf(key, sizeof key, "%s%s", HOURLY_METRIC_KEYS[m], suffix[i]);
+      doc[key] = round(v * 10) / 10.0f; // ArduinoJson copies non-const char* keys
     }
   }
-  return valid_count > 0 ? sum / valid_count : NAN;
+  doc["flushInterval"]   = flushInterval;
+  // Add new duration fields
+  doc["pumpDuration"] = a.pumpSeconds;
+  doc["sirenDuration"] = a.sirenSeconds;
+  doc["cctvDuration"] = a.cctvSeconds;
+  doc["auxDuration"] = a.auxSeconds; // Add auxiliary socket duration
+  // Flow estimates from tank level deltas
+  doc["flushCount"]  = a.flushCount;
+  doc["flushLiters"] = round(a.flushLiters * 10) / 10.0f;
+  if (!isnan(lastFlushLiters)) doc["lastFlushLiters"] = round(lastFlushLiters * 10) / 10.0f;
+  if (!isnan(lastFlushLpm))    doc["flowLpm"]         = round(lastFlushLpm * 10) / 10.0f;
+  if (!isnan(refillLpm))       doc["refillLpm"]       = round(refillLpm * 100) / 100.0f;
+  if (nh3TrendReady) doc["nh3SlopePerHour"] = round(nh3TrendSlope * 3600.0f * 100) / 100.0f;
+  doc["predictiveFlushes"] = a.predictiveFlushCount;
+  // Flush efficacy (events this hour; statistics since boot)
+  doc["flushEvents"]   = a.flushEventCount;
+  doc["pumpOnSeconds"] = pumpOnDurationMs / 1000;
+  doc["flushUnrecovered"] = a.flushUnrecoveredCount;
+  if (flushDropStat.n > 0) doc["flushDropMean"] = round(flushDropStat.mean * 10) / 10.0f;
+  if (flushRecoverP50.count > 0) {  // recovered events only
+    doc["flushRecoverMinP50"] = round(p2Value(flushRecoverP50) * 10) / 10.0f;
+    doc["flushRecoverMinP90"] = round(p2Value(flushRecoverP90) * 10) / 10.0f;
+  }
+  if (flushDropPctP50.count > 0) doc["flushDropPctP50"] = round(p2Value(flushDropPctP50) * 100);
+  if (flushLitersStat.n > 0)     doc["flushLitersMean"] = round(flushLitersStat.mean * 10) / 10.0f;
+  // Sensor health: lowest score this hour per sensor, and new faults raised
+  const char* const healthKeys[SENSOR_COUNT] = { "tempHealth", "humHealth", "nh3Health", "tankHealth" };
+  for (int c = 0; c < SENSOR_COUNT; c++) {
+    if (primaryReading[c]) doc[healthKeys[c]] = a.primaryHealth[c];  // blank cell when the channel has no sensor
+  }
+  doc["sensorFaults"] = a.sensorFaultEvents;
+  // Acquisition cycle timing this hour
+  if (a.acqCycles > 0) {
+    doc["acqMeanMs"] = round(a.acqCycleUs / (float)a.acqCycles / 100.0f) / 10.0f;
+    doc["acqMaxMs"]  = round(a.acqMaxUs / 100.0f) / 10.0f;
+    if (a.acqSerialUs > 0) doc["acqSavedPct"] = round(100.0f * (1.0f - (float)a.acqCycleUs / a.acqSerialUs));
+  }
+  // Extra sensors: "sensors": { "t2": [hourly mean, min health score], ... }
+  if (extraReadingCount > 0) {
+    JsonObject extra = doc.createNestedObject("sensors");
+    for (int i = 0; i < extraReadingCount; i++) {
+      JsonArray e = extra.createNestedArray(extraReadings[i]->label);
+      if (!isnan(a.extraMean[i])) e.add(round(a.extraMean[i] * 10) / 10.0f); else e.add(nullptr);
+      e.add(a.extraHealth[i]);
+    }
+  }
+
+  uint32_t backlog, retries, dropped, rejected, connectMs, postMs, rawBytes, sentBytes;
+  bool     warm;
+  portENTER_CRITICAL(&uploadMux);
+  backlog = uploadCount; retries = uploadRetries; dropped = uploadsDropped; rejected = uploadsRejected;
+  connectMs = uploadLastConnectMs; postMs = uploadLastPostMs; warm = uploadLastWarm;
+  rawBytes = uploadRawBytes; sentBytes = uploadSentBytes;
+  uploadRetries = 0; uploadRawBytes = 0; uploadSentBytes = 0;
+  portEXIT_CRITICAL(&uploadMux);
+  doc["uploadBacklog"] = backlog;   // reports still waiting when this hour closed
+  doc["uploadRetries"] = retries;   // failed POSTs since the previous report
+  doc["uploadDropped"] = dropped;   // since boot
+  doc["uploadRejected"] = rejected; // since boot, from verified uploads
+  if (postMs > 0) {                 // previous upload: handshake cost and POST round trip
+    doc["uploadConnectMs"] = connectMs;
+    doc["uploadPostMs"]    = postMs;
+    doc["uploadWarm"]      = warm;
+  }
+  if (rawBytes > 0) {               // uploads confirmed since the previous report
+    doc["uploadRawBytes"]   = rawBytes;
+    doc["uploadBytesSaved"] = (int32_t)(rawBytes - sentBytes);
+  }
+  // Abnormal resets, and the last crash record until a report carrying it is confirmed
+  CrashRecord crash;
+  portENTER_CRITICAL(&crashMux);
+  crash = crashRecord;
+  portEXIT_CRITICAL(&crashMux);
+  doc["crashCount"] = crash.count;
+  if (crash.pending) {
+    char trail[CRASH_TRAIL_LEN * 24];
+    int  n = 0;
+    for (int i = 0; i < CRASH_TRAIL_LEN; i++) {
+      if (crash.trailStage[i] == STAGE_NONE || crash.trailStage[i] >= STAGE_COUNT) continue;
+      n += snprintf(trail + n, sizeof trail - n, "%s%s@%08lx", n ? " " : "",
+                    WATCH_STAGE_NAMES[crash.trailStage[i]], (unsigned long)crash.trailPc[i]);
+      if (n >= (int)sizeof trail) break;
+    }
+    char pc[12];
+    snprintf(pc, sizeof pc, "%08lx", (unsigned long)crash.pc);
+    doc["crashReason"]  = crash.reason;
+    doc["crashTask"]    = crash.task < WATCH_TASK_COUNT ? WATCHED_TASK_NAMES[crash.task] : "?";
+    doc["crashStage"]   = crash.stage < STAGE_COUNT ? WATCH_STAGE_NAMES[crash.stage] : "?";
+    doc["crashPc"]      = pc;
+    doc["crashTrail"]   = trail;
+    doc["crashUptimeS"] = crash.uptimeS;
+  }
+  // Firmware build, and the last OTA outcome on the same terms
+  doc["fwBuild"] = FIRMWARE_BUILD;
+  OtaOutcome ota;
+  portENTER_CRITICAL(&otaMux);
+  ota = otaOutcome;
+  portEXIT_CRITICAL(&otaMux);
+  if (ota.pending) {
+    doc["otaResult"]    = ota.result;
+    doc["otaKind"]      = ota.kind;
+    doc["otaFromBuild"] = ota.fromBuild;
+    doc["otaToBuild"]   = ota.toBuild;
+    doc["otaBytes"]     = ota.bytes;
+    doc["otaMs"]        = ota.ms;
+  }
+  uint8_t carries = (crash.pending ? UPLOAD_CARRIES_CRASH : 0) | (ota.pending ? UPLOAD_CARRIES_OTA : 0);
+
+  static char payload[UPLOAD_PAYLOAD_MAX];
+  size_t len = measureJson(doc);
+  if (len >= UPLOAD_PAYLOAD_MAX) {
+    // Shed the bulkiest optional members so the crash and OTA fields still go out
+    doc.remove("crashTrail");
+    doc.remove("sensors");
+    len = measureJson(doc);
+    Serial.printf("[Hourly Report] Slot overflow, sent without crash trail and extra sensors (%u bytes)\n", (unsigned)len);
+  }
+  if (len >= UPLOAD_PAYLOAD_MAX) {
+    Serial.printf("[Hourly Report] Payload of %u bytes exceeds the upload slot, report dropped\n", (unsigned)len);
+    return;
+  }
+  serializeJson(doc, payload, sizeof payload);
+  if (logLevel >= LOG_DEBUG) Serial.printf("[Hourly Report] JSON Payload: %s\n", payload);
+
+  bool    queued  = true;
+  uint8_t evicted = 0;
+  portENTER_CRITICAL(&uploadMux);
+  if (uploadCount == UPLOAD_QUEUE_SLOTS) {
+    if (uploadInFlight) queued = false;                       // keep the report being sent
+    else {
+      evicted    = uploadQueue[uploadHead].carries;
+      uploadHead = (uploadHead + 1) % UPLOAD_QUEUE_SLOTS;
+      uploadCount--;
+    }
+    uploadsDropped++;
+  }
+  if (queued) {
+    UploadSlot& s = uploadQueue[(uploadHead + uploadCount) % UPLOAD_QUEUE_SLOTS];
+    memcpy(s.payload, payload, len + 1);
+    s.length    = (uint16_t)len;
+    s.attempts  = 0;
+    s.carries   = carries;
+    s.hourEpoch = (uint32_t)time(nullptr);
+    uploadCount++;
+  }
+  int pending = uploadCount;
+  portEXIT_CRITICAL(&uploadMux);
+  // The new slot carries the records now; an evicted one hands its records back
+  uint8_t handedOver = queued ? carries : 0;
+  portENTER_CRITICAL(&crashMux);
+  if (handedOver & UPLOAD_CARRIES_CRASH) crashRecord.pending = false;
+  if (evicted & UPLOAD_CARRIES_CRASH)    crashRecord.pending = true;
+  portEXIT_CRITICAL(&crashMux);
+  portENTER_CRITICAL(&otaMux);
+  if (handedOver & UPLOAD_CARRIES_OTA) otaOutcome.pending = false;
+  if (evicted & UPLOAD_CARRIES_OTA)    otaOutcome.pending = true;
+  portEXIT_CRITICAL(&otaMux);
+
+  Serial.printf("[Hourly Report] %s, %d report(s) pending upload\n", queued ? "Queued" : "Upload ring full, dropped", pending);
+  traceEvent(KPTRACE_INSTANT, WATCH_LOOP, TRACE_EV_HOURLY_QUEUED, queued ? (int32_t)len : -1);
+  if (uploaderTask) xTaskNotifyGive(uploaderTask);
 }
 
 /**
- * @brief Measures distance using an ultrasonic sensor.
- * @param trigPin The trigger pin of the ultrasonic sensor.
- * @param echoPin The echo pin of the ultrasonic sensor.
- * @return Distance in centimeters, or NAN if timeout occurs.
+ * @brief Resolves the webhook host, reusing the last answer for DNS_CACHE_TTL_MS.
+ * @param ip Receives the address.
+ * @return False if the lookup failed.
  */
-float measureDistanceCM(uint8_t trigPin, uint8_t echoPin) {
-  digitalWrite(trigPin, LOW);
-  delayMicroseconds(2);
-  digitalWrite(trigPin, HIGH);
-  delayMicroseconds(10);
-  digitalWrite(trigPin, LOW);
-  long duration_us = pulseIn(echoPin, HIGH, ULTRASONIC_TIMEOUT_US);
-  return duration_us > 0 ? duration_us * SPEED_OF_SOUND_CM_PER_US / 2.0f : NAN;
+bool resolveUploadHost(IPAddress& ip) {
+  if (uploadDnsValid && millis() - uploadDnsMillis < DNS_CACHE_TTL_MS) { ip = uploadDnsIp; return true; }
+  if (WiFi.hostByName(GOOGLE_SCRIPT_HOST, uploadDnsIp) != 1) { uploadDnsValid = false; return false; }
+  uploadDnsValid  = true;
+  uploadDnsMillis = millis();
+  ip = uploadDnsIp;
+  return true;
 }
 
 /**
- * @brief Calculates the water volume in liters for a frustum-shaped tank.
- * Based on the height of the water.
- * @param h_cm Water height in centimeters.
- * @return Water volume in liters.
+ * @brief Opens the TLS connection to the webhook host on clientSecure, using the
+ * cached address. googleSheetsClient keeps alive and reuses an open socket, so
+ * the next POST skips DNS, TCP and TLS.
+ * @return True if connected.
  */
-float calculateWaterVolumeLiters(float h_cm) {
-  h_cm = constrain(h_cm, 0.0f, TANK_HEIGHT_CM);
-  if (h_cm <= 0.0f) return 0.0f;
-  if (h_cm >= TANK_HEIGHT_CM) return TANK_MAX_VOLUME_LITERS;
-  float radius_at_h = TANK_RADIUS_BOTTOM_CM + (h_cm / TANK_HEIGHT_CM) * (TANK_RADIUS_TOP_CM - TANK_RADIUS_BOTTOM_CM);
-  float vol_cm3 = (M_PI * h_cm / 3.0f) * (pow(radius_at_h, 2) + radius_at_h * TANK_RADIUS_BOTTOM_CM + pow(TANK_RADIUS_BOTTOM_CM, 2));
-  return vol_cm3 / 1000.0f;
+bool openUploadConnection() {
+  IPAddress ip;
+  unsigned long t0 = millis();
+  markStage(WATCH_UPLOADER, STAGE_UP_CONNECT);
+  if (!resolveUploadHost(ip)) { Serial.println("[Uploader] DNS lookup failed"); return false; }
+  bool ok = clientSecure.connect(ip, GOOGLE_SCRIPT_PORT, GOOGLE_SCRIPT_HOST, nullptr, nullptr, nullptr) > 0;
+  uint32_t ms = millis() - t0;
+  if (!ok) {
+    uploadDnsValid = false;  // the address may have moved; resolve again next time
+    clientSecure.stop();
+    Serial.printf("[Uploader] Connect to %s failed after %lu ms\n", GOOGLE_SCRIPT_HOST, (unsigned long)ms);
+    return false;
+  }
+  portENTER_CRITICAL(&uploadMux);
+  uploadLastConnectMs = ms;
+  portEXIT_CRITICAL(&uploadMux);
+  Serial.printf("[Uploader] Connected to %s in %lu ms\n", GOOGLE_SCRIPT_HOST, (unsigned long)ms);
+  return true;
 }
 
-// ===================================================================================
-//          Cloud variable change callbacks
-// ===================================================================================
+/**
+ * @brief Opens the connection UPLOAD_PREWARM_LEAD_S before the next hourly
+ * report is due (reports close on the hour), once per hour.
+ */
+void servicePrewarm() {
+  static time_t warmedFor = 0;
+  time_t now = time(nullptr);
+  if (now < 946684800L) return;  // clock not set, no prediction
+  struct tm tmNow; localtime_r(&now, &tmNow);
+  time_t due = now + 3600 - (tmNow.tm_min * 60 + tmNow.tm_sec);
+  if (due - now > UPLOAD_PREWARM_LEAD_S || warmedFor == due) return;
+  warmedFor = due;
+  if (googleSheetsClient.connected()) return;
+  Serial.printf("[Uploader] Pre-warming connection %ld s before the hourly report\n", (long)(due - now));
+  openUploadConnection();
+}
 
 /**
- * @brief Callback function when the 'storagePump' variable changes in the Arduino Cloud.
- * Controls the pump relay and records when it was turned on by the cloud.
+ * @brief Reads and discards the rest of a response so the socket can carry the
+ * next request. Nothing is buffered beyond a small scratch array.
+ * @param c Client whose headers have been read.
+ * @param maxBytes Largest body worth draining.
+ * @return False if the body is chunked, unbounded, too large or timed out;
+ * the caller then closes the connection.
  */
-void onStoragePumpChange() {
-    unsigned long nowMillis = millis();
-    digitalWrite(RELAY_PUMP_PIN, storagePump ? HIGH : LOW); // Update physical relay immediately
+bool drainResponseBody(HttpClient& c, int maxBytes) {
+  if (c.isResponseChunked()) return false;
+  int remaining = c.contentLength();
+  if (remaining < 0 || remaining > maxBytes) return false;
+  uint8_t scratch[64];
+  unsigned long t0 = millis();
+  while (remaining > 0 && millis() - t0 < UPLOAD_DRAIN_TIMEOUT_MS) {
+    int n = c.read(scratch, min(remaining, (int)sizeof scratch));
+    if (n > 0) remaining -= n;
+    else if (!c.connected()) break;
+    else delay(1);
+  }
+  return remaining == 0;
+}
 
-    if (storagePump) { // Pump is turning ON via Cloud dashboard
-        pumpTurnedOnMillis = nowMillis; // Start the auto-off timer
-        pumpLastOnMillis = nowMillis; // Start duration tracking
-        Serial.printf("[Cloud Callback] Pump ON. pumpTurnedOnMillis set to %lu. pumpLastOnMillis set to %lu.\n", pumpTurnedOnMillis, pumpLastOnMillis);
-    } else { // Pump is turning OFF via Cloud dashboard
-        if (pumpLastOnMillis != 0) { // Only calculate duration if it was previously ON
-            totalPumpOnSeconds += (nowMillis - pumpLastOnMillis) / 1000;
-            Serial.printf("[Cloud Callback] Pump OFF. Added %lu seconds. Total: %lu s\n", (nowMillis - pumpLastOnMillis) / 1000, totalPumpOnSeconds);
-            pumpLastOnMillis = 0; // Reset start time for duration tracking
-        }
-        pumpTurnedOnMillis = 0; // Reset auto-off timer when pump goes off
+/**
+ * @brief Follows the Apps Script redirect and checks that doPost replied "OK".
+ * Only the first two bytes of the reply are read.
+ * @param location Location header of the 302.
+ * @return True if the script accepted the row.
+ */
+bool verifyScriptReply(const char* location) {
+  const char* path = strstr(location, GOOGLE_ECHO_HOST);
+  if (!path) return false;
+  path += strlen(GOOGLE_ECHO_HOST);
+  markStage(WATCH_UPLOADER, STAGE_UP_VERIFY);
+  echoClientSecure.setInsecure();
+  int status = googleEchoClient.get(path);
+  if (status == HTTP_SUCCESS) status = googleEchoClient.responseStatusCode();
+  char reply[3] = { 0 };
+  if (status == 200 && googleEchoClient.skipResponseHeaders() == HTTP_SUCCESS) {
+    unsigned long t0 = millis();
+    int n = 0;
+    while (n < 2 && millis() - t0 < UPLOAD_DRAIN_TIMEOUT_MS) {
+      int ch = googleEchoClient.read();
+      if (ch >= 0) reply[n++] = (char)ch;
+      else if (!googleEchoClient.connected()) break;
+      else delay(1);
     }
-    Serial.printf("[Cloud] StoragePump now %s\n", storagePump ? "ON" : "OFF");
+  }
+  googleEchoClient.stop();
+  bool ok = !strcmp(reply, "OK");
+  Serial.printf("[Uploader] Verified script reply: %s (status %d)\n", ok ? "OK" : "rejected", status);
+  return ok;
 }
 
 /**
- * @brief Callback function when the 'siren' variable changes in the Arduino Cloud.
- * Controls the siren relay and records its ON/OFF duration.
+ * @brief POSTs one report to the Apps Script webhook over a kept-alive
+ * connection. Delivery is decided from the status line and headers alone: a
+ * 302 to script.googleusercontent.com means doPost has run. Error pages come
+ * back as text/html without a redirect and count as failures. The body is
+ * drained, never stored.
+ * @param body Request body.
+ * @param len Body length.
+ * @param contentType "application/json" or UPLOAD_GZIP_CONTENT_TYPE.
+ * @param verify Also follow the redirect and check the script's reply.
+ * @param status Receives the HTTP status, or a negative ArduinoHttpClient error.
+ * @return True if the report was delivered.
  */
-void onSirenChange() {
-  unsigned long nowMillis = millis();
-  if (siren) { // Siren is turning ON
-    sirenLastOnMillis = nowMillis;
-    Serial.printf("[Cloud Callback] Siren ON at %lu ms\n", sirenLastOnMillis);
-  } else { // Siren is turning OFF
-    if (sirenLastOnMillis != 0) { // Only calculate if it was previously ON
-      totalSirenOnSeconds += (nowMillis - sirenLastOnMillis) / 1000;
-      Serial.printf("[Cloud Callback] Siren OFF. Added %lu seconds. Total: %lu s\n", (nowMillis - sirenLastOnMillis) / 1000, totalSirenOnSeconds);
-      sirenLastOnMillis = 0; // Reset start time
-    }
+bool postHourlyReport(const char* body, int len, const char* contentType, bool verify, int& status) {
+  static char location[UPLOAD_LOCATION_MAX];
+  bool reused = false;
+  unsigned long t0 = 0;
+  for (int attempt = 0; attempt < 2; attempt++) {  // the server may have closed an idle kept-alive socket
+    reused = googleSheetsClient.connected();
+    if (!reused) openUploadConnection();           // cached DNS; on failure HttpClient connects by name
+    markStage(WATCH_UPLOADER, STAGE_UP_POST);
+    t0 = millis();
+    googleSheetsClient.connectionKeepAlive();
+    status = googleSheetsClient.post(GOOGLE_SCRIPT_PATH, contentType, len, (const uint8_t*)body);
+    if (status == HTTP_SUCCESS) status = googleSheetsClient.responseStatusCode();
+    if (status > 0 || !reused) break;
+    googleSheetsClient.stop();
   }
-  digitalWrite(RELAY_SIREN_PIN, siren ? HIGH : LOW);
-  Serial.printf("[Cloud] Siren now %s\n", siren ? "ON" : "OFF");
+  portENTER_CRITICAL(&uploadMux);
+  uploadLastPostMs = millis() - t0;
+  uploadLastWarm   = reused;
+  portEXIT_CRITICAL(&uploadMux);
+  if (status <= 0) { googleSheetsClient.stop(); return false; }
+
+  location[0] = '\0';
+  bool html = false;
+  while (googleSheetsClient.headerAvailable()) {
+    String name  = googleSheetsClient.readHeaderName();
+    String value = googleSheetsClient.readHeaderValue();
+    if (!strcasecmp(name.c_str(), "Location"))          snprintf(location, sizeof location, "%s", value.c_str());
+    else if (!strcasecmp(name.c_str(), "Content-Type")) html = strstr(value.c_str(), "text/html") != nullptr;
+  }
+  if (!drainResponseBody(googleSheetsClient, UPLOAD_DRAIN_MAX_BYTES)) googleSheetsClient.stop();
+
+  bool redirected = (status == 302 || status == 303) && strstr(location, GOOGLE_ECHO_HOST) != nullptr;
+  bool delivered  = redirected || (status >= 200 && status < 300 && !html);
+  Serial.printf("[Uploader] POST status %d%s%s\n", status, redirected ? ", redirected to echo" : "", reused ? ", reused connection" : "");
+  if (delivered && redirected && verify && !verifyScriptReply(location)) {
+    portENTER_CRITICAL(&uploadMux);
+    uploadsRejected++;
+    portEXIT_CRITICAL(&uploadMux);
+  }
+  return delivered;
 }
 
 /**
- * @brief Callback function when the 'cctv' variable changes in the Arduino Cloud.
- * Controls the CCTV relay and records its ON/OFF duration.
+ * @brief Compresses the JSON in uploadBatch in place when it is long enough and
+ * actually gets shorter: gzip into uploadGzip, then base64 back into uploadBatch.
+ * @param len JSON length; replaced by the length to send.
+ * @return Content type of the body now in uploadBatch.
  */
-void onCCTVChange() {
-  unsigned long nowMillis = millis();
-  if (cCTV) { // CCTV is turning ON
-    cctvLastOnMillis = nowMillis;
-    Serial.printf("[Cloud Callback] CCTV ON at %lu ms\n", cctvLastOnMillis);
-  } else { // CCTV is turning OFF
-    if (cctvLastOnMillis != 0) { // Only calculate if it was previously ON
-      totalCCTVOnSeconds += (nowMillis - cctvLastOnMillis) / 1000;
-      Serial.printf("[Cloud Callback] CCTV OFF. Added %lu seconds. Total: %lu s\n", (nowMillis - cctvLastOnMillis) / 1000, totalCCTVOnSeconds);
-      cctvLastOnMillis = 0; // Reset start time
+const char* compressUploadBatch(int& len) {
+  if ((size_t)len < UPLOAD_COMPRESS_MIN_BYTES) return "application/json";
+  unsigned long t0 = micros();
+  size_t gz = kpGzip((const uint8_t*)uploadBatch, len, uploadGzip, sizeof uploadGzip, uploadGzipWork);
+  if (gz == 0 || kpBase64Length(gz) >= (size_t)len) return "application/json";
+  int sent = (int)kpBase64Encode(uploadGzip, gz, uploadBatch);  // shorter than the JSON, so it fits
+  Serial.printf("[Uploader] Compressed %d -> %d bytes in %lu us\n", len, sent, micros() - t0);
+  len = sent;
+  return UPLOAD_GZIP_CONTENT_TYPE;
+}
+
+/**
+ * @brief Uploader task: sends the oldest queued report whenever WiFi is up and
+ * the retry backoff has elapsed. Only a confirmed send (see postHourlyReport)
+ * releases the slot. A verified reply other than "OK" (e.g. a missing sheet tab)
+ * is counted but still releases it, since resending cannot fix it.
+ */
+void uploaderTaskMain(void*) {
+  unsigned long backoffMs      = 0;
+  unsigned long lastFailMillis = 0;
+  clientSecure.setInsecure();
+  clientSecure.setHandshakeTimeout(UPLOAD_TLS_HANDSHAKE_S);
+  echoClientSecure.setHandshakeTimeout(UPLOAD_TLS_HANDSHAKE_S);
+  googleSheetsClient.setHttpResponseTimeout(UPLOAD_RESPONSE_TIMEOUT_MS);
+  googleEchoClient.setHttpResponseTimeout(UPLOAD_RESPONSE_TIMEOUT_MS);
+  watchdogSubscribe(WATCH_UPLOADER);
+  for (;;) {
+    markStage(WATCH_UPLOADER, STAGE_UP_WAIT);
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+    if (backoffMs > 0 && millis() - lastFailMillis < backoffMs) continue;
+    if (WiFi.status() != WL_CONNECTED) continue;
+
+    // Up to UPLOAD_BATCH_MAX of the oldest reports: one object, or a JSON array of several
+    int      batched = 0;
+    int      len     = 0;
+    uint32_t hourEpoch = 0;
+    uint8_t  carries = 0;
+    portENTER_CRITICAL(&uploadMux);
+    batched = min(uploadCount, UPLOAD_BATCH_MAX);
+    if (batched > 1) uploadBatch[len++] = '[';
+    for (int k = 0; k < batched; k++) {
+      const UploadSlot& s = uploadQueue[(uploadHead + k) % UPLOAD_QUEUE_SLOTS];
+      if (k > 0) uploadBatch[len++] = ',';
+      memcpy(uploadBatch + len, s.payload, s.length);
+      len += s.length;
+      carries |= s.carries;
+      if (k == 0) hourEpoch = s.hourEpoch;
+    }
+    if (batched > 1) uploadBatch[len++] = ']';
+    uploadBatch[len] = '\0';
+    if (batched > 0) uploadInFlight = true;
+    portEXIT_CRITICAL(&uploadMux);
+    if (batched == 0) { servicePrewarm(); continue; }
+
+    unsigned long t0 = millis();
+    int  rawLen = len;
+    const char* contentType = compressUploadBatch(len);
+    int  status;
+    bool confirmed = postHourlyReport(uploadBatch, len, contentType, uploadsConfirmed % UPLOAD_VERIFY_EVERY == 0, status);
+    traceEvent(KPTRACE_INSTANT, WATCH_UPLOADER, TRACE_EV_UPLOAD_RESULT, status);
+
+    int pending;
+    portENTER_CRITICAL(&uploadMux);
+    uploadInFlight = false;
+    if (confirmed) {
+      uploadHead = (uploadHead + batched) % UPLOAD_QUEUE_SLOTS;
+      uploadCount -= batched;
+      uploadsConfirmed++;
+      uploadRawBytes  += rawLen;
+      uploadSentBytes += len;
+    } else {
+      uploadQueue[uploadHead].attempts++;
+      uploadRetries++;
+    }
+    pending = uploadCount;
+    portEXIT_CRITICAL(&uploadMux);
+
+    if (confirmed) {
+      Serial.printf("[Uploader] %d report(s) from %lu confirmed in %lu ms (%d of %d bytes sent), %d pending\n",
+                    batched, (unsigned long)hourEpoch, millis() - t0, len, rawLen, pending);
+      if (carries) releaseReportedRecords(carries);
+      backoffMs = 0;
+      if (pending > 0) xTaskNotifyGive(uploaderTask);  // drain the backlog without waiting
+    } else {
+      backoffMs = backoffMs == 0 ? UPLOAD_RETRY_MIN_MS : min(backoffMs * 2, UPLOAD_RETRY_MAX_MS);
+      lastFailMillis = millis();
+      Serial.printf("[Uploader] POST failed (%d), %d pending, retry in %lu s\n", status, pending, backoffMs / 1000);
     }
   }
-  digitalWrite(RELAY_CCTV_PIN, cCTV ? HIGH : LOW);
-  Serial.printf("[Cloud] CCTV now %s\n", cCTV ? "ON" : "OFF");
 }
 
 /**
- * @brief Callback function when the 'auxilliarySocket' variable changes in the Arduino Cloud.
- * Controls the auxiliary relay and records its ON/OFF duration.
+ * @brief Starts the uploader task on core 0.
  */
-void onAuxilliarySocketChange() {
-  unsigned long nowMillis = millis();
-  if (auxilliarySocket) { // Auxiliary Socket is turning ON
-    auxLastOnMillis = nowMillis;
-    Serial.printf("[Cloud Callback] Aux Socket ON at %lu ms\n", auxLastOnMillis);
-  } else { // Auxiliary Socket is turning OFF
-    if (auxLastOnMillis != 0) { // Only calculate if it was previously ON
-      totalAuxOnSeconds += (nowMillis - auxLastOnMillis) / 1000;
-      Serial.printf("[Cloud Callback] Aux Socket OFF. Added %lu seconds. Total: %lu s\n", (nowMillis - auxLastOnMillis) / 1000, totalAuxOnSeconds);
-      auxLastOnMillis = 0; // Reset start time
-    }
+void startUploader() {
+  if (xTaskCreatePinnedToCore(uploaderTaskMain, "uploader", UPLOADER_STACK_BYTES, nullptr,
+                              UPLOADER_PRIORITY, &uploaderTask, UPLOADER_CORE) != pdPASS) {
+    uploaderTask = nullptr;
+    Serial.println("[Uploader] Task creation failed – hourly reports will stay queued");
   }
-  digitalWrite(RELAY_AUX_PIN, auxilliarySocket ? HIGH : LOW);
-  Serial.printf("[Cloud] Auxiliary Socket now %s\n", auxilliarySocket ? "ON" : "OFF");
+}
+
+/**
+ * @brief Feeds one reading into the hourly p50/p90/p99 sketches of a metric.
+ * @param m Metric index.
+ * @param x Reading; NAN is ignored.
+ */
+void addHourlyQuantileSample(HourlyMetric m, float x) {
+  if (isnan(x)) return;
+  p2Add(hourly->quantiles[m].p50, x);
+  p2Add(hourly->quantiles[m].p90, x);
+  p2Add(hourly->quantiles[m].p99, x);
+}
+
+/**
+ * @brief Calculates the average of an array of floats, ignoring NAN values.
+ * @param arr Pointer to the float array.
+ * @param n Number of elements to consider in the array.
+ * @return The average of valid (non-NAN) numbers, or NAN if no valid numbers.
+ */
+float averageArray(const float* arr, int n) {
+  if (n == 0) return NAN;
+  float sum = 0; int valid_count = 0;
+  for (int i = 0; i < n; i++) {
+    if (!isnan(arr[i])) {
+      sum += arr[i];
+      valid_count++;
+    }
+  }
+  return valid_count > 0 ? sum / valid_count : NAN;
+}
+
+/**
+ * @brief Calculates the water volume in liters for a frustum-shaped tank.
+ * Interpolates the tank's compile-time height → volume table.
+ * @param tank Tank model (height and table).
+ * @param h_cm Water height in centimeters.
+ * @return Water volume in liters.
+ */
+float calculateWaterVolumeLiters(const TankModel& tank, float h_cm) {
+  h_cm = constrain(h_cm, 0.0f, tank.heightCm);
+  if (h_cm <= 0.0f) return 0.0f;
+  float pos  = h_cm / tank.stepCm;
+  int   i    = (int)pos;
+  if (i >= tank.tableSize - 1) return tank.table[tank.tableSize - 1];
+  float frac = pos - i;
+  return tank.table[i] + frac * (tank.table[i + 1] - tank.table[i]);
+}
+
+/**
+ * @brief Converts a raw MQ-137 ADC reading to ammonia ppm.
+ * @param raw ADC counts (0..ADC_MAX_VALUE).
+ * @param cal Load resistor and curve constants from the board profile.
+ * @return Ammonia concentration in ppm, never negative.
+ */
+float mq137RawToPpm(int raw, const Mq137Calibration& cal) {
+  float mqVolt  = raw * (ADC_VOLTAGE_REFERENCE / ADC_MAX_VALUE);
+  float rs_kOhm = mqVolt > 0.001f ? (ADC_VOLTAGE_REFERENCE - mqVolt) * cal.loadResistorKohm / mqVolt : 1e5f;
+  return max(0.0f, cal.ammoniaOffsetPpm + (-rs_kOhm / cal.ammoniaScalingDiv));
+}
+
+/**
+ * @brief Drives a relay honouring the board's polarity (BOARD.relayActiveLow).
+ * @param pin Relay GPIO.
+ * @param on true energises the relay.
+ */
+void relayWrite(int pin, bool on) {
+  digitalWrite(pin, (on != BOARD.relayActiveLow) ? HIGH : LOW);
+  traceEvent(KPTRACE_RELAY, WATCH_LOOP, pin, on);
+}
+
+/**
+ * @brief Reads back a relay output as ON/OFF, honouring the board's polarity.
+ */
+bool relayIsOn(int pin) {
+  return (digitalRead(pin) == HIGH) != BOARD.relayActiveLow;
+}
+
+// ===================================================================================
+//          Flush planner
+// ===================================================================================
+
+/**
+ * @brief Fills flushPlan[] from 'fromMinute' onward with slots aligned to
+ * multiples of flushInterval since midnight. Slots before 'fromMinute' that
+ * were already fired are kept, so an interval change only re-plans the rest of the day.
+ * @param fromMinute First minute-of-day that may hold a new slot.
+ */
+void replanFlushSlots(int fromMinute) {
+  flushPlanLength   = flushPlanCursor;
+  flushPlanInterval = flushInterval;
+  if (flushInterval <= 0) return;
+  int first = ((fromMinute + flushInterval - 1) / flushInterval) * flushInterval;
+  for (int m = first; m < 1440 && flushPlanLength < MAX_FLUSH_SLOTS_PER_DAY; m += flushInterval) {
+    flushPlan[flushPlanLength++] = m;
+  }
+}
+
+/**
+ * @brief Builds the plan for a new day. Runs once per day (and at boot).
+ * @param tmNow Current local time.
+ * @param includeCurrentMinute true at midnight rollover so the 00:00 slot fires;
+ *        false at boot so a restart does not trigger an immediate flush.
+ */
+void buildDailyFlushPlan(const struct tm& tmNow, bool includeCurrentMinute) {
+  int minuteOfDay = tmNow.tm_hour * 60 + tmNow.tm_min;
+  flushPlanCursor = 0;
+  replanFlushSlots(includeCurrentMinute ? minuteOfDay : minuteOfDay + 1);
+  flushPlanDay = tmNow.tm_yday;
+  Serial.printf("[Flush Plan] Day %d: %d slots every %d min, %d zone(s), max %d concurrent\n",
+                flushPlanDay, flushPlanLength, flushInterval, PUMP_ZONE_COUNT, MAX_CONCURRENT_PUMPS);
+}
+
+/**
+ * @brief Checks the plan cursor against the clock and queues all zones when a slot is due.
+ * Late slots (e.g. after a slow upload) fire once; slots missed entirely are skipped.
+ * @param tmNow Current local time.
+ */
+void serviceFlushPlan(const struct tm& tmNow) {
+  int minuteOfDay = tmNow.tm_hour * 60 + tmNow.tm_min;
+  if (flushPlanDay != tmNow.tm_yday) {
+    buildDailyFlushPlan(tmNow, flushPlanDay >= 0);
+  } else if (flushPlanInterval != flushInterval) {
+    replanFlushSlots(minuteOfDay + 1);
+    Serial.printf("[Flush Plan] Interval now %d min, %d slots left today\n", flushInterval, flushPlanLength - flushPlanCursor);
+  }
+
+  if (flushPlanCursor >= flushPlanLength || flushPlan[flushPlanCursor] > minuteOfDay) return;
+
+  while (flushPlanCursor < flushPlanLength && flushPlan[flushPlanCursor] <= minuteOfDay) flushPlanCursor++;
+  Serial.printf("TIMER: Auto-flush slot %02d:%02d due\n", tmNow.tm_hour, tmNow.tm_min);
+  queueFlushAllZones();
+  lastAutoFlushMillis = millis();
+}
+
+/**
+ * @brief Queues every pump zone for a flush. Zones already running or queued are not doubled.
+ */
+void queueFlushAllZones() {
+  for (int z = 0; z < PUMP_ZONE_COUNT; z++) {
+    if (!isPumpZoneRunning(z)) pendingZoneMask |= (1UL << z);
+  }
+  traceEvent(KPTRACE_INSTANT, WATCH_LOOP, TRACE_EV_FLUSH_QUEUED, (int32_t)pendingZoneMask);
+}
+
+/**
+ * @brief Returns whether a zone's relay is currently on. Zone 0 follows storagePump
+ * so that manual dashboard flushes also count against the concurrency cap.
+ */
+bool isPumpZoneRunning(int zone) {
+  return zone == 0 ? storagePump : zoneRunning[zone];
+}
+
+/**
+ * @brief Switches a zone's pump on and starts its auto-off timer.
+ */
+void startPumpZone(int zone, unsigned long nowMillis) {
+  if (isTankBelowReserve()) {
+    Serial.printf("[Tank] Flush of zone '%s' blocked: %.1f L < reserve %.1f L\n", PUMP_ZONES[zone].name, sensorSnapshot.read().value[SENSOR_TANK], tankReserveLiters);
+    return;
+  }
+  if (zone == 0) {
+    // Directly perform the turn-on actions.
+    relayWrite(RELAY_PUMP_PIN, true);
+    pumpTurnedOnMillis = nowMillis; // Start the auto-off timer
+    storagePump = true; // Update the cloud variable to reflect the new state.
+    Serial.printf("  >> ACTION: Relay ON. pumpTurnedOnMillis set to %lu. storagePump set to TRUE. Calling ArduinoCloud.update()\n", pumpTurnedOnMillis);
+    ArduinoCloud.update(); // Immediately update Cloud to reflect pump status.
+
+    // Also record the start time for pump duration tracking
+    pumpLastOnMillis = nowMillis;
+    Serial.println("[AUTO-FLUSH] Pump ON, recording start time for duration tracking.");
+  } else {
+    relayWrite(PUMP_ZONES[zone].relayPin, true);
+    zoneRunning[zone]  = true;
+    zoneOnMillis[zone] = nowMillis;
+    Serial.printf("[AUTO-FLUSH] Zone '%s' ON\n", PUMP_ZONES[zone].name);
+  }
+}
+
+/**
+ * @brief Starts queued zones while fewer than MAX_CONCURRENT_PUMPS are running,
+ * and stops extra zones once their run time has elapsed. Zone 0 is stopped by
+ * the storagePump auto-off timer in loop().
+ * @param nowMillis Current millis() value.
+ */
+void serviceFlushZones(unsigned long nowMillis) {
+  int active = 0;
+  for (int z = 0; z < PUMP_ZONE_COUNT; z++) {
+    if (z > 0 && zoneRunning[z] && nowMillis - zoneOnMillis[z] >= pumpOnDurationMs) {
+      relayWrite(PUMP_ZONES[z].relayPin, false);
+      zoneRunning[z] = false;
+      hourly->pumpSeconds += pumpOnDurationMs / 1000; // pump-seconds across all zones
+      Serial.printf("[AUTO-FLUSH] Zone '%s' OFF\n", PUMP_ZONES[z].name);
+    }
+    if (isPumpZoneRunning(z)) active++;
+  }
+
+  for (int z = 0; z < PUMP_ZONE_COUNT && pendingZoneMask && active < MAX_CONCURRENT_PUMPS; z++) {
+    if (!(pendingZoneMask & (1UL << z))) continue;
+    pendingZoneMask &= ~(1UL << z);
+    if (isPumpZoneRunning(z)) continue;
+    startPumpZone(z, nowMillis);
+    if (isPumpZoneRunning(z)) active++;
+  }
+}
+
+// ===================================================================================
+//          Tank protection & flow estimation
+// ===================================================================================
+
+/**
+ * @brief Returns true if any pump zone is running.
+ */
+bool anyPumpRunning() {
+  for (int z = 0; z < PUMP_ZONE_COUNT; z++) if (isPumpZoneRunning(z)) return true;
+  return false;
+}
+
+/**
+ * @brief Returns true when a valid tank reading is below the reserve (tankReserveL parameter).
+ * An unknown level (no echo yet) does not block flushing.
+ */
+bool isTankBelowReserve() {
+  const SensorSnapshot snap = sensorSnapshot.read();
+  return snap.tankValid() && snap.value[SENSOR_TANK] < tankReserveLiters;
+}
+
+/**
+ * @brief Switches every pump off immediately, with duration accounting.
+ * Used when the tank drops below the reserve during a flush.
+ */
+void abortAllPumps(unsigned long nowMillis) {
+  pendingZoneMask = 0;
+  for (int z = 1; z < PUMP_ZONE_COUNT; z++) {
+    if (!zoneRunning[z]) continue;
+    relayWrite(PUMP_ZONES[z].relayPin, false);
+    zoneRunning[z] = false;
+    hourly->pumpSeconds += (nowMillis - zoneOnMillis[z]) / 1000;
+  }
+  if (storagePump) {
+    relayWrite(RELAY_PUMP_PIN, false);
+    storagePump = false;
+    if (pumpLastOnMillis != 0) hourly->pumpSeconds += (nowMillis - pumpLastOnMillis) / 1000;
+    pumpLastOnMillis = 0;
+    pumpTurnedOnMillis = 0;
+    ArduinoCloud.update(); // Immediately update Cloud to reflect pump status.
+  }
+}
+
+/**
+ * @brief Tracks each flush from first pump on to settled level after the last pump off.
+ * Aborts the flush below the reserve, computes liters delivered from the level
+ * delta, and estimates the refill rate from level rises while idle.
+ * @param nowMillis Current millis() value.
+ */
+void serviceTankMonitor(unsigned long nowMillis) {
+  const SensorSnapshot snap = sensorSnapshot.read();
+  const float tank      = snap.value[SENSOR_TANK];
+  const bool  tankValid = snap.tankValid();
+  bool running = anyPumpRunning();
+
+  if (running && isTankBelowReserve()) {
+    Serial.printf("[Tank] Level %.1f L below reserve %.1f L – aborting flush\n", tank, tankReserveLiters);
+    abortAllPumps(nowMillis);
+    running = false;
+  }
+
+  if (running && !flushSessionActive) {
+    flushSessionActive   = true;
+    flushSessionSettling = false;
+    flushStartLiters     = tank;
+    flushStartMillis     = nowMillis;
+    beginFlushEvent(nowMillis);
+  } else if (running && flushSessionSettling) {
+    flushSessionSettling = false; // another zone started before the level settled
+  } else if (!running && flushSessionActive && !flushSessionSettling) {
+    flushSessionSettling = true;
+    flushEndMillis       = nowMillis;
+  } else if (flushSessionSettling && nowMillis - flushEndMillis >= TANK_SETTLE_MS) {
+    flushSessionActive   = false;
+    flushSessionSettling = false;
+    if (!isnan(flushStartLiters) && tankValid) {
+      lastFlushLiters = max(0.0f, flushStartLiters - tank);
+      float minutes   = (flushEndMillis - flushStartMillis) / 60000.0f;
+      lastFlushLpm    = minutes > 0 ? lastFlushLiters / minutes : NAN;
+      hourly->flushLiters += lastFlushLiters;
+      hourly->flushCount++;
+      if (flushEventActive) flushEventLiters = lastFlushLiters;
+      Serial.printf("[Tank] Flush delivered %.1f L (%.1f -> %.1f L, %.1f L/min)\n",
+                    lastFlushLiters, flushStartLiters, tank, lastFlushLpm);
+    }
+    refillWindowLiters = NAN; // restart the refill window from the settled level
+  }
+
+  // Refill rate from level rises while no flush is in progress.
+  if (flushSessionActive || !tankValid) return;
+  if (isnan(refillWindowLiters)) {
+    refillWindowLiters = tank;
+    refillWindowMillis = nowMillis;
+  } else if (nowMillis - refillWindowMillis >= REFILL_WINDOW_MS) {
+    float rise = tank - refillWindowLiters;
+    float rate = rise >= REFILL_MIN_RISE_LITERS ? rise / ((nowMillis - refillWindowMillis) / 60000.0f) : 0.0f;
+    refillLpm  = isnan(refillLpm) ? rate : REFILL_EWMA_ALPHA * rate + (1.0f - REFILL_EWMA_ALPHA) * refillLpm;
+    refillWindowLiters = tank;
+    refillWindowMillis = nowMillis;
+  }
+}
+
+// ===================================================================================
+//          Predictive flushing
+// ===================================================================================
+
+/**
+ * @brief Feeds one ammonia reading into a constant-velocity Kalman filter.
+ * Constant time and memory per sample.
+ * @param ppm Latest ammonia reading.
+ * @param nowMillis Current millis() value.
+ */
+void updateAmmoniaTrend(float ppm, unsigned long nowMillis) {
+  if (isnan(ppm)) return;
+  if (!nh3TrendReady) {
+    nh3TrendLevel = ppm; nh3TrendSlope = 0;
+    nh3P00 = NH3_MEASUREMENT_VAR; nh3P01 = 0; nh3P11 = 1e-4f;
+    nh3TrendMillis = nowMillis; nh3TrendReady = true;
+    return;
+  }
+  float dt = (nowMillis - nh3TrendMillis) / 1000.0f;
+  nh3TrendMillis = nowMillis;
+
+  // Predict
+  nh3TrendLevel += nh3TrendSlope * dt;
+  nh3P00 += dt * (2.0f * nh3P01 + dt * nh3P11) + NH3_LEVEL_PROCESS_VAR * dt;
+  nh3P01 += dt * nh3P11;
+  nh3P11 += NH3_SLOPE_PROCESS_VAR * dt;
+
+  // Update
+  float innov = ppm - nh3TrendLevel;
+  float sInv  = 1.0f / (nh3P00 + NH3_MEASUREMENT_VAR);
+  float k0 = nh3P00 * sInv, k1 = nh3P01 * sInv;
+  nh3TrendLevel += k0 * innov;
+  nh3TrendSlope += k1 * innov;
+  nh3P11 -= k1 * nh3P01;
+  nh3P01 -= k0 * nh3P01;
+  nh3P00 -= k0 * nh3P00;
+}
+
+/**
+ * @brief Forecasts seconds until the filtered ammonia level reaches the threshold.
+ * @return 0 if already above, INFINITY if the trend is flat or falling.
+ */
+float secondsToAmmoniaThreshold() {
+  if (!nh3TrendReady) return INFINITY;
+  if (nh3TrendLevel >= AMMONIA_FLUSH_THRESHOLD_PPM) return 0;
+  if (nh3TrendSlope < NH3_MIN_SLOPE_PPM_PER_S) return INFINITY;
+  return (AMMONIA_FLUSH_THRESHOLD_PPM - nh3TrendLevel) / nh3TrendSlope;
+}
+
+/**
+ * @brief Queues a flush when the threshold crossing is forecast within the lead time.
+ * Holds off while a flush is running, and for PREDICTIVE_MIN_GAP_MS after any
+ * flush started or after its own last trigger (which may have been blocked).
+ * @param nowMillis Current millis() value.
+ */
+void servicePredictiveFlush(unsigned long nowMillis) {
+  if (flushSessionActive || pendingZoneMask) return;
+  if (flushStartMillis != 0 && nowMillis - flushStartMillis < PREDICTIVE_MIN_GAP_MS) return;
+  if (lastPredictiveFlushMillis != 0 && nowMillis - lastPredictiveFlushMillis < PREDICTIVE_MIN_GAP_MS) return;
+
+  float eta = secondsToAmmoniaThreshold();
+  if (eta > PREDICTIVE_FLUSH_LEAD_S) return;
+
+  Serial.printf("PREDICT: NH3 %.1f ppm, slope %.2f ppm/h, threshold %.1f ppm in %.0f s – flushing\n",
+                nh3TrendLevel, nh3TrendSlope * 3600.0f, AMMONIA_FLUSH_THRESHOLD_PPM, eta);
+  queueFlushAllZones();
+  lastPredictiveFlushMillis = nowMillis; // hold-off starts now even if the flush is blocked
+  hourly->predictiveFlushCount++;
+}
+
+// ===================================================================================
+//          Flush efficacy analytics
+// ===================================================================================
+
+/**
+ * @brief Resets a P² estimator for quantile p (0..1).
+ */
+void p2Init(P2Quantile& e, float p) {
+  e.p = p; e.count = 0;
+  e.dn[0] = 0; e.dn[1] = p / 2; e.dn[2] = p; e.dn[3] = (1 + p) / 2; e.dn[4] = 1;
+}
+
+/**
+ * @brief Adds one observation to a P² estimator. O(1) time and memory.
+ */
+void p2Add(P2Quantile& e, float x) {
+  if (isnan(x)) return;
+  if (e.count < 5) {
+    e.q[e.count++] = x;
+    if (e.count == 5) {
+      for (int i = 1; i < 5; i++) for (int j = i; j > 0 && e.q[j - 1] > e.q[j]; j--) { float t = e.q[j]; e.q[j] = e.q[j - 1]; e.q[j - 1] = t; }
+      for (int i = 0; i < 5; i++) e.n[i] = i;
+      e.np[0] = 0; e.np[1] = 2 * e.p; e.np[2] = 4 * e.p; e.np[3] = 2 + 2 * e.p; e.np[4] = 4;
+    }
+    return;
+  }
+
+  int k;
+  if (x < e.q[0])       { e.q[0] = x; k = 0; }
+  else if (x >= e.q[4]) { e.q[4] = x; k = 3; }
+  else { k = 0; while (k < 3 && x >= e.q[k + 1]) k++; }
+  for (int i = k + 1; i < 5; i++) e.n[i]++;
+  for (int i = 0; i < 5; i++) e.np[i] += e.dn[i];
+  e.count++;
+
+  for (int i = 1; i <= 3; i++) {
+    float d = e.np[i] - e.n[i];
+    if ((d >= 1 && e.n[i + 1] - e.n[i] > 1) || (d <= -1 && e.n[i - 1] - e.n[i] < -1)) {
+      int ds = d >= 0 ? 1 : -1;
+      float qp = e.q[i] + (float)ds / (e.n[i + 1] - e.n[i - 1]) *
+                 ((e.n[i] - e.n[i - 1] + ds) * (e.q[i + 1] - e.q[i]) / (e.n[i + 1] - e.n[i]) +
+                  (e.n[i + 1] - e.n[i] - ds) * (e.q[i] - e.q[i - 1]) / (e.n[i] - e.n[i - 1]));
+      if (e.q[i - 1] < qp && qp < e.q[i + 1]) e.q[i] = qp;
+      else e.q[i] += ds * (e.q[i + ds] - e.q[i]) / (e.n[i + ds] - e.n[i]);
+      e.n[i] += ds;
+    }
+  }
+}
+
+/**
+ * @brief Returns the current quantile estimate, or NAN if no observations.
+ */
+float p2Value(const P2Quantile& e) {
+  if (e.count == 0) return NAN;
+  if (e.count >= 5) return e.q[2];
+  float sorted[5];
+  for (uint32_t i = 0; i < e.count; i++) {
+    int j = i;
+    while (j > 0 && sorted[j - 1] > e.q[i]) { sorted[j] = sorted[j - 1]; j--; }
+    sorted[j] = e.q[i];
+  }
+  return sorted[(int)(e.p * (e.count - 1) + 0.5f)];
+}
+
+/**
+ * @brief Adds one observation to a running mean/variance.
+ */
+void statAdd(RunningStat& s, float x) {
+  if (isnan(x)) return;
+  s.n++;
+  float delta = x - s.mean;
+  s.mean += delta / s.n;
+  s.m2   += delta * (x - s.mean);
+}
+
+/**
+ * @brief Starts observing a flush. A flush that starts while the previous one
+ * is still being observed closes the previous event as not yet recovered.
+ */
+void beginFlushEvent(unsigned long nowMillis) {
+  if (flushEventActive) completeFlushEvent(nowMillis, false);
+  if (!nh3TrendReady) return;
+  flushEventActive   = true;
+  flushEventMillis   = nowMillis;
+  flushEventBaseline = nh3TrendLevel;
+  flushEventMin      = nh3TrendLevel;
+  flushEventLiters   = NAN;
+}
+
+/**
+ * @brief Tracks the ammonia minimum after a flush and closes the event once
+ * the filtered level is back at the baseline or the window expires.
+ */
+void serviceFlushEvent(unsigned long nowMillis) {
+  if (!flushEventActive) return;
+  flushEventMin = min(flushEventMin, nh3TrendLevel);
+  if (flushSessionActive) return; // still pumping or settling
+  if (nh3TrendLevel >= flushEventBaseline && flushEventMin < flushEventBaseline) completeFlushEvent(nowMillis, true);
+  else if (nowMillis - flushEventMillis >= FLUSH_EVENT_WINDOW_MS)               completeFlushEvent(nowMillis, false);
+}
+
+/**
+ * @brief Folds a finished event into the running statistics and sketches,
+ * then re-tunes the pump duration every PUMP_TUNE_EVENTS events.
+ * @param recovered false if the window expired (recovery time is a lower bound).
+ */
+void completeFlushEvent(unsigned long nowMillis, bool recovered) {
+  flushEventActive = false;
+  float drop       = max(0.0f, flushEventBaseline - flushEventMin);
+  float recoverMin = (nowMillis - flushEventMillis) / 60000.0f;
+  statAdd(flushDropStat, drop);
+  statAdd(flushLitersStat, flushEventLiters);
+  if (recovered) {
+    // An expired window only bounds the recovery time; it would pin the quantiles at the window length
+    statAdd(flushRecoverStat, recoverMin);
+    p2Add(flushRecoverP50, recoverMin);
+    p2Add(flushRecoverP90, recoverMin);
+  } else {
+    hourly->flushUnrecoveredCount++;
+  }
+  hourly->flushEventCount++;
+  Serial.printf("[Flush Event] Baseline %.1f ppm, min %.1f ppm, recovery %.1f min%s, water %.1f L\n",
+                flushEventBaseline, flushEventMin, recoverMin, recovered ? "" : "+", flushEventLiters);
+
+  if (flushEventBaseline < PUMP_TUNE_MIN_BASELINE_PPM) return;
+  float dropPct = drop / flushEventBaseline;
+  p2Add(flushDropPctP50, dropPct);
+  if (!PUMP_AUTO_TUNE_ENABLED) return;
+
+  tuneDropSum += dropPct;
+  if (++tuneDropCount < PUMP_TUNE_EVENTS) return;
+  float meanDrop = tuneDropSum / tuneDropCount;
+  tuneDropSum = 0; tuneDropCount = 0;
+
+  unsigned long previous = pumpOnDurationMs;
+  if (meanDrop < PUMP_TUNE_DROP_LOW)       pumpOnDurationMs = min(PUMP_MAX_DURATION_MS, pumpOnDurationMs + PUMP_TUNE_STEP_MS);
+  else if (meanDrop > PUMP_TUNE_DROP_HIGH) pumpOnDurationMs = max(PUMP_MIN_DURATION_MS, pumpOnDurationMs - PUMP_TUNE_STEP_MS);
+  if (pumpOnDurationMs != previous) {
+    // Store through the pumpOnMs parameter: the cache, NVS and a reboot keep the tuned value
+    char text[16], reply[PARAM_REPLY_MAX];
+    snprintf(text, sizeof text, "%lu", pumpOnDurationMs);
+    setParamText(PARAM_PUMP_ON_MS, text, reply, sizeof reply);
+    Serial.printf("[Flush Tune] Mean NH3 drop %.0f%% over %d events – pump duration %lu -> %lu s\n",
+                  meanDrop * 100, PUMP_TUNE_EVENTS, previous / 1000, pumpOnDurationMs / 1000);
+  }
+}
+
+// ===================================================================================
+//          Sensor health
+// ===================================================================================
+
+/**
+ * @brief Clears a detector to the healthy, not-yet-warmed-up state.
+ */
+void resetSensorHealth(SensorHealth& s) {
+  memset(&s, 0, sizeof s);
+  s.last = NAN;
+  s.lastChangeMillis = millis();
+  s.score = 100;
+  s.hourMinScore = 100;
+}
+
+/**
+ * @brief Runs the streaming detectors for one sample. O(1) time and memory.
+ * Raises FAULT_* bits, derives a 0-100 health score and logs a fault event
+ * whenever a new fault bit appears.
+ * @param r Sensor reading whose detector is updated.
+ * @param x Raw reading, NAN for a failed read or timeout.
+ * @param nowMillis Current millis() value.
+ */
+void updateSensorHealth(SensorReading& r, float x, unsigned long nowMillis) {
+  const SensorHealthConfig& cfg = SENSOR_HEALTH_CONFIG[r.channel];
+  SensorHealth& s = r.health;
+  uint8_t faults = 0;
+
+  if (isnan(x)) {
+    if (s.missStreak < 0xFFFF) s.missStreak++;
+    if (s.missStreak >= HEALTH_MISSING_STREAK) faults |= FAULT_MISSING;
+    faults |= s.faults & (FAULT_STUCK | FAULT_RANGE | FAULT_NOISE); // keep last verdicts while blind
+  } else {
+    s.missStreak = 0;
+    if (x < r.minValid || x > r.maxValid) faults |= FAULT_RANGE;
+
+    if (isnan(s.last) || x != s.last) s.lastChangeMillis = nowMillis;
+    else if (nowMillis - s.lastChangeMillis >= cfg.stuckMs) faults |= FAULT_STUCK;
+
+    if (s.samples == 0) {
+      s.mean = x; s.var = 0; s.jitter = 0;
+    } else {
+      s.jitter = HEALTH_EWMA_ALPHA * fabsf(x - s.last) + (1 - HEALTH_EWMA_ALPHA) * s.jitter;
+      if (s.samples > HEALTH_WARMUP_SAMPLES && s.jitter > cfg.noiseLimit) faults |= FAULT_NOISE;
+
+      float dev = x - s.mean;
+      if (s.samples > HEALTH_WARMUP_SAMPLES && s.var > 1e-6f && fabsf(dev) > HEALTH_SPIKE_Z * sqrtf(s.var)) {
+        s.spikeHold = HEALTH_SPIKE_HOLD;
+      }
+      s.mean += HEALTH_EWMA_ALPHA * dev;
+      s.var   = (1 - HEALTH_EWMA_ALPHA) * (s.var + HEALTH_EWMA_ALPHA * dev * dev);
+    }
+    s.last = x;
+    s.samples++;
+  }
+  if (s.spikeHold > 0) { s.spikeHold--; faults |= FAULT_SPIKE; }
+
+  int score = 100;
+  if (faults & FAULT_MISSING) score -= 60;
+  if (faults & FAULT_STUCK)   score -= 50;
+  if (faults & FAULT_RANGE)   score -= 40;
+  if (faults & FAULT_NOISE)   score -= 25;
+  if (faults & FAULT_SPIKE)   score -= 15;
+  s.score = score < 0 ? 0 : score;
+  if (s.score < s.hourMinScore) s.hourMinScore = s.score;
+
+  uint8_t raised = faults & ~s.faults;
+  s.faults = faults;
+  if (!raised) return;
+  hourly->sensorFaultEvents++;
+  for (int b = 0; b < 5; b++) {
+    if (raised & (1 << b)) {
+      Serial.printf("[Health] %s fault %s (value %.2f, score %d)\n", r.label, SENSOR_FAULT_NAMES[b], x, s.score);
+    }
+  }
+}
+
+// ===================================================================================
+//          Sensor registry
+// ===================================================================================
+
+/**
+ * @brief Initialises every sensor and sorts readings into primary and extra.
+ */
+void beginSensors() {
+  memset(primaryReading, 0, sizeof primaryReading);
+  extraReadingCount = 0;
+  forEachSensor([](auto& s) { s.begin(); });
+  forEachReading([](SensorReading& r) {
+    if (!primaryReading[r.channel]) primaryReading[r.channel] = &r;
+    else if (extraReadingCount < MAX_SENSOR_READINGS) extraReadings[extraReadingCount++] = &r;
+  });
+  for (int c = 0; c < SENSOR_COUNT; c++) {
+    if (!primaryReading[c]) Serial.printf("[Sensors] WARNING: no sensor for channel %d\n", c);
+  }
+  Serial.printf("[Sensors] %d readings (%d extra)\n", SENSOR_COUNT + extraReadingCount, extraReadingCount);
+}
+
+/**
+ * @brief Applies a completed reading: hourly mean, and for primary readings
+ * the trend filter and percentile sketches.
+ */
+void onSensorReading(SensorReading& r, unsigned long nowMillis) {
+  if (!r.fresh) return;
+  r.hourSum += r.value;
+  r.hourCount++;
+  if (primaryReading[r.channel] != &r) return;
+  switch (r.channel) {
+    case SENSOR_TEMP: addHourlyQuantileSample(METRIC_TEMPERATURE, r.value); break;
+    case SENSOR_HUM:  addHourlyQuantileSample(METRIC_HUMIDITY, r.value); break;
+    case SENSOR_NH3:
+      updateAmmoniaTrend(r.value, nowMillis);
+      addHourlyQuantileSample(METRIC_AMMONIA, r.value);
+      break;
+    case SENSOR_TANK: addHourlyQuantileSample(METRIC_STORAGE_TANK, r.value); break;
+    default: break;
+  }
+}
+
+/**
+ * @brief Publishes the primary readings as one SensorSnapshot and mirrors
+ * them into the Arduino Cloud variables, which are written nowhere else.
+ */
+void publishSensorSnapshot(unsigned long nowMillis) {
+  SensorSnapshot s;
+  memset(&s, 0, sizeof s);
+  s.takenMillis = nowMillis;
+  for (int c = 0; c < SENSOR_COUNT; c++) {
+    const SensorReading* r = primaryReading[c];
+    s.value[c]  = r ? r->value : NAN;
+    s.health[c] = r ? r->health.score : 0;
+    if (!r || isnan(r->raw)) s.staleMask |= 1 << c;
+  }
+  s.nh3SlopePerHour = nh3TrendReady ? nh3TrendSlope * 3600.0f : NAN;
+  s.acqCycleUs      = acqLastCycleUs;
+  sensorSnapshot.write(s);
+
+  if (!isnan(s.value[SENSOR_TEMP])) temperature = s.value[SENSOR_TEMP];
+  if (!isnan(s.value[SENSOR_HUM]))  humidity    = s.value[SENSOR_HUM];
+  if (!isnan(s.value[SENSOR_NH3]))  ammonia     = s.value[SENSOR_NH3];
+  if (!isnan(s.value[SENSOR_TANK])) storageTank = s.value[SENSOR_TANK];
+}
+
+/**
+ * @brief Runs one overlapped acquisition cycle: starts the background
+ * (ASYNC) sensors first, e.g. the ultrasonic ping, then the blocking ones
+ * (DHT frame, ADC burst) while it is in flight, then collects each result as
+ * it completes. Wall time is that of the slowest sensor, not the sum.
+ * @param nowMillis Current millis() value.
+ */
+void serviceSensors(unsigned long nowMillis) {
+  bool     flushing = flushSessionActive || anyPumpRunning();
+  uint32_t cycleStartUs = micros();
+  uint32_t serialUs = 0;
+  int      started = 0;
+
+  forEachSensor([&](auto& s) {
+    if (std::decay_t<decltype(s)>::ASYNC && s.due(nowMillis, flushing)) { s.start(nowMillis); started++; }
+  });
+  forEachSensor([&](auto& s) {
+    if (!std::decay_t<decltype(s)>::ASYNC && s.due(nowMillis, flushing)) { s.start(nowMillis); started++; }
+  });
+
+  bool pending;
+  do {
+    pending = false;
+    forEachSensor([&](auto& s) {
+      if (s.poll(nowMillis)) {
+        serialUs += s.busyUs;
+        for (auto& r : s.readings) onSensorReading(r, nowMillis);
+      }
+      pending |= s.busy;
+    });
+  } while (pending && micros() - cycleStartUs < ACQ_MAX_WAIT_US);
+
+  if (started == 0) return;
+  acqLastCycleUs  = micros() - cycleStartUs;
+  acqLastSerialUs = serialUs;
+  hourly->acqCycles++;
+  hourly->acqCycleUs  += acqLastCycleUs;
+  hourly->acqSerialUs += serialUs;
+  if (acqLastCycleUs > hourly->acqMaxUs) hourly->acqMaxUs = acqLastCycleUs;
+  publishSensorSnapshot(nowMillis);
+}
+
+/**
+ * @brief GET /api/snapshot – the latest SensorSnapshot as JSON.
+ */
+void handleSnapshotRequest() {
+  const SensorSnapshot s = sensorSnapshot.read();
+  static const char* const keys[SENSOR_COUNT] = { "temperature", "humidity", "ammonia", "storageTank" };
+  char body[320];
+  int  n = snprintf(body, sizeof body, "{\"version\":%lu,\"ageMs\":%lu", (unsigned long)sensorSnapshot.version(),
+                    (unsigned long)(millis() - s.takenMillis));
+  for (int c = 0; c < SENSOR_COUNT; c++) {
+    if (isnan(s.value[c])) n += snprintf(body + n, sizeof body - n, ",\"%s\":null", keys[c]);
+    else n += snprintf(body + n, sizeof body - n, ",\"%s\":%.1f", keys[c], s.value[c]);
+  }
+  n += snprintf(body + n, sizeof body - n, ",\"health\":[%u,%u,%u,%u],\"stale\":%u", s.health[0], s.health[1], s.health[2], s.health[3], s.staleMask);
+  if (!isnan(s.nh3SlopePerHour)) n += snprintf(body + n, sizeof body - n, ",\"nh3SlopePerHour\":%.2f", s.nh3SlopePerHour);
+  snprintf(body + n, sizeof body - n, ",\"acqUs\":%lu}", (unsigned long)s.acqCycleUs);
+  localApi.send(200, "application/json", body);
+}
+
+/**
+ * @brief Draws the LCD. Page 0 shows the primary readings from the snapshot;
+ * with extra sensors, further pages of two readings each rotate every LCD_PAGE_MS.
+ */
+void updateLcd(unsigned long nowMillis, const SensorSnapshot& snap) {
+  int pages = 1 + (extraReadingCount + 1) / 2;
+  int page  = (int)((nowMillis / LCD_PAGE_MS) % pages);
+  if (page == 0) {
+    lcd.setCursor(0,0); lcd.printf("T:%.1fC H:%2.0f%%", snap.value[SENSOR_TEMP], snap.value[SENSOR_HUM]);
+    lcd.setCursor(0,1); lcd.printf("NH3:%.1f S:%5.1fL", snap.value[SENSOR_NH3], snap.value[SENSOR_TANK]);
+    return;
+  }
+  for (int line = 0; line < 2; line++) {
+    int  i = (page - 1) * 2 + line;
+    char buf[17];
+    if (i < extraReadingCount) {
+      const SensorReading& r = *extraReadings[i];
+      snprintf(buf, sizeof buf, "%-6.6s%7.1f%-3s", r.label, r.value, SENSOR_HEALTH_CONFIG[r.channel].unit);
+    } else {
+      buf[0] = 0;
+    }
+    lcd.setCursor(0, line); lcd.printf("%-16s", buf);
+  }
+}
+
+// ===================================================================================
+//          Rollup pyramid
+// ===================================================================================
+
+/**
+ * @brief Mounts LittleFS and pre-sizes each ring file so every slot can be
+ * rewritten in place. Runs once; later boots find the files already sized.
+ */
+void initRollupStorage() {
+  if (!LittleFS.begin(true)) { Serial.println("[Rollup] LittleFS mount failed – rollups disabled"); return; }
+  uint8_t zeros[256] = {0};
+  for (int l = 0; l < ROLLUP_LEVEL_COUNT; l++) {
+    size_t want = ROLLUP_LEVELS[l].capacity * sizeof(RollupRecord);
+    File f = LittleFS.open(ROLLUP_LEVELS[l].path, LittleFS.exists(ROLLUP_LEVELS[l].path) ? "r+" : "w+");
+    if (!f) { Serial.printf("[Rollup] Cannot open %s\n", ROLLUP_LEVELS[l].path); return; }
+    if (f.size() < want) {
+      Serial.printf("[Rollup] Sizing %s to %u bytes\n", ROLLUP_LEVELS[l].path, (unsigned)want);
+      f.seek(f.size(), SeekSet);
+      for (size_t have = f.size(); have < want; ) {
+        size_t n = min(sizeof zeros, want - have);
+        f.write(zeros, n); have += n;
+      }
+    }
+    f.close();
+    memset(&rollupAcc[l], 0, sizeof rollupAcc[l]);
+  }
+  rollupStorageReady = true;
+}
+
+/**
+ * @brief Returns the local-time start of the period containing 'epoch'.
+ */
+uint32_t rollupPeriodStart(int level, uint32_t epoch) {
+  uint32_t p = ROLLUP_LEVELS[level].periodSeconds;
+  return ((epoch + GMT_OFFSET_SECONDS) / p) * p - GMT_OFFSET_SECONDS;
+}
+
+/**
+ * @brief Returns the byte offset of the ring slot that holds the given period.
+ */
+uint32_t rollupSlotOffset(int level, uint32_t periodStart) {
+  uint32_t index = (periodStart + GMT_OFFSET_SECONDS) / ROLLUP_LEVELS[level].periodSeconds;
+  return (index % ROLLUP_LEVELS[level].capacity) * sizeof(RollupRecord);
+}
+
+/**
+ * @brief Writes a closed period into its ring slot.
+ */
+void writeRollupRecord(int level, const RollupRecord& rec) {
+  File f = LittleFS.open(ROLLUP_LEVELS[level].path, "r+");
+  if (!f) return;
+  f.seek(rollupSlotOffset(level, rec.epoch), SeekSet);
+  f.write((const uint8_t*)&rec, sizeof rec);
+  f.close();
+}
+
+/**
+ * @brief Reads the record for a period; returns false for empty or overwritten slots.
+ */
+bool readRollupRecord(int level, uint32_t periodStart, RollupRecord& rec) {
+  File f = LittleFS.open(ROLLUP_LEVELS[level].path, "r");
+  if (!f) return false;
+  f.seek(rollupSlotOffset(level, periodStart), SeekSet);
+  bool ok = f.read((uint8_t*)&rec, sizeof rec) == sizeof rec && rec.epoch == periodStart;
+  f.close();
+  return ok;
+}
+
+/**
+ * @brief Folds a record (a single reading at level 0, or a closed period of
+ * the level below) into a level's accumulator. When the record belongs to a
+ * new period, the open period is written and folded one level up first.
+ */
+void foldRollup(int level, const RollupRecord& in) {
+  RollupAccumulator& acc = rollupAcc[level];
+  uint32_t period = rollupPeriodStart(level, in.epoch);
+
+  if (acc.epoch != 0 && acc.epoch != period) {
+    RollupRecord out;
+    out.epoch = acc.epoch;
+    for (int m = 0; m < METRIC_COUNT; m++) {
+      out.count[m] = acc.count[m];
+      out.mean[m]  = acc.count[m] ? acc.sum[m] / acc.count[m] : NAN;
+      out.min[m]   = acc.count[m] ? acc.min[m] : NAN;
+      out.max[m]   = acc.count[m] ? acc.max[m] : NAN;
+    }
+    for (int r = 0; r < RELAY_ID_COUNT; r++) out.dutyMs[r] = acc.dutyMs[r];
+    writeRollupRecord(level, out);
+    if (level == 0) appendColumnarRow(out);
+    if (level + 1 < ROLLUP_LEVEL_COUNT) foldRollup(level + 1, out);
+    memset(&acc, 0, sizeof acc);
+  }
+
+  if (acc.epoch == 0 && level > 0) {
+    // First fold since boot: recover the part of this period that closed
+    // before the restart from the level below (at most 60 or 24 reads).
+    uint32_t step = ROLLUP_LEVELS[level - 1].periodSeconds;
+    for (uint32_t p = period; p < rollupPeriodStart(level - 1, in.epoch); p += step) {
+      RollupRecord prev;
+      if (readRollupRecord(level - 1, p, prev)) accumulateRollup(acc, prev);
+    }
+  }
+  acc.epoch = period;
+  accumulateRollup(acc, in);
+}
+
+/**
+ * @brief Adds a record's counts, sums, extremes and duty time to an accumulator.
+ */
+void accumulateRollup(RollupAccumulator& acc, const RollupRecord& in) {
+  for (int m = 0; m < METRIC_COUNT; m++) {
+    if (in.count[m] == 0) continue;
+    if (acc.count[m] == 0 || in.min[m] < acc.min[m]) acc.min[m] = in.min[m];
+    if (acc.count[m] == 0 || in.max[m] > acc.max[m]) acc.max[m] = in.max[m];
+    acc.sum[m]   += in.mean[m] * in.count[m];
+    acc.count[m] += in.count[m];
+  }
+  for (int r = 0; r < RELAY_ID_COUNT; r++) acc.dutyMs[r] += in.dutyMs[r];
+}
+
+/**
+ * @brief Feeds one loop's readings and relay ON time into the minute level.
+ * Minute, hour and day records are written as each period closes.
+ */
+void addRollupSample(time_t epoch, unsigned long nowMillis, float t, float h, float nh3, float tankLiters) {
+  unsigned long dt = rollupLastMillis ? nowMillis - rollupLastMillis : 0;
+  rollupLastMillis = nowMillis;
+  if (!rollupStorageReady || epoch < 946684800L) return;
+
+  RollupRecord s;
+  memset(&s, 0, sizeof s);
+  s.epoch = (uint32_t)epoch;
+  const float values[METRIC_COUNT] = { nh3, t, h, tankLiters };
+  for (int m = 0; m < METRIC_COUNT; m++) {
+    if (isnan(values[m])) continue;
+    s.count[m] = 1; s.mean[m] = s.min[m] = s.max[m] = values[m];
+  }
+  const bool relayOn[RELAY_ID_COUNT] = { storagePump, auxilliarySocket, cCTV, siren };
+  for (int r = 0; r < RELAY_ID_COUNT; r++) s.dutyMs[r] = relayOn[r] ? dt : 0;
+  foldRollup(0, s);
+}
+
+/**
+ * @brief GET /api/rollups?level=minute|hour|day&count=N
+ * Streams the most recent N closed periods (newest first) as a JSON array.
+ * Reads exactly N ring slots through one open file, ROLLUP_STREAM_CHUNK
+ * contiguous slots at a time (wrapping at the ring end at most once); periods
+ * with no data are skipped.
+ */
+void handleRollupsRequest() {
+  String levelArg = localApi.arg("level");
+  int level = levelArg == "minute" ? 0 : levelArg == "hour" ? 1 : 2;
+  int count = localApi.hasArg("count") ? localApi.arg("count").toInt() : 90;
+  count = constrain(count, 1, (int)ROLLUP_LEVELS[level].capacity);
+  if (!rollupStorageReady || time(nullptr) < 946684800L) { localApi.send(503, "text/plain", "rollups unavailable"); return; }
+
+  File ring = LittleFS.open(ROLLUP_LEVELS[level].path, "r");
+  if (!ring) { localApi.send(503, "text/plain", "rollups unavailable"); return; }
+
+  static RollupRecord chunk[ROLLUP_STREAM_CHUNK];
+  const uint32_t step = ROLLUP_LEVELS[level].periodSeconds;
+  localApi.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  localApi.send(200, "application/json", "[");
+  uint32_t period = rollupPeriodStart(level, (uint32_t)time(nullptr)) - step;  // newest period still to send
+  bool first = true;
+  char line[320];
+  for (int done = 0; done < count; ) {
+    // Slots of the next 'span' periods run backwards from 'slot' without crossing the ring start
+    int slot = rollupSlotOffset(level, period) / sizeof(RollupRecord);
+    int span = min(min(count - done, ROLLUP_STREAM_CHUNK), slot + 1);
+    ring.seek((slot + 1 - span) * sizeof(RollupRecord), SeekSet);
+    int got = ring.read((uint8_t*)chunk, span * sizeof(RollupRecord)) / sizeof(RollupRecord);
+    markStage(WATCH_LOOP, STAGE_LOCAL_API);
+    for (int k = span - 1; k >= 0; k--, period -= step) {
+      if (k >= got || chunk[k].epoch != period) continue;  // empty or overwritten slot
+      const RollupRecord& r = chunk[k];
+      // {"t":epoch,"ammonia":[min,mean,max],...,"dutyS":[pump,aux,cctv,siren]}
+      int n = snprintf(line, sizeof line, "%s{\"t\":%lu", first ? "" : ",", (unsigned long)r.epoch);
+      for (int m = 0; m < METRIC_COUNT; m++) {
+        if (r.count[m] == 0) n += snprintf(line + n, sizeof line - n, ",\"%s\":null", HOURLY_METRIC_KEYS[m]);
+        else n += snprintf(line + n, sizeof line - n, ",\"%s\":[%.1f,%.1f,%.1f]", HOURLY_METRIC_KEYS[m], r.min[m], r.mean[m], r.max[m]);
+      }
+      snprintf(line + n, sizeof line - n, ",\"dutyS\":[%lu,%lu,%lu,%lu]}",
+               (unsigned long)(r.dutyMs[RELAY_ID_PUMP] / 1000), (unsigned long)(r.dutyMs[RELAY_ID_AUX] / 1000),
+               (unsigned long)(r.dutyMs[RELAY_ID_CCTV] / 1000), (unsigned long)(r.dutyMs[RELAY_ID_SIREN] / 1000));
+      localApi.sendContent(line);
+      first = false;
+    }
+    done += span;
+  }
+  ring.close();
+  localApi.sendContent("]");
+  localApi.sendContent("");
+}
+
+// ===================================================================================
+//          Columnar flash log
+// ===================================================================================
+
+/**
+ * @brief Truncates a LittleFS file through the VFS (the Arduino File API has no truncate).
+ */
+bool truncateLittleFsFile(const char* path, uint32_t size) {
+  char full[48];
+  snprintf(full, sizeof full, "%s%s", LITTLEFS_VFS_PREFIX, path);
+  return truncate(full, size) == 0;
+}
+
+/**
+ * @brief Reads and fully verifies (header and payload CRC) the block at 'offset'.
+ * @param f Open log file.
+ * @param offset Byte offset of the block header.
+ * @param hdr Receives the header.
+ * @return true if the block is complete and intact.
+ */
+bool readColumnarBlockHeader(File& f, uint32_t offset, KpLogBlockHeader& hdr) {
+  if (offset + KPLOG_BLOCK_BYTES > f.size()) return false;
+  f.seek(offset, SeekSet);
+  if (f.read((uint8_t*)&hdr, sizeof hdr) != sizeof hdr || !kplogHeaderValid(hdr)) return false;
+  uint8_t  buf[128];
+  uint32_t crc = 0;
+  for (size_t left = KPLOG_PAYLOAD_BYTES; left > 0; ) {
+    size_t n = f.read(buf, min(sizeof buf, left));
+    if (n == 0) return false;
+    crc = kplogCrc32(buf, n, crc); left -= n;
+  }
+  return crc == hdr.payloadCrc;
+}
+
+/**
+ * @brief Brings the log and its index back to a consistent state after a power loss.
+ * Walks back from the last index entry to the last intact block, re-indexes any
+ * intact blocks written after it (index write lost), and cuts off a torn tail.
+ */
+void recoverColumnarLog() {
+  if (!rollupStorageReady) return;
+  if (!LittleFS.exists(KPLOG_PATH)) { File c = LittleFS.open(KPLOG_PATH, "w"); c.close(); }
+  if (!LittleFS.exists(KPLOG_INDEX_PATH)) { File c = LittleFS.open(KPLOG_INDEX_PATH, "w"); c.close(); }
+
+  File log = LittleFS.open(KPLOG_PATH, "r");
+  File idx = LittleFS.open(KPLOG_INDEX_PATH, "r");
+  if (!log || !idx) { Serial.println("[Log] Cannot open columnar log"); return; }
+  uint32_t logSize = log.size();
+  kplogIndexCount  = idx.size() / sizeof(KpLogIndexEntry);
+
+  // 1. Last index entry that points at an intact block.
+  kplogAppendOffset = 0;
+  while (kplogIndexCount > 0) {
+    KpLogIndexEntry e; KpLogBlockHeader h;
+    idx.seek((kplogIndexCount - 1) * sizeof e, SeekSet);
+    if (idx.read((uint8_t*)&e, sizeof e) == sizeof e && readColumnarBlockHeader(log, e.offset, h) && h.startEpoch == e.startEpoch) {
+      kplogAppendOffset = e.offset + KPLOG_BLOCK_BYTES;
+      break;
+    }
+    kplogIndexCount--;
+  }
+  idx.close();
+  truncateLittleFsFile(KPLOG_INDEX_PATH, kplogIndexCount * sizeof(KpLogIndexEntry));
+  kplogLastEpoch = 0;
+  if (kplogAppendOffset > 0) { KpLogBlockHeader last; if (readColumnarBlockHeader(log, kplogAppendOffset - KPLOG_BLOCK_BYTES, last)) kplogLastEpoch = last.startEpoch; }
+
+  // 2. Intact blocks past the index (torn index append), then a torn tail.
+  KpLogBlockHeader h;
+  int reindexed = 0;
+  while (readColumnarBlockHeader(log, kplogAppendOffset, h)) {
+    appendColumnarIndex(h.startEpoch, kplogAppendOffset);
+    kplogAppendOffset += KPLOG_BLOCK_BYTES;
+    kplogLastEpoch = h.startEpoch;
+    reindexed++;
+  }
+  log.close();
+  if (kplogAppendOffset < logSize) {
+    Serial.printf("[Log] Dropping %lu torn bytes at offset %lu\n", (unsigned long)(logSize - kplogAppendOffset), (unsigned long)kplogAppendOffset);
+    truncateLittleFsFile(KPLOG_PATH, kplogAppendOffset);
+  }
+  Serial.printf("[Log] %lu blocks (%lu re-indexed), %lu bytes\n", (unsigned long)kplogIndexCount, (unsigned long)reindexed, (unsigned long)kplogAppendOffset);
+
+  // 3. Fit both generations next to the rollup rings.
+  size_t ringBytes = 0;
+  for (int l = 0; l < ROLLUP_LEVEL_COUNT; l++) ringBytes += ROLLUP_LEVELS[l].capacity * sizeof(RollupRecord);
+  size_t total = LittleFS.totalBytes();
+  size_t budget = total > ringBytes + KPLOG_FS_RESERVE_BYTES ? (total - ringBytes - KPLOG_FS_RESERVE_BYTES) / 2 : 0;
+  kplogGenerationBytes = (min(budget, KPLOG_MAX_BYTES) / KPLOG_BLOCK_BYTES) * KPLOG_BLOCK_BYTES;
+  if (kplogGenerationBytes < KPLOG_BLOCK_BYTES) { Serial.println("[Log] No room for the columnar log – disabled"); return; }
+  File old = LittleFS.open(KPLOG_OLD_PATH, "r");
+  bool oldTooBig = old && old.size() > kplogGenerationBytes;  // written with a larger generation size
+  old.close();
+  if (oldTooBig) { LittleFS.remove(KPLOG_OLD_PATH); LittleFS.remove(KPLOG_OLD_INDEX_PATH); Serial.println("[Log] Dropped oversized old generation"); }
+  Serial.printf("[Log] Generation size %lu bytes (%lu free for logs)\n", (unsigned long)kplogGenerationBytes, (unsigned long)budget * 2);
+  kplogReady = true;
+}
+
+/**
+ * @brief Appends one fixed-size entry to the block index.
+ */
+void appendColumnarIndex(uint32_t startEpoch, uint32_t offset) {
+  KpLogIndexEntry e = { startEpoch, offset };
+  File idx = LittleFS.open(KPLOG_INDEX_PATH, "a");
+  if (!idx) return;
+  idx.write((const uint8_t*)&e, sizeof e);
+  idx.close();
+  kplogIndexCount++;
+}
+
+/**
+ * @brief Writes the hours between the last block on flash and 'hour' that the
+ * minute ring still holds. These are hours that were open when the device
+ * reset; without this they would only exist in the minute ring until it wraps.
+ */
+void closeColumnarBlocksAfterBoot(uint32_t hour) {
+  uint32_t from = hour - KPLOG_BOOT_CLOSE_MAX_HOURS * 3600UL;
+  if (kplogLastEpoch + 3600 > from) from = kplogLastEpoch + 3600;
+  File ring = LittleFS.open(ROLLUP_LEVELS[0].path, "r");
+  if (!ring) return;
+  for (uint32_t h = from; h < hour; h += 3600) {
+    bool any = false;
+    for (int c = 0; c < KPLOG_COLUMN_COUNT; c++)
+      for (int r = 0; r < KPLOG_ROWS_PER_BLOCK; r++) kplogColumns[c][r] = KPLOG_MISSING;
+    kplogBlockEpoch = h;
+    for (uint32_t m = h; m < h + 3600; m += KPLOG_ROW_SECONDS) {
+      RollupRecord prev;
+      ring.seek(rollupSlotOffset(0, m), SeekSet);
+      if (ring.read((uint8_t*)&prev, sizeof prev) == sizeof prev && prev.epoch == m) { setColumnarRow(prev); any = true; }
+    }
+    if (any) {
+      flushColumnarBlock();
+      Serial.printf("[Log] Closed hour %lu left open at reset\n", (unsigned long)h);
+    }
+  }
+  ring.close();
+}
+
+/**
+ * @brief Stores a closed minute as one row of the open hourly block; a new
+ * hour flushes the previous block first. The first row after boot closes the
+ * hours left open by the reset, then back-fills the earlier minutes of this
+ * hour from the minute ring.
+ * @param rec Closed minute rollup.
+ */
+void appendColumnarRow(const RollupRecord& rec) {
+  if (!kplogReady) return;
+  uint32_t hour = rec.epoch - rec.epoch % 3600;
+  if (kplogBlockEpoch != hour) {
+    bool afterBoot = kplogBlockEpoch == 0;
+    if (afterBoot) closeColumnarBlocksAfterBoot(hour);
+    else flushColumnarBlock();
+    for (int c = 0; c < KPLOG_COLUMN_COUNT; c++)
+      for (int r = 0; r < KPLOG_ROWS_PER_BLOCK; r++) kplogColumns[c][r] = KPLOG_MISSING;
+    kplogBlockEpoch = hour;
+    if (afterBoot) {
+      for (uint32_t m = hour; m < rec.epoch; m += KPLOG_ROW_SECONDS) {
+        RollupRecord prev;
+        if (readRollupRecord(0, m, prev)) setColumnarRow(prev);
+      }
+    }
+  }
+  setColumnarRow(rec);
+}
+
+/**
+ * @brief Converts a minute rollup to fixed-point and writes it into its row.
+ */
+void setColumnarRow(const RollupRecord& rec) {
+  int row = (rec.epoch - kplogBlockEpoch) / KPLOG_ROW_SECONDS;
+  if (row < 0 || row >= KPLOG_ROWS_PER_BLOCK) return;
+  const int metricColumn[METRIC_COUNT] = { KPLOG_COL_AMMONIA, KPLOG_COL_TEMPERATURE, KPLOG_COL_HUMIDITY, KPLOG_COL_STORAGE_TANK };
+  for (int m = 0; m < METRIC_COUNT; m++) {
+    int c = metricColumn[m];
+    kplogColumns[c][row] = rec.count[m] ? (int16_t)constrain(lroundf(rec.mean[m] * KPLOG_COLUMN_SCALE[c]), -32767L, 32767L) : KPLOG_MISSING;
+  }
+  for (int r = 0; r < RELAY_ID_COUNT; r++) kplogColumns[KPLOG_COL_PUMP_DUTY + r][row] = (int16_t)((rec.dutyMs[r] + 500) / 1000);
+}
+
+/**
+ * @brief Writes the open block (header with min/max and CRCs, then columns) and
+ * indexes it. Rotates to the ".old" generation when the log reaches kplogGenerationBytes.
+ */
+void flushColumnarBlock() {
+  KpLogBlockHeader h;
+  memset(&h, 0, sizeof h);
+  h.magic = KPLOG_MAGIC; h.version = KPLOG_VERSION; h.rowCount = KPLOG_ROWS_PER_BLOCK;
+  h.startEpoch = kplogBlockEpoch; h.columnCount = KPLOG_COLUMN_COUNT;
+  for (int c = 0; c < KPLOG_COLUMN_COUNT; c++) {
+    h.colMin[c] = h.colMax[c] = KPLOG_MISSING;
+    for (int r = 0; r < KPLOG_ROWS_PER_BLOCK; r++) {
+      int16_t v = kplogColumns[c][r];
+      if (v == KPLOG_MISSING) continue;
+      if (h.colMin[c] == KPLOG_MISSING || v < h.colMin[c]) h.colMin[c] = v;
+      if (h.colMax[c] == KPLOG_MISSING || v > h.colMax[c]) h.colMax[c] = v;
+    }
+  }
+  h.payloadCrc = kplogCrc32(kplogColumns, KPLOG_PAYLOAD_BYTES);
+  h.headerCrc  = kplogHeaderCrc(h);
+
+  if (kplogAppendOffset + KPLOG_BLOCK_BYTES > kplogGenerationBytes) {
+    LittleFS.remove(KPLOG_OLD_PATH); LittleFS.remove(KPLOG_OLD_INDEX_PATH);
+    LittleFS.rename(KPLOG_PATH, KPLOG_OLD_PATH); LittleFS.rename(KPLOG_INDEX_PATH, KPLOG_OLD_INDEX_PATH);
+    File c = LittleFS.open(KPLOG_INDEX_PATH, "w"); c.close();
+    kplogAppendOffset = 0; kplogIndexCount = 0;
+    Serial.println("[Log] Rotated columnar log");
+  }
+
+  // Block first, index second: a loss between the two is repaired by recoverColumnarLog().
+  File log = LittleFS.open(KPLOG_PATH, "a");
+  if (!log) return;
+  size_t written = log.write((const uint8_t*)&h, sizeof h);
+  written += log.write((const uint8_t*)kplogColumns, KPLOG_PAYLOAD_BYTES);
+  log.close();
+  if (written != KPLOG_BLOCK_BYTES) { Serial.println("[Log] Short write – block dropped"); truncateLittleFsFile(KPLOG_PATH, kplogAppendOffset); return; }
+  appendColumnarIndex(h.startEpoch, kplogAppendOffset);
+  kplogAppendOffset += KPLOG_BLOCK_BYTES;
+  kplogLastEpoch = h.startEpoch;
+}
+
+/**
+ * @brief GET /api/log?file=log|index|oldlog|oldindex
+ * Streams a raw log or index file for tools/kplog2csv.
+ */
+void handleLogDownload() {
+  String which = localApi.arg("file");
+  const char* path = which == "index" ? KPLOG_INDEX_PATH : which == "oldlog" ? KPLOG_OLD_PATH
+                   : which == "oldindex" ? KPLOG_OLD_INDEX_PATH : KPLOG_PATH;
+  File f = LittleFS.open(path, "r");
+  if (!f) { localApi.send(404, "text/plain", "not found"); return; }
+  localApi.streamFile(f, "application/octet-stream");
+  f.close();
+}
+
+// ===================================================================================
+//          Relay scheduler
+// ===================================================================================
+
+/**
+ * @brief Parses one cron field into a bitmask.
+ * Supports "*", single values, ranges ("1-5"), lists ("0,30") and steps ("8-18/2").
+ * @param field The field text (modified in place by the tokenizer).
+ * @param lo Lowest allowed value.
+ * @param hi Highest allowed value.
+ * @param mask Receives the resulting bitmask.
+ * @return true if the field is valid.
+ */
+bool parseCronField(char* field, int lo, int hi, uint64_t& mask) {
+  mask = 0;
+  char* save = nullptr;
+  for (char* part = strtok_r(field, ",", &save); part; part = strtok_r(nullptr, ",", &save)) {
+    int from = lo, to = hi, step = 1;
+    char* slash = strchr(part, '/');
+    if (slash) { *slash = '\0'; step = atoi(slash + 1); if (step <= 0) return false; }
+    if (strcmp(part, "*") != 0) {
+      char* dash = strchr(part, '-');
+      from = atoi(part);
+      to   = dash ? atoi(dash + 1) : (slash ? hi : from);
+    }
+    if (from < lo || to > hi || from > to) return false;
+    for (int v = from; v <= to; v += step) mask |= (1ULL << v);
+  }
+  return mask != 0;
+}
+
+/**
+ * @brief Builds a schedule entry from a standard 5-field cron expression.
+ * Day-of-month and month must be "*"; barn routines are daily or weekly.
+ * @param relay The RelayId to switch.
+ * @param turnOn true to switch the relay ON, false for OFF.
+ * @param cronExpr "minute hour day-of-month month day-of-week", e.g. "0 19 * * *".
+ * @param out Receives the parsed entry.
+ * @return true if the expression is valid.
+ */
+bool parseRelaySchedule(uint8_t relay, bool turnOn, const char* cronExpr, RelaySchedule& out) {
+  char buf[64];
+  strncpy(buf, cronExpr, sizeof buf - 1); buf[sizeof buf - 1] = '\0';
+  char* fields[5]; int n = 0; char* save = nullptr;
+  for (char* tok = strtok_r(buf, " \t", &save); tok && n < 5; tok = strtok_r(nullptr, " \t", &save)) fields[n++] = tok;
+  if (n != 5 || relay >= RELAY_ID_COUNT) return false;
+  if (strcmp(fields[2], "*") != 0 || strcmp(fields[3], "*") != 0) return false;
+
+  uint64_t minutes, hours, days;
+  if (!parseCronField(fields[0], 0, 59, minutes)) return false;
+  if (!parseCronField(fields[1], 0, 23, hours))   return false;
+  if (!parseCronField(fields[4], 0, 7,  days))    return false;
+  if (days & (1ULL << 7)) days |= 1; // cron allows 7 for Sunday
+
+  out.minuteMask = minutes;
+  out.hourMask   = (uint32_t)hours;
+  out.dowMask    = (uint8_t)(days & 0x7F);
+  out.relay      = relay;
+  out.turnOn     = turnOn ? 1 : 0;
+  out.reserved   = 0;
+  return true;
+}
+
+/**
+ * @brief Adds a schedule entry and persists the table to NVS.
+ * @param relayName One of RELAY_NAMES ("pump", "aux", "cctv", "siren").
+ * @param turnOn true to switch the relay ON at the given times, false for OFF.
+ * @param cronExpr 5-field cron expression, see parseRelaySchedule().
+ * @return true if the entry was accepted.
+ */
+bool addRelaySchedule(const char* relayName, bool turnOn, const char* cronExpr) {
+  if (relayScheduleCount >= MAX_RELAY_SCHEDULES) { Serial.println("[Scheduler] Table full"); return false; }
+  uint8_t relay = RELAY_ID_COUNT;
+  for (uint8_t i = 0; i < RELAY_ID_COUNT; i++) if (strcmp(relayName, RELAY_NAMES[i]) == 0) relay = i;
+  RelaySchedule entry;
+  if (!parseRelaySchedule(relay, turnOn, cronExpr, entry)) {
+    Serial.printf("[Scheduler] Rejected '%s %s %s'\n", relayName, turnOn ? "on" : "off", cronExpr);
+    return false;
+  }
+  relaySchedules[relayScheduleCount++] = entry;
+  saveRelaySchedules();
+  planRelaySchedules();
+  return true;
+}
+
+/**
+ * @brief Removes the schedule entry at the given index and persists the table.
+ * @param index Position in relaySchedules[].
+ * @return true if the entry existed.
+ */
+bool removeRelaySchedule(int index) {
+  if (index < 0 || index >= relayScheduleCount) return false;
+  for (int i = index; i < relayScheduleCount - 1; i++) relaySchedules[i] = relaySchedules[i + 1];
+  relayScheduleCount--;
+  saveRelaySchedules();
+  planRelaySchedules();
+  return true;
+}
+
+/**
+ * @brief Writes the schedule table to NVS.
+ */
+void saveRelaySchedules() {
+  prefs.begin(RELAY_SCHEDULE_NVS_NAMESPACE, false);
+  prefs.putBytes("entries", relaySchedules, relayScheduleCount * sizeof(RelaySchedule));
+  prefs.end();
+  Serial.printf("[Scheduler] Saved %d entries to NVS\n", relayScheduleCount);
+}
+
+/**
+ * @brief Loads the schedule table from NVS.
+ * Seeds evening/morning CCTV and auxiliary socket switching on first boot.
+ */
+void loadRelaySchedules() {
+  prefs.begin(RELAY_SCHEDULE_NVS_NAMESPACE, true);
+  bool stored = prefs.isKey("entries");
+  size_t len = stored ? prefs.getBytesLength("entries") : 0;
+  if (stored && len <= sizeof relaySchedules && len % sizeof(RelaySchedule) == 0) {
+    prefs.getBytes("entries", relaySchedules, len);
+    relayScheduleCount = len / sizeof(RelaySchedule);
+  }
+  prefs.end();
+
+  if (!stored) {
+    Serial.println("[Scheduler] No schedules in NVS, seeding defaults");
+    relayScheduleCount = 0;
+    RelaySchedule e;
+    if (parseRelaySchedule(RELAY_ID_CCTV, true,  "0 19 * * *", e)) relaySchedules[relayScheduleCount++] = e;
+    if (parseRelaySchedule(RELAY_ID_CCTV, false, "0 7 * * *",  e)) relaySchedules[relayScheduleCount++] = e;
+    if (parseRelaySchedule(RELAY_ID_AUX,  true,  "0 19 * * *", e)) relaySchedules[relayScheduleCount++] = e;
+    if (parseRelaySchedule(RELAY_ID_AUX,  false, "0 7 * * *",  e)) relaySchedules[relayScheduleCount++] = e;
+    saveRelaySchedules();
+  }
+  Serial.printf("[Scheduler] %d schedule entries loaded\n", relayScheduleCount);
+}
+
+/**
+ * @brief Computes the first time strictly after 'after' at which an entry fires.
+ * Uses bit scans over the hour/minute masks, so the cost is bounded by the
+ * number of weekdays (at most 8 iterations) regardless of the schedule.
+ * @param s The schedule entry.
+ * @param after Epoch seconds to search from.
+ * @return Next fire epoch, or 0 if the entry can never fire.
+ */
+time_t nextRelayScheduleFire(const RelaySchedule& s, time_t after) {
+  if (!s.minuteMask || !s.hourMask || !s.dowMask) return 0;
+  time_t t = after - (after % 60) + 60; // first whole minute after 'after'
+  struct tm tm; localtime_r(&t, &tm);
+
+  for (int day = 0; day < 8; day++) {
+    if (s.dowMask & (1U << tm.tm_wday)) {
+      int hour = -1, minute = 0;
+      uint64_t minsLeft = (s.minuteMask >> tm.tm_min) << tm.tm_min;
+      if ((s.hourMask & (1UL << tm.tm_hour)) && minsLeft) {
+        hour = tm.tm_hour; minute = __builtin_ctzll(minsLeft);
+      } else {
+        uint32_t hoursLeft = tm.tm_hour < 23 ? (s.hourMask >> (tm.tm_hour + 1)) << (tm.tm_hour + 1) : 0;
+        if (hoursLeft) { hour = __builtin_ctz(hoursLeft); minute = __builtin_ctzll(s.minuteMask); }
+      }
+      if (hour >= 0) {
+        tm.tm_hour = hour; tm.tm_min = minute; tm.tm_sec = 0; tm.tm_isdst = -1;
+        return mktime(&tm);
+      }
+    }
+    // Advance to midnight of the following day.
+    tm.tm_mday++; tm.tm_hour = 0; tm.tm_min = 0; tm.tm_sec = 0; tm.tm_isdst = -1;
+    mktime(&tm);
+  }
+  return 0;
+}
+
+/**
+ * @brief Computes the last time at or before 'atOrBefore' (whole minute) at
+ * which an entry fired; the mirror of nextRelayScheduleFire().
+ * @return Last fire epoch, or 0 if the entry did not fire in the past week.
+ */
+time_t prevRelayScheduleFire(const RelaySchedule& s, time_t atOrBefore) {
+  if (!s.minuteMask || !s.hourMask || !s.dowMask) return 0;
+  time_t t = atOrBefore - (atOrBefore % 60);
+  struct tm tm; localtime_r(&t, &tm);
+
+  for (int day = 0; day < 8; day++) {
+    if (s.dowMask & (1U << tm.tm_wday)) {
+      int hour = -1, minute = 0;
+      uint64_t minsUpTo = s.minuteMask & ((2ULL << tm.tm_min) - 1);
+      if ((s.hourMask & (1UL << tm.tm_hour)) && minsUpTo) {
+        hour = tm.tm_hour; minute = 63 - __builtin_clzll(minsUpTo);
+      } else {
+        uint32_t hoursBefore = s.hourMask & ((1UL << tm.tm_hour) - 1);
+        if (hoursBefore) { hour = 31 - __builtin_clz(hoursBefore); minute = 63 - __builtin_clzll(s.minuteMask); }
+      }
+      if (hour >= 0) {
+        tm.tm_hour = hour; tm.tm_min = minute; tm.tm_sec = 0; tm.tm_isdst = -1;
+        return mktime(&tm);
+      }
+    }
+    // Back to the last minute of the previous day.
+    tm.tm_mday--; tm.tm_hour = 23; tm.tm_min = 59; tm.tm_sec = 0; tm.tm_isdst = -1;
+    mktime(&tm);
+  }
+  return 0;
+}
+
+/**
+ * @brief Restores the min-heap property downwards from position i.
+ */
+void siftDownRelaySchedule(int i) {
+  for (;;) {
+    int l = 2 * i + 1, r = l + 1, smallest = i;
+    if (l < relayScheduleHeapSize && relayScheduleHeap[l].nextFire < relayScheduleHeap[smallest].nextFire) smallest = l;
+    if (r < relayScheduleHeapSize && relayScheduleHeap[r].nextFire < relayScheduleHeap[smallest].nextFire) smallest = r;
+    if (smallest == i) return;
+    RelayScheduleSlot tmp = relayScheduleHeap[i]; relayScheduleHeap[i] = relayScheduleHeap[smallest]; relayScheduleHeap[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+/**
+ * @brief Recomputes every entry's next fire time from the current wall clock and rebuilds the heap.
+ * Called at boot, after the table changes and whenever the clock steps.
+ */
+void planRelaySchedules() {
+  time_t now = time(nullptr);
+  relayScheduleHeapSize = 0;
+  scheduleRefEpoch  = now;
+  scheduleRefMillis = millis();
+  if (now < 946684800L) { Serial.println("[Scheduler] Clock not set, planning deferred"); return; }
+
+  for (int i = 0; i < relayScheduleCount; i++) {
+    time_t next = nextRelayScheduleFire(relaySchedules[i], now);
+    if (next == 0) continue;
+    relayScheduleHeap[relayScheduleHeapSize].nextFire = next;
+    relayScheduleHeap[relayScheduleHeapSize].entry    = i;
+    relayScheduleHeapSize++;
+  }
+  for (int i = relayScheduleHeapSize / 2 - 1; i >= 0; i--) siftDownRelaySchedule(i);
+
+  if (relayScheduleHeapSize > 0) {
+    struct tm tmNext; localtime_r(&relayScheduleHeap[0].nextFire, &tmNext);
+    Serial.printf("[Scheduler] Planned %d entries, next at %02d:%02d\n", relayScheduleHeapSize, tmNext.tm_hour, tmNext.tm_min);
+  }
+}
+
+/**
+ * @brief Puts each relay in the state its most recent schedule entry left it
+ * in, so a reboot or a clock step does not miss e.g. the evening CCTV ON.
+ * The pump is skipped: a scheduled pump ON is a timed run, not a state.
+ */
+void applyScheduledRelayStates() {
+  time_t now = time(nullptr);
+  if (now < 946684800L) return;
+  for (uint8_t r = 0; r < RELAY_ID_COUNT; r++) {
+    if (r == RELAY_ID_PUMP) continue;
+    time_t latest = 0;
+    bool   on     = false;
+    for (int i = 0; i < relayScheduleCount; i++) {
+      if (relaySchedules[i].relay != r) continue;
+      time_t fired = prevRelayScheduleFire(relaySchedules[i], now);
+      if (fired > latest) { latest = fired; on = relaySchedules[i].turnOn; }
+    }
+    if (latest == 0) continue;
+    Serial.printf("[Scheduler] %s should be %s since %ld s ago\n", RELAY_NAMES[r], on ? "ON" : "OFF", (long)(now - latest));
+    applyRelayCommand(r, on);
+  }
+}
+
+/**
+ * @brief Switches a relay through its cloud variable and callback so duration
+ * tracking and dashboard state stay consistent with manual switching.
+ */
+void applyRelayCommand(uint8_t relay, bool on) {
+  switch (relay) {
+    case RELAY_ID_PUMP:  if (storagePump      != on) { storagePump      = on; onStoragePumpChange(); }      break;
+    case RELAY_ID_AUX:   if (auxilliarySocket != on) { auxilliarySocket = on; onAuxilliarySocketChange(); } break;
+    case RELAY_ID_CCTV:  if (cCTV             != on) { cCTV             = on; onCCTVChange(); }             break;
+    case RELAY_ID_SIREN: if (siren            != on) { siren            = on; onSirenChange(); }            break;
+  }
+}
+
+/**
+ * @brief Fires due schedule entries. In the common case this is a single
+ * comparison against the heap root. Re-plans if the wall clock stepped.
+ * @param epoch Current wall-clock time.
+ * @param nowMillis Current millis() value.
+ */
+void serviceRelaySchedules(time_t epoch, unsigned long nowMillis) {
+  if (epoch < 946684800L) return;
+
+  time_t expected = scheduleRefEpoch + (time_t)((nowMillis - scheduleRefMillis) / 1000UL);
+  long   drift    = (long)(epoch - expected);
+  if (scheduleRefEpoch < 946684800L || drift > CLOCK_STEP_REPLAN_THRESHOLD_S || drift < -CLOCK_STEP_REPLAN_THRESHOLD_S) {
+    Serial.printf("[Scheduler] Clock stepped by %ld s, re-planning\n", drift);
+    planRelaySchedules();
+    applyScheduledRelayStates();
+    return;
+  }
+
+  if (relayScheduleHeapSize == 0 || relayScheduleHeap[0].nextFire > epoch) return;
+
+  while (relayScheduleHeapSize > 0 && relayScheduleHeap[0].nextFire <= epoch) {
+    const RelaySchedule& s = relaySchedules[relayScheduleHeap[0].entry];
+    Serial.printf("[Scheduler] Entry %d: %s -> %s\n", relayScheduleHeap[0].entry, RELAY_NAMES[s.relay], s.turnOn ? "ON" : "OFF");
+    applyRelayCommand(s.relay, s.turnOn);
+
+    time_t next = nextRelayScheduleFire(s, epoch);
+    if (next == 0) { relayScheduleHeap[0] = relayScheduleHeap[--relayScheduleHeapSize]; }
+    else           { relayScheduleHeap[0].nextFire = next; }
+    siftDownRelaySchedule(0);
+  }
+  ArduinoCloud.update(); // Push the new relay states to the dashboard.
+}
+
+// ===================================================================================
+//          Watchdog & crash records
+// ===================================================================================
+
+/**
+ * @brief Records the stage a watched task enters and, if the task is
+ * subscribed, feeds the task watchdog. Never inlined, so the return address is
+ * the caller's position.
+ */
+__attribute__((noinline))
+void markStage(WatchedTask task, WatchStage stage) {
+  uintptr_t ra = (uintptr_t)__builtin_return_address(0);
+#if defined(__XTENSA__)
+  ra = (ra & 0x3FFFFFFFUL) | 0x40000000UL;  // strip the windowed-ABI call-size bits
+#endif
+  WatchMark m = { (uint32_t)ra, (uint32_t)millis(), stage };
+  if (crashTrail.task[task].stage != stage) traceEvent(KPTRACE_STAGE, task, stage, 0);
+  crashTrail.task[task] = m;
+  if (task == WATCH_LOOP) {
+    crashTrail.loopTrail[crashTrail.loopTrailHead] = m;
+    crashTrail.loopTrailHead = (crashTrail.loopTrailHead + 1) % CRASH_TRAIL_LEN;
+  }
+  if (watchSubscribed[task]) esp_task_wdt_reset();
+}
+
+/**
+ * @brief Adds the calling task to the task watchdog.
+ */
+void watchdogSubscribe(WatchedTask task) {
+  if (watchSubscribed[task]) return;
+  crashTrail.task[task].ms = millis();
+  if (esp_task_wdt_add(nullptr) == ESP_OK) watchSubscribed[task] = true;
+  else Serial.printf("[WDT] Could not watch task %s\n", WATCHED_TASK_NAMES[task]);
+}
+
+/**
+ * @brief Removes the calling task from the task watchdog.
+ */
+void watchdogUnsubscribe(WatchedTask task) {
+  if (!watchSubscribed[task]) return;
+  watchSubscribed[task] = false;
+  esp_task_wdt_delete(nullptr);
+}
+
+/**
+ * @brief Task watchdog hook, called from its interrupt just before the panic
+ * reboot: de-energises every relay and notes which subscribed task has gone
+ * longest without a stage change. Relays are switched through the GPIO set and
+ * clear registers (digitalWrite is not IRAM-resident) and nothing is traced.
+ */
+extern "C" void IRAM_ATTR esp_task_wdt_isr_user_handler(void) {
+  if (BOARD.relayActiveLow) {
+    GPIO.out_w1ts = RELAY_GPIO_MASK_LO;
+    GPIO.out1_w1ts.val = RELAY_GPIO_MASK_HI;
+  } else {
+    GPIO.out_w1tc = RELAY_GPIO_MASK_LO;
+    GPIO.out1_w1tc.val = RELAY_GPIO_MASK_HI;
+  }
+  uint32_t now = millis(), worst = 0;
+  crashTrail.stalledTask = -1;
+  for (int t = 0; t < WATCH_TASK_COUNT; t++) {
+    if (!watchSubscribed[t] || now - crashTrail.task[t].ms < worst) continue;
+    worst = now - crashTrail.task[t].ms;
+    crashTrail.stalledTask = t;
+  }
+}
+
+/**
+ * @brief Turns the RTC trail of an abnormal reset into a crash record in NVS,
+ * clears the trail and arms the task watchdog with WDT_TIMEOUT_S.
+ */
+void initWatchdog() {
+  esp_reset_reason_t why = esp_reset_reason();
+  const char* reason = nullptr;
+  switch (why) {
+    case ESP_RST_TASK_WDT: reason = "taskWdt";  break;
+    case ESP_RST_INT_WDT:  reason = "intWdt";   break;
+    case ESP_RST_WDT:      reason = "wdt";      break;
+    case ESP_RST_PANIC:    reason = "panic";    break;
+    case ESP_RST_BROWNOUT: reason = "brownout"; break;
+    default: break;
+  }
+
+  Preferences p;
+  p.begin(CRASH_NVS_NAMESPACE, false);
+  CrashRecord rec = {};
+  if (p.getBytesLength("last") == sizeof rec) p.getBytes("last", &rec, sizeof rec);
+  rec.pending = p.getUChar("report", 0) != 0;
+  if (reason) {
+    bool trail = crashTrail.magic == CRASH_TRAIL_MAGIC;  // RTC memory is random after power-on
+    rec.pending = true;
+    rec.count++;
+    snprintf(rec.reason, sizeof rec.reason, "%s", reason);
+    rec.task = WATCH_TASK_COUNT;
+    if (trail) {
+      int t = crashTrail.stalledTask;
+      if (t < 0 || t >= WATCH_TASK_COUNT) t = WATCH_LOOP;  // panics carry no task; the loop's stage is the best hint
+      rec.task  = why == ESP_RST_TASK_WDT ? t : WATCH_TASK_COUNT;
+      rec.stage = crashTrail.task[t].stage;
+      rec.pc    = crashTrail.task[t].pc;
+      uint32_t lastMs = 0;
+      for (int k = 0; k < WATCH_TASK_COUNT; k++) lastMs = max(lastMs, crashTrail.task[k].ms);
+      rec.uptimeS = lastMs / 1000;
+      for (int i = 0; i < CRASH_TRAIL_LEN; i++) {
+        const WatchMark& m = crashTrail.loopTrail[(crashTrail.loopTrailHead + i) % CRASH_TRAIL_LEN];
+        rec.trailStage[i] = m.stage;
+        rec.trailPc[i]    = m.pc;
+      }
+    }
+    p.putBytes("last", &rec, sizeof rec);
+    p.putUChar("report", 1);
+    Serial.printf("[WDT] Previous boot ended by %s in %s/%s at %08lx after %lu s\n", rec.reason,
+                  rec.task < WATCH_TASK_COUNT ? WATCHED_TASK_NAMES[rec.task] : "?",
+                  rec.stage < STAGE_COUNT ? WATCH_STAGE_NAMES[rec.stage] : "?",
+                  (unsigned long)rec.pc, (unsigned long)rec.uptimeS);
+  }
+  p.end();
+  portENTER_CRITICAL(&crashMux);
+  crashRecord = rec;
+  portEXIT_CRITICAL(&crashMux);
+
+  memset(&crashTrail, 0, sizeof crashTrail);
+  crashTrail.magic       = CRASH_TRAIL_MAGIC;
+  crashTrail.stalledTask = -1;
+
+  esp_task_wdt_config_t cfg = { WDT_TIMEOUT_S * 1000, 0, true };
+  esp_err_t err = esp_task_wdt_reconfigure(&cfg);
+  if (err == ESP_ERR_INVALID_STATE) err = esp_task_wdt_init(&cfg);  // not started by the core
+  if (err != ESP_OK) Serial.printf("[WDT] Task watchdog setup failed (%d)\n", (int)err);
+}
+
+// ===================================================================================
+//          Event trace
+// ===================================================================================
+
+/**
+ * @brief Appends one event to the trace ring. Lock-free and safe from any task
+ * or core; the oldest event is overwritten.
+ * @param kind KPTRACE_STAGE, KPTRACE_INSTANT or KPTRACE_RELAY.
+ * @param track WatchedTask the event belongs to.
+ * @param id Stage, TraceEventId or relay GPIO.
+ * @param arg Value shown with the event.
+ */
+void IRAM_ATTR traceEvent(uint8_t kind, uint8_t track, uint16_t id, int32_t arg) {
+  if (traceFrozen.load(std::memory_order_relaxed)) return;
+  uint32_t i = traceHead.fetch_add(1, std::memory_order_relaxed);
+  KpTraceEvent& e = traceRing[i % TRACE_EVENTS];
+  e.us    = (uint32_t)micros();
+  e.kind  = kind;
+  e.track = track;
+  e.id    = id;
+  e.arg   = arg;
+}
+
+/**
+ * @brief Writes a dump of the trace ring (see KambingPRO_Trace.h) to a sink.
+ * @param head Events recorded so far, sampled once by the caller.
+ * @param sink void(const uint8_t*, size_t)
+ * @return Dump length in bytes.
+ */
+template <typename Sink>
+size_t writeTraceDump(uint32_t head, uint32_t nowUs, Sink&& sink) {
+  return kptraceWriteDump(traceRing, TRACE_EVENTS, head, nowUs, WATCHED_TASK_NAMES, WATCH_TASK_COUNT,
+                          WATCH_STAGE_NAMES, STAGE_COUNT, TRACE_EVENT_NAMES, TRACE_EVENT_ID_COUNT, sink);
+}
+
+/**
+ * @brief GET /api/trace – binary trace dump for tools/kptrace2json.
+ */
+void handleTraceRequest() {
+  uint32_t head  = traceHead.load();
+  uint32_t nowUs = micros();
+  size_t length = writeTraceDump(head, nowUs, [](const uint8_t*, size_t) {});
+  localApi.setContentLength(length);
+  localApi.send(200, "application/octet-stream", "");
+  static char chunk[512];
+  size_t used = 0;
+  writeTraceDump(head, nowUs, [&](const uint8_t* p, size_t n) {
+    while (n > 0) {
+      size_t k = min(n, sizeof chunk - used);
+      memcpy(chunk + used, p, k);
+      used += k; p += k; n -= k;
+      if (used == sizeof chunk) { localApi.sendContent(chunk, used); used = 0; }
+    }
+  });
+  if (used > 0) localApi.sendContent(chunk, used);
+}
+
+/**
+ * @brief Starts printing the trace dump as base64 lines between KPTRACE
+ * BEGIN/END markers; serviceTraceSerialDump() prints the lines. Capture the
+ * terminal and feed it to tools/kptrace2json.
+ * @return False if a dump is already running.
+ */
+bool startTraceSerialDump() {
+  if (traceSerialActive) return false;
+  traceFrozen = true;  // the ring must not wrap under a dump that takes seconds
+  traceSerialHead   = traceHead.load();
+  traceSerialNowUs  = micros();
+  traceSerialLength = writeTraceDump(traceSerialHead, traceSerialNowUs, [](const uint8_t*, size_t) {});
+  traceSerialOffset = 0;
+  traceSerialActive = true;
+  Serial.printf("KPTRACE BEGIN %u\n", (unsigned)traceSerialLength);
+  return true;
+}
+
+/**
+ * @brief Prints the next TRACE_SERIAL_LINES_PER_PASS lines of a running serial
+ * dump. The dump is regenerated from the frozen ring and bytes already printed
+ * are skipped, so no copy of it is kept. Returns at once when no dump runs.
+ */
+void serviceTraceSerialDump() {
+  if (!traceSerialActive) return;
+  uint8_t group[57];  // 57 bytes -> one 76-character base64 line
+  char    line[77];
+  size_t  used = 0, pos = 0, lines = 0;
+  writeTraceDump(traceSerialHead, traceSerialNowUs, [&](const uint8_t* p, size_t n) {
+    if (pos + n <= traceSerialOffset || lines == TRACE_SERIAL_LINES_PER_PASS) { pos += n; return; }
+    if (pos < traceSerialOffset) { size_t skip = traceSerialOffset - pos; p += skip; n -= skip; pos += skip; }
+    while (n > 0 && lines < TRACE_SERIAL_LINES_PER_PASS) {
+      size_t k = min(n, sizeof group - used);
+      memcpy(group + used, p, k);
+      used += k; p += k; n -= k; pos += k;
+      if (used == sizeof group) { kpBase64Encode(group, used, line); Serial.println(line); used = 0; lines++; }
+    }
+    pos += n;
+  });
+  traceSerialOffset += lines * sizeof group;
+  if (traceSerialOffset + used < traceSerialLength) return;
+  if (used > 0) { kpBase64Encode(group, used, line); Serial.println(line); }
+  Serial.println("KPTRACE END");
+  traceSerialActive = false;
+  traceFrozen = false;
+}
+
+// ===================================================================================
+//          Runtime parameters
+// ===================================================================================
+
+void applyPumpOnParam() {
+  pumpOnDurationMs = paramValues[PARAM_PUMP_ON_MS].u;  // auto-tuning continues from here
+}
+
+void applyMq137Params() {
+  Mq137Calibration cal = { paramValues[PARAM_MQ_RL].f, paramValues[PARAM_MQ_OFFSET].f, paramValues[PARAM_MQ_DIV].f };
+  forEachSensor([&](auto& s) {
+    using S = typename std::decay<decltype(s)>::type;
+    if constexpr (std::is_same<S, Mq137Sensor>::value) {
+      if (&s.readings[0] == primaryReading[SENSOR_NH3]) s.calibration() = cal;
+    }
+  });
+}
+
+/**
+ * @brief Points the primary tank sensor at the board's flash table, or at a
+ * table rebuilt in RAM when the geometry parameters differ from the profile.
+ */
+void applyTankParams() {
+  TankGeometry g = { paramValues[PARAM_TANK_HEIGHT].f, paramValues[PARAM_TANK_R_TOP].f, paramValues[PARAM_TANK_R_BOTTOM].f };
+  TankModel model = PRIMARY_TANK;
+  if (g.heightCm != BOARD.tank.heightCm || g.radiusTopCm != BOARD.tank.radiusTopCm || g.radiusBottomCm != BOARD.tank.radiusBottomCm) {
+    int size = min((int)(g.heightCm / TANK_TABLE_STEP_CM) + 2, TANK_PARAM_TABLE_MAX);
+    for (int i = 0; i < size; i++) tankParamTable[i] = frustumVolumeLiters(g, min(i * TANK_TABLE_STEP_CM, g.heightCm));
+    model = { g.heightCm, TANK_TABLE_STEP_CM, tankParamTable, size };
+  }
+  forEachSensor([&](auto& s) {
+    using S = typename std::decay<decltype(s)>::type;
+    if constexpr (std::is_same<S, UltrasonicTankSensor>::value) {
+      if (&s.readings[0] == primaryReading[SENSOR_TANK]) s.setModel(model);
+    }
+  });
+}
+
+void applyTankReserveParam() {
+  tankReserveLiters = paramValues[PARAM_TANK_RESERVE].f;
+}
+
+void applyNtpParam() {
+  ntpSyncIntervalMs = paramValues[PARAM_NTP_SYNC_H].u * 3600UL * 1000UL;
+}
+
+const ParamDef PARAM_DEFS[PARAM_COUNT] = {
+  { "pumpOnMs",     PARAM_UINT,  (float)PUMP_MIN_DURATION_MS, (float)PUMP_MAX_DURATION_MS, { .u = (uint32_t)PUMP_ON_DURATION_MS }, "ms", applyPumpOnParam },
+  { "mqRlKohm",     PARAM_FLOAT, 0.1f,   1000.0f, { .f = BOARD.mq137.loadResistorKohm },  "kOhm", applyMq137Params },
+  { "mqOffsetPpm",  PARAM_FLOAT, -100.0f, 100.0f, { .f = BOARD.mq137.ammoniaOffsetPpm },  "ppm",  applyMq137Params },
+  { "mqScaleDiv",   PARAM_FLOAT, 0.01f,  1000.0f, { .f = BOARD.mq137.ammoniaScalingDiv }, "",     applyMq137Params },
+  { "tankHeightCm", PARAM_FLOAT, 5.0f, TANK_PARAM_MAX_HEIGHT_CM, { .f = BOARD.tank.heightCm }, "cm", applyTankParams },
+  { "tankRTopCm",   PARAM_FLOAT, 1.0f,   200.0f,  { .f = BOARD.tank.radiusTopCm },       "cm",   applyTankParams },
+  { "tankRBotCm",   PARAM_FLOAT, 1.0f,   200.0f,  { .f = BOARD.tank.radiusBottomCm },    "cm",   applyTankParams },
+  { "tankReserveL", PARAM_FLOAT, 0.0f,   500.0f,  { .f = TANK_RESERVE_LITERS },          "L",    applyTankReserveParam },
+  { "ntpSyncH",     PARAM_UINT,  1.0f,   168.0f,  { .u = (uint32_t)(NTP_SYNC_INTERVAL_MS / 3600000UL) }, "h", applyNtpParam },
+};
+
+/**
+ * @brief Looks a parameter up by key. @return ParamId, or -1.
+ */
+int findParam(const char* key) {
+  for (int i = 0; i < PARAM_COUNT; i++) if (!strcmp(key, PARAM_DEFS[i].key)) return i;
+  return -1;
+}
+
+/**
+ * @brief Writes "key=value" into buf.
+ */
+void formatParam(ParamId id, char* buf, size_t size) {
+  const ParamDef& d = PARAM_DEFS[id];
+  if (d.type == PARAM_UINT) snprintf(buf, size, "%s=%lu", d.key, (unsigned long)paramValues[id].u);
+  else                      snprintf(buf, size, "%s=%g", d.key, paramValues[id].f);
+}
+
+/**
+ * @brief Parses and range-checks a value for a parameter.
+ * @return False if text is not a number of the parameter's type or out of range.
+ */
+bool parseParamValue(ParamId id, const char* text, ParamValue& out) {
+  const ParamDef& d = PARAM_DEFS[id];
+  char* end;
+  if (d.type == PARAM_UINT) {
+    if (*text == '-') return false;
+    unsigned long v = strtoul(text, &end, 10);
+    if (end == text || *end || v < d.minValue || v > d.maxValue) return false;
+    out.u = (uint32_t)v;
+  } else {
+    float v = strtof(text, &end);
+    if (end == text || *end || !isfinite(v) || v < d.minValue || v > d.maxValue) return false;
+    out.f = v;
+  }
+  return true;
+}
+
+/**
+ * @brief Validates, saves to NVS and applies a new value.
+ * @param reply Receives "key=value" or an error message.
+ * @return True if the value was accepted.
+ */
+bool setParamText(ParamId id, const char* text, char* reply, size_t replySize) {
+  const ParamDef& d = PARAM_DEFS[id];
+  ParamValue v;
+  if (!parseParamValue(id, text, v)) {
+    snprintf(reply, replySize, "error: %s must be %s in %g..%g", d.key, d.type == PARAM_UINT ? "an integer" : "a number",
+             d.minValue, d.maxValue);
+    return false;
+  }
+  Preferences p;
+  p.begin(PARAM_NVS_NAMESPACE, false);
+  bool saved = d.type == PARAM_UINT ? p.putUInt(d.key, v.u) > 0 : p.putFloat(d.key, v.f) > 0;
+  p.end();
+  paramValues[id] = v;
+  d.onChange();
+  formatParam(id, reply, replySize);
+  Serial.printf("[Param] %s%s\n", reply, saved ? "" : " (NVS write failed, lost on reboot)");
+  return true;
+}
+
+/**
+ * @brief Restores a parameter's default and removes it from NVS.
+ */
+void resetParam(ParamId id, char* reply, size_t replySize) {
+  const ParamDef& d = PARAM_DEFS[id];
+  Preferences p;
+  p.begin(PARAM_NVS_NAMESPACE, false);
+  p.remove(d.key);
+  p.end();
+  paramValues[id] = d.defaultValue;
+  d.onChange();
+  formatParam(id, reply, replySize);
+  Serial.printf("[Param] %s (default)\n", reply);
+}
+
+/**
+ * @brief Fills the cache from NVS (defaults for missing or out-of-range
+ * entries) and applies every parameter. Runs once after beginSensors().
+ */
+void loadParams() {
+  Preferences p;
+  p.begin(PARAM_NVS_NAMESPACE, true);
+  int stored = 0;
+  for (int i = 0; i < PARAM_COUNT; i++) {
+    const ParamDef& d = PARAM_DEFS[i];
+    ParamValue v = d.defaultValue;
+    if (p.isKey(d.key)) {
+      if (d.type == PARAM_UINT) v.u = p.getUInt(d.key, d.defaultValue.u);
+      else                      v.f = p.getFloat(d.key, d.defaultValue.f);
+      float x = d.type == PARAM_UINT ? (float)v.u : v.f;
+      if (isfinite(x) && x >= d.minValue && x <= d.maxValue) stored++;
+      else { Serial.printf("[Param] Stored %s out of range, using the default\n", d.key); v = d.defaultValue; }
+    }
+    paramValues[i] = v;
+  }
+  p.end();
+  for (int i = 0; i < PARAM_COUNT; i++) {
+    bool shared = false;  // several parameters share one hook; run each hook once
+    for (int j = 0; j < i; j++) if (PARAM_DEFS[j].onChange == PARAM_DEFS[i].onChange) shared = true;
+    if (!shared) PARAM_DEFS[i].onChange();
+  }
+  Serial.printf("[Param] %d of %d parameters set from NVS\n", stored, (int)PARAM_COUNT);
+}
+
+/**
+ * @brief /api/params – GET without arguments lists every parameter as JSON,
+ * GET ?key=K reads one. POST key=K&value=V&token=T sets one (value=default
+ * restores it); T must match PARAM_API_TOKEN, and an empty token disables it.
+ */
+void handleParamsRequest() {
+  char reply[PARAM_REPLY_MAX];
+  String value = localApi.arg("value");
+  if (localApi.method() != HTTP_POST && !value.isEmpty()) {
+    localApi.send(405, "application/json", "{\"error\":\"use POST to set a parameter\"}");
+    return;
+  }
+  if (localApi.method() == HTTP_POST && (!PARAM_API_TOKEN[0] || localApi.arg("token") != PARAM_API_TOKEN)) {
+    localApi.send(403, "application/json", "{\"error\":\"bad token\"}");
+    return;
+  }
+  if (localApi.hasArg("key")) {
+    int id = findParam(localApi.arg("key").c_str());
+    if (id < 0) { localApi.send(404, "application/json", "{\"error\":\"unknown parameter\"}"); return; }
+    bool ok = true;
+    if (value == "default")     resetParam((ParamId)id, reply, sizeof reply);
+    else if (!value.isEmpty())  ok = setParamText((ParamId)id, value.c_str(), reply, sizeof reply);
+    else                        formatParam((ParamId)id, reply, sizeof reply);
+    char body[PARAM_REPLY_MAX + 32];
+    snprintf(body, sizeof body, "{\"%s\":\"%s\"}", ok ? "ok" : "error", reply);
+    localApi.send(ok ? 200 : 400, "application/json", body);
+    return;
+  }
+  localApi.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  localApi.send(200, "application/json", "[");
+  char line[192];
+  for (int i = 0; i < PARAM_COUNT; i++) {
+    const ParamDef& d = PARAM_DEFS[i];
+    bool u = d.type == PARAM_UINT;
+    char value[24], def[24];
+    if (u) { snprintf(value, sizeof value, "%lu", (unsigned long)paramValues[i].u); snprintf(def, sizeof def, "%lu", (unsigned long)d.defaultValue.u); }
+    else   { snprintf(value, sizeof value, "%g", paramValues[i].f);                 snprintf(def, sizeof def, "%g", d.defaultValue.f); }
+    snprintf(line, sizeof line, "%s{\"key\":\"%s\",\"type\":\"%s\",\"value\":%s,\"default\":%s,\"min\":%g,\"max\":%g,\"unit\":\"%s\"}",
+             i ? "," : "", d.key, u ? "uint" : "float", value, def, d.minValue, d.maxValue, d.unit);
+    localApi.sendContent(line);
+  }
+  localApi.sendContent("]");
+  localApi.sendContent("");
+}
+
+// ===================================================================================
+//          Serial console
+// ===================================================================================
+
+/**
+ * @brief printf to Serial through a static buffer (no heap); output longer than
+ * CONSOLE_OUT_MAX is cut.
+ */
+void consolePrintf(const char* fmt, ...) {
+  static char buf[CONSOLE_OUT_MAX];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof buf, fmt, ap);
+  va_end(ap);
+  if (n > 0) Serial.write((const uint8_t*)buf, min(n, (int)sizeof buf - 1));
+}
+
+/**
+ * @brief Prints a value with one decimal, or "--" if it is NAN.
+ */
+const char* consoleValue(char* buf, size_t size, float v) {
+  if (isnan(v)) snprintf(buf, size, "--");
+  else          snprintf(buf, size, "%.1f", v);
+  return buf;
+}
+
+void consoleStatus(int, char**) {
+  char a[12], b[12], c[12], d[12];
+  time_t now = time(nullptr);
+  struct tm tmNow; localtime_r(&now, &tmNow);
+  char when[24];
+  strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", &tmNow);
+  consolePrintf("%s build %u | %s | up %lu s | WiFi %s | Cloud %s\n", THING_UID_NAME, (unsigned)FIRMWARE_BUILD,
+                now >= 946684800L ? when : "clock not set", millis() / 1000,
+                WiFi.status() == WL_CONNECTED ? "up" : "down", ArduinoCloud.connected() ? "up" : "down");
+  const SensorSnapshot snap = sensorSnapshot.read();
+  consolePrintf("Sensors: T %s C | RH %s %% | NH3 %s ppm | tank %s L | stale 0x%x | health %u/%u/%u/%u\n",
+                consoleValue(a, sizeof a, snap.current(SENSOR_TEMP)), consoleValue(b, sizeof b, snap.current(SENSOR_HUM)),
+                consoleValue(c, sizeof c, snap.value[SENSOR_NH3]), consoleValue(d, sizeof d, snap.value[SENSOR_TANK]),
+                snap.staleMask, snap.health[0], snap.health[1], snap.health[2], snap.health[3]);
+  int nextSlot = flushPlanCursor < flushPlanLength ? flushPlan[flushPlanCursor] : -1;
+  char next[8];
+  if (nextSlot < 0) snprintf(next, sizeof next, "--:--");  // nothing planned (disabled, clock not set, day done)
+  else              snprintf(next, sizeof next, "%02d:%02d", nextSlot / 60, nextSlot % 60);
+  consolePrintf("Flush: every %d min | next %s | queued zones 0x%lx | session %s | pump %s\n",
+                flushInterval, next, (unsigned long)pendingZoneMask,
+                flushSessionActive ? "active" : "idle", storagePump ? "ON" : "OFF");
+  consolePrintf("Uploads pending: %d | log level %s\n", uploadCount, LOG_LEVEL_NAMES[logLevel]);
+}
+
+void consoleFlush(int, char**) {
+  if (isTankBelowReserve()) { consolePrintf("Refused: tank below reserve (%.1f L)\n", tankReserveLiters); return; }
+  queueFlushAllZones();
+  consolePrintf("Flush queued for all zones (mask 0x%lx)\n", (unsigned long)pendingZoneMask);
+}
+
+void consoleRelay(int argc, char** argv) {
+  if (argc == 3) {
+    int relay = -1;
+    for (int r = 0; r < RELAY_ID_COUNT; r++) if (!strcmp(argv[1], RELAY_NAMES[r])) relay = r;
+    bool on = !strcmp(argv[2], "on");
+    if (relay < 0 || (!on && strcmp(argv[2], "off"))) { consolePrintf("usage: relay [pump|aux|cctv|siren on|off]\n"); return; }
+    applyRelayCommand((uint8_t)relay, on);  // same path as the dashboard: interlocks and duty accounting
+  }
+  const int pins[RELAY_ID_COUNT] = { RELAY_PUMP_PIN, RELAY_AUX_PIN, RELAY_CCTV_PIN, RELAY_SIREN_PIN };
+  for (int r = 0; r < RELAY_ID_COUNT; r++) consolePrintf("  %-6s %s\n", RELAY_NAMES[r], relayIsOn(pins[r]) ? "ON" : "off");
+  for (int z = 1; z < PUMP_ZONE_COUNT; z++) consolePrintf("  zone %d %s\n", z, zoneRunning[z] ? "ON" : "off");
+}
+
+/**
+ * @brief Prints a cron field mask back as text ("*", "7", "8-18", "0,30").
+ */
+void formatCronField(uint64_t mask, int lo, int hi, char* buf, size_t size) {
+  uint64_t all = ((2ULL << hi) - 1) & ~((1ULL << lo) - 1);
+  if ((mask & all) == all) { snprintf(buf, size, "*"); return; }
+  size_t n = 0;
+  buf[0] = '\0';
+  for (int v = lo; v <= hi && n < size; v++) {
+    if (!(mask & (1ULL << v))) continue;
+    int end = v;
+    while (end < hi && (mask & (1ULL << (end + 1)))) end++;
+    n += snprintf(buf + n, size - n, n ? ",%d" : "%d", v);
+    if (end > v && n < size) n += snprintf(buf + n, size - n, "-%d", end);
+    v = end;
+  }
+}
+
+void consoleSchedule(int argc, char** argv) {
+  if (argc == 9 && !strcmp(argv[1], "add")) {
+    bool on = !strcmp(argv[3], "on");
+    if (!on && strcmp(argv[3], "off")) { consolePrintf("usage: sched add <relay> on|off <min> <hour> * * <dow>\n"); return; }
+    char cron[64];
+    snprintf(cron, sizeof cron, "%s %s %s %s %s", argv[4], argv[5], argv[6], argv[7], argv[8]);
+    if (!addRelaySchedule(argv[2], on, cron)) { consolePrintf("Rejected (relay name, cron fields or table full)\n"); return; }
+  } else if (argc == 3 && !strcmp(argv[1], "del")) {
+    if (!removeRelaySchedule(atoi(argv[2]))) { consolePrintf("No entry %s\n", argv[2]); return; }
+  } else if (argc != 1) {
+    consolePrintf("usage: sched [add <relay> on|off <min> <hour> * * <dow> | del <n>]\n");
+    return;
+  }
+  time_t now = time(nullptr);
+  for (int i = 0; i < relayScheduleCount; i++) {
+    const RelaySchedule& e = relaySchedules[i];
+    char mins[48], hours[40], days[20];
+    formatCronField(e.minuteMask, 0, 59, mins, sizeof mins);
+    formatCronField(e.hourMask, 0, 23, hours, sizeof hours);
+    formatCronField(e.dowMask, 0, 6, days, sizeof days);
+    time_t next = now >= 946684800L ? nextRelayScheduleFire(e, now) : 0;
+    struct tm tmNext; localtime_r(&next, &tmNext);
+    if (next) consolePrintf("  %2d %-6s %-3s %s %s * * %s | next %02d:%02d\n", i, RELAY_NAMES[e.relay], e.turnOn ? "on" : "off",
+                            mins, hours, days, tmNext.tm_hour, tmNext.tm_min);
+    else      consolePrintf("  %2d %-6s %-3s %s %s * * %s | next --:--\n", i, RELAY_NAMES[e.relay], e.turnOn ? "on" : "off",
+                            mins, hours, days);
+  }
+  if (relayScheduleCount == 0) consolePrintf("  no entries\n");
+}
+
+void consoleCalibration(int argc, char** argv) {
+  bool changed = false, matched = argc == 1;
+  forEachSensor([&](auto& s) {
+    using S = typename std::decay<decltype(s)>::type;
+    if constexpr (std::is_same<S, Mq137Sensor>::value) {
+      Mq137Calibration& cal = s.calibration();
+      const SensorReading& r = s.readings[0];
+      if (argc == 4 && !strcmp(argv[1], r.label)) {
+        matched = true;
+        int id = !strcmp(argv[2], "rl") ? PARAM_MQ_RL : !strcmp(argv[2], "offset") ? PARAM_MQ_OFFSET
+               : !strcmp(argv[2], "div") ? PARAM_MQ_DIV : -1;
+        if (id < 0) { consolePrintf("usage: cal %s rl|offset|div <value>\n", r.label); return; }
+        char reply[PARAM_REPLY_MAX];
+        if (&r == primaryReading[SENSOR_NH3]) {    // the primary MQ-137 is a saved runtime parameter
+          setParamText((ParamId)id, argv[3], reply, sizeof reply);
+          consolePrintf("%s\n", reply);
+        } else {
+          char* end;
+          float v = strtof(argv[3], &end);
+          if (*end || !isfinite(v) || (id != PARAM_MQ_OFFSET && v <= 0)) { consolePrintf("Bad value: %s\n", argv[3]); return; }
+          if      (id == PARAM_MQ_RL)     cal.loadResistorKohm  = v;
+          else if (id == PARAM_MQ_OFFSET) cal.ammoniaOffsetPpm  = v;
+          else                            cal.ammoniaScalingDiv = v;
+          changed = true;
+        }
+      }
+      consolePrintf("  %-8s raw %.0f -> %.2f ppm | rl %.2f kOhm | offset %.2f | div %.3f\n", r.label, r.raw,
+                    mq137RawToPpm((int)r.raw, cal), cal.loadResistorKohm, cal.ammoniaOffsetPpm, cal.ammoniaScalingDiv);
+    }
+  });
+  if (!matched) consolePrintf("usage: cal [<sensor> rl|offset|div <value>]\n");
+  if (changed) consolePrintf("Applied from the next reading (extra sensor: not saved, lost on reboot)\n");
+}
+
+void consoleTrace(int, char**) {
+  if (!startTraceSerialDump()) consolePrintf("Trace dump already running\n");
+}
+
+void consoleMetrics(int, char**) {
+  consolePrintf("Acquisition: last %lu us (sequential %lu us)\n", (unsigned long)acqLastCycleUs, (unsigned long)acqLastSerialUs);
+  for (int m = 0; m < METRIC_COUNT; m++) {
+    const MetricQuantiles& q = hourly->quantiles[m];
+    consolePrintf("  %-12s p50 %.2f p90 %.2f p99 %.2f (this hour)\n", HOURLY_METRIC_KEYS[m],
+                  p2Value(q.p50), p2Value(q.p90), p2Value(q.p99));
+  }
+  forEachReading([](const SensorReading& r) {
+    consolePrintf("  %-12s health %u faults 0x%02x\n", r.label, r.health.score, r.health.faults);
+  });
+  portENTER_CRITICAL(&uploadMux);
+  int      backlog   = uploadCount;
+  uint32_t confirmed = uploadsConfirmed, retries = uploadRetries, dropped = uploadsDropped, rejected = uploadsRejected;
+  uint32_t connectMs = uploadLastConnectMs, postMs = uploadLastPostMs;
+  portEXIT_CRITICAL(&uploadMux);
+  consolePrintf("Uploads: %d pending, %lu confirmed, %lu retries, %lu dropped, %lu rejected | connect %lu ms, post %lu ms\n",
+                backlog, (unsigned long)confirmed, (unsigned long)retries, (unsigned long)dropped, (unsigned long)rejected,
+                (unsigned long)connectMs, (unsigned long)postMs);
+  consolePrintf("Heap free %lu | trace events %lu | abnormal resets %lu\n", (unsigned long)ESP.getFreeHeap(),
+                (unsigned long)traceHead.load(), (unsigned long)crashRecord.count);
+}
+
+void consoleParam(int argc, char** argv) {
+  char reply[PARAM_REPLY_MAX];
+  if (argc == 1) {
+    for (int i = 0; i < PARAM_COUNT; i++) {
+      formatParam((ParamId)i, reply, sizeof reply);
+      const ParamDef& d = PARAM_DEFS[i];
+      consolePrintf("  %s (%g..%g %s)\n", reply, d.minValue, d.maxValue, d.unit);
+    }
+    return;
+  }
+  int id = findParam(argv[1]);
+  if (id < 0) { consolePrintf("Unknown parameter '%s', try param\n", argv[1]); return; }
+  if (argc == 2)                            formatParam((ParamId)id, reply, sizeof reply);
+  else if (!strcmp(argv[2], "default"))     resetParam((ParamId)id, reply, sizeof reply);
+  else                                      setParamText((ParamId)id, argv[2], reply, sizeof reply);
+  consolePrintf("%s\n", reply);
+}
+
+void consoleLog(int argc, char** argv) {
+  if (argc == 2) {
+    if      (!strcmp(argv[1], "info"))  logLevel = LOG_INFO;
+    else if (!strcmp(argv[1], "debug")) logLevel = LOG_DEBUG;
+    else { consolePrintf("usage: log [info|debug]\n"); return; }
+    setDebugMessageLevel(logLevel == LOG_DEBUG ? 2 : 0);  // Arduino Cloud library chatter follows
+  }
+  consolePrintf("Log level %s\n", LOG_LEVEL_NAMES[logLevel]);
+}
+
+const ConsoleCommand CONSOLE_COMMANDS[] = {
+  { "help",    "this list",                                   consoleHelp },
+  { "status",  "time, connectivity, sensors, flush plan",      consoleStatus },
+  { "flush",   "queue a flush of every zone now",              consoleFlush },
+  { "relay",   "[pump|aux|cctv|siren on|off] – show/switch",   consoleRelay },
+  { "sched",   "[add <relay> on|off <cron> | del <n>] – relay schedules", consoleSchedule },
+  { "cal",     "[<sensor> rl|offset|div <value>] – MQ-137",    consoleCalibration },
+  { "metrics", "acquisition, quantiles, health, uploads",      consoleMetrics },
+  { "trace",   "dump the event trace (tools/kptrace2json)",    consoleTrace },
+  { "param",   "[<key> [<value>|default]] – runtime tunables", consoleParam },
+  { "log",     "[info|debug] – show/set log level",            consoleLog },
+};
+
+void consoleHelp(int, char**) {
+  for (const ConsoleCommand& c : CONSOLE_COMMANDS) consolePrintf("  %-8s %s\n", c.name, c.usage);
+}
+
+/**
+ * @brief Splits a line in place on spaces and runs the matching command.
+ */
+void runConsoleLine(char* line) {
+  char* argv[CONSOLE_MAX_ARGS];
+  int   argc = 0;
+  for (char* p = line; *p && argc < CONSOLE_MAX_ARGS; ) {
+    while (*p == ' ' || *p == '\t') *p++ = '\0';
+    if (!*p) break;
+    argv[argc++] = p;
+    while (*p && *p != ' ' && *p != '\t') p++;
+  }
+  if (argc == 0) return;
+  for (const ConsoleCommand& c : CONSOLE_COMMANDS) {
+    if (!strcmp(argv[0], c.name)) { c.run(argc, argv); return; }
+  }
+  consolePrintf("Unknown command '%s', try help\n", argv[0]);
+}
+
+/**
+ * @brief Continues a running trace dump, then collects whatever serial input
+ * has arrived and runs each complete line. Returns at once when nothing is pending.
+ */
+void serviceConsole() {
+  serviceTraceSerialDump();
+  for (int budget = CONSOLE_READ_BUDGET; budget > 0 && Serial.available() > 0; budget--) {
+    int ch = Serial.read();
+    if (ch < 0) break;
+    if (ch == '\r' || ch == '\n') {
+      if (consoleOverflow) consolePrintf("Line too long (max %d)\n", CONSOLE_LINE_MAX - 1);
+      else if (consoleLength > 0) { consoleLine[consoleLength] = '\0'; runConsoleLine(consoleLine); }
+      consoleLength   = 0;
+      consoleOverflow = false;
+    } else if (ch == '\b' || ch == 0x7F) {
+      if (consoleLength > 0) consoleLength--;
+    } else if (consoleLength < CONSOLE_LINE_MAX - 1) {
+      consoleLine[consoleLength++] = (char)ch;
+    } else {
+      consoleOverflow = true;
+    }
+  }
+}
+
+// ===================================================================================
+//          Firmware updates (OTA)
+// ===================================================================================
+
+/**
+ * @brief Tells the Arduino core not to mark a new image valid at startup; the
+ * OTA task does it after the health check (needs a rollback-enabled bootloader).
+ */
+extern "C" bool verifyRollbackLater() { return true; }
+
+/**
+ * @brief Stores the outcome of an update attempt in NVS and flags it for the
+ * next hourly report.
+ */
+void saveOtaOutcome(const OtaOutcome& o) {
+  Preferences p;
+  p.begin(OTA_NVS_NAMESPACE, false);
+  p.putBytes("outcome", &o, sizeof o);
+  p.putUChar("report", o.pending ? 1 : 0);
+  p.end();
+  portENTER_CRITICAL(&otaMux);
+  otaOutcome = o;
+  portEXIT_CRITICAL(&otaMux);
+}
+
+/**
+ * @brief Reads the rollback state of the running image, resolves an update
+ * that was in flight across the reboot and starts the OTA task.
+ */
+void initOta() {
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  esp_ota_img_states_t state;
+  otaPendingVerify = running && esp_ota_get_state_partition(running, &state) == ESP_OK &&
+                     state == ESP_OTA_IMG_PENDING_VERIFY;
+
+  Preferences p;
+  p.begin(OTA_NVS_NAMESPACE, false);
+  OtaOutcome o = {};
+  if (p.getBytesLength("outcome") == sizeof o) p.getBytes("outcome", &o, sizeof o);
+  o.pending = p.getUChar("report", 0) != 0;
+  bool inflight = p.getUChar("inflight", 0) != 0;  // cleared once the new image confirms itself
+  p.end();
+
+  bool resolved = inflight && (FIRMWARE_BUILD != o.toBuild || !otaPendingVerify);
+  if (inflight && FIRMWARE_BUILD != o.toBuild) {
+    // The bootloader went back to this image: the new one failed before confirming itself
+    snprintf(o.result, sizeof o.result, "rolledBack");
+    o.pending = true;
+    saveOtaOutcome(o);
+  } else if (inflight && !otaPendingVerify) {
+    // Booted the new image, but the bootloader has no rollback to confirm against
+    snprintf(o.result, sizeof o.result, "ok");
+    o.pending = true;
+    saveOtaOutcome(o);
+  } else {
+    portENTER_CRITICAL(&otaMux);
+    otaOutcome = o;
+    portEXIT_CRITICAL(&otaMux);
+  }
+  if (resolved) {                  // otherwise superviseOtaHealth() clears it on confirmation
+    p.begin(OTA_NVS_NAMESPACE, false);
+    p.putUChar("inflight", 0);
+    p.end();
+  }
+  Serial.printf("[OTA] Firmware %s build %u%s\n", FIRMWARE_VERSION, (unsigned)FIRMWARE_BUILD,
+                otaPendingVerify ? ", new image pending health check" : "");
+
+  if (!OTA_ENABLED && !otaPendingVerify) return;
+  if (xTaskCreatePinnedToCore(otaTaskMain, "ota", OTA_STACK_BYTES, nullptr, 1, &otaTask, 0) != pdPASS) {
+    otaTask = nullptr;
+    Serial.println("[OTA] Task creation failed");
+  }
+}
+
+/**
+ * @brief Marks a freshly updated image healthy once it has run for
+ * OTA_HEALTH_SETTLE_MS with WiFi and Arduino Cloud connected and at least one
+ * primary sensor delivering readings.
+ */
+void serviceOtaHealth(unsigned long nowMillis, const SensorSnapshot& snap) {
+  if (!otaPendingVerify || otaHealthy.load()) return;
+  if (nowMillis < OTA_HEALTH_SETTLE_MS) return;
+  if (WiFi.status() != WL_CONNECTED || !ArduinoCloud.connected()) return;
+  if (snap.staleMask == (1 << SENSOR_COUNT) - 1) return;
+  otaHealthy = true;
+}
+
+/**
+ * @brief Waits for serviceOtaHealth(); confirms the image or rolls it back.
+ */
+void superviseOtaHealth() {
+  while (!otaHealthy.load() && millis() < OTA_HEALTH_WINDOW_MS) vTaskDelay(pdMS_TO_TICKS(1000));
+  OtaOutcome o;
+  portENTER_CRITICAL(&otaMux);
+  o = otaOutcome;
+  portEXIT_CRITICAL(&otaMux);
+  o.pending = true;
+  if (otaHealthy.load()) {
+    esp_err_t err = esp_ota_mark_app_valid_cancel_rollback();
+    if (err != ESP_OK) {
+      snprintf(o.result, sizeof o.result, "unconfirmed");
+      saveOtaOutcome(o);
+      Serial.printf("[OTA] Build %u healthy but not confirmed (%s)\n", (unsigned)FIRMWARE_BUILD, esp_err_to_name(err));
+      return;
+    }
+    Preferences p;
+    p.begin(OTA_NVS_NAMESPACE, false);
+    p.putUChar("inflight", 0);
+    p.end();
+    snprintf(o.result, sizeof o.result, "ok");
+    saveOtaOutcome(o);
+    Serial.printf("[OTA] Build %u healthy after %lu s, rollback cancelled\n", (unsigned)FIRMWARE_BUILD, millis() / 1000);
+  } else {
+    snprintf(o.result, sizeof o.result, "unhealthy");
+    saveOtaOutcome(o);
+    Serial.println("[OTA] Health check failed, rolling back");
+    delay(100);
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+  }
+}
+
+/**
+ * @brief Reads exactly n body bytes, waiting up to OTA_IO_TIMEOUT_MS for each piece.
+ * @param bytes Incremented by the bytes read (transfer size).
+ */
+bool otaReadExact(HttpClient& c, uint8_t* dst, size_t n, uint32_t& bytes) {
+  size_t got = 0;
+  unsigned long last = millis();
+  while (got < n) {
+    int r = c.read(dst + got, n - got);
+    if (r > 0) { got += r; bytes += r; last = millis(); markStage(WATCH_OTA, STAGE_OTA_DOWNLOAD); continue; }
+    if (!c.connected() && !c.available()) return false;
+    if (millis() - last > OTA_IO_TIMEOUT_MS) return false;
+    delay(1);
+  }
+  return true;
+}
+
+/**
+ * @brief Starts a GET on the update server and skips to the body.
+ * @return Content length, or -1 on any error or non-200 status.
+ */
+int otaGet(HttpClient& c, const char* path) {
+  if (c.get(path) != HTTP_SUCCESS) return -1;
+  int status = c.responseStatusCode();
+  if (status != 200 || c.skipResponseHeaders() != HTTP_SUCCESS) {
+    Serial.printf("[OTA] GET %s failed (%d)\n", path, status);
+    return -1;
+  }
+  return c.contentLength();
+}
+
+/**
+ * @brief Streams a delta patch into the inactive partition, rebuilding the new
+ * image from the running one.
+ * @return True if Update accepted the complete image.
+ */
+bool applyOtaDelta(const char* path, uint32_t& bytes) {
+  static uint8_t scratch[OTA_CHUNK_BYTES];
+  WiFiClient net;
+  HttpClient http(net, OTA_MANIFEST_HOST, OTA_MANIFEST_PORT);
+  if (otaGet(http, path) < 0) return false;
+  auto readPatch = [&](uint8_t* dst, size_t n) { return otaReadExact(http, dst, n, bytes); };
+
+  KpDeltaHeader h;
+  KpDeltaResult r = KPDELTA_OK;
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  auto readOld = [&](uint32_t off, uint8_t* dst, size_t n) { return esp_partition_read(running, off, dst, n) == ESP_OK; };
+  uint32_t crc;
+  if (!readPatch((uint8_t*)&h, sizeof h) || !kpdeltaHeaderValid(h)) r = KPDELTA_ERR_HEADER;
+  else if (h.oldSize > running->size || !kpdeltaImageCrc(readOld, h.oldSize, scratch, sizeof scratch, crc) || crc != h.oldCrc)
+    r = KPDELTA_ERR_OLD_IMAGE;
+  else if (!Update.begin(h.newSize)) r = KPDELTA_ERR_WRITE;
+  else {
+    r = kpdeltaApply(h, readOld, readPatch,
+                     [](const uint8_t* src, size_t n) { return Update.write((uint8_t*)src, n) == n; },
+                     scratch, sizeof scratch);
+    if (r != KPDELTA_OK) Update.abort();
+  }
+  http.stop();
+  if (r != KPDELTA_OK) { Serial.printf("[OTA] Delta %s: %s\n", path, kpdeltaResultName(r)); return false; }
+  if (!Update.end()) { Serial.printf("[OTA] Image rejected: %s\n", Update.errorString()); return false; }
+  return true;
+}
+
+/**
+ * @brief Streams a full image into the inactive partition.
+ * @return True if the CRC matched the manifest and Update accepted the image.
+ */
+bool applyOtaFull(const char* path, uint32_t size, uint32_t expectedCrc, uint32_t& bytes) {
+  static uint8_t chunk[OTA_CHUNK_BYTES];
+  WiFiClient net;
+  HttpClient http(net, OTA_MANIFEST_HOST, OTA_MANIFEST_PORT);
+  if (otaGet(http, path) < 0 || !Update.begin(size)) { http.stop(); return false; }
+  uint32_t crc = 0;
+  for (uint32_t done = 0; done < size; ) {
+    size_t n = min((uint32_t)sizeof chunk, size - done);
+    if (!otaReadExact(http, chunk, n, bytes) || Update.write(chunk, n) != n) {
+      Update.abort(); http.stop();
+      Serial.printf("[OTA] Full image %s interrupted at %u bytes\n", path, (unsigned)done);
+      return false;
+    }
+    crc = kplogCrc32(chunk, n, crc);
+    done += n;
+  }
+  http.stop();
+  if (crc != expectedCrc) { Update.abort(); Serial.println("[OTA] Full image CRC mismatch"); return false; }
+  if (!Update.end()) { Serial.printf("[OTA] Image rejected: %s\n", Update.errorString()); return false; }
+  return true;
+}
+
+/**
+ * @brief Rollout bucket 0..99 of this device for a build: stable per build, and
+ * different devices go first for different builds.
+ */
+int otaRolloutBucket(uint32_t build) {
+  char key[48];
+  snprintf(key, sizeof key, "%s:%u", THING_UID_NAME, (unsigned)build);
+  return (int)(kplogCrc32(key, strlen(key)) % 100);
+}
+
+/**
+ * @brief Waits up to OTA_IDLE_WAIT_MS until no pump zone runs and the upload
+ * queue is empty, so a reboot neither cuts a pump nor drops queued rows.
+ * @return True if the device is idle.
+ */
+bool waitForOtaIdle() {
+  unsigned long waitStart = millis();
+  for (;;) {
+    portENTER_CRITICAL(&uploadMux);
+    int backlog = uploadCount;
+    portEXIT_CRITICAL(&uploadMux);
+    if (!anyPumpRunning() && backlog == 0) return true;
+    if (millis() - waitStart >= OTA_IDLE_WAIT_MS) {
+      Serial.printf("[OTA] Not idle after %lu min (pump %s, %d upload(s) queued)\n", OTA_IDLE_WAIT_MS / 60000UL,
+                    anyPumpRunning() ? "running" : "off", backlog);
+      return false;
+    }
+    markStage(WATCH_OTA, STAGE_OTA_WAIT_IDLE);
+    vTaskDelay(pdMS_TO_TICKS(5000));
+  }
+}
+
+/**
+ * @brief Reboots into the image staged in the boot partition once the device
+ * is idle. The download took a while, so pumps may have started and rows been
+ * queued since; if postponed, the image starts on the next reboot or check.
+ */
+void rebootIntoStagedImage() {
+  if (!waitForOtaIdle()) { Serial.println("[OTA] Reboot postponed"); return; }
+  Serial.println("[OTA] Rebooting into the new image");
+  Serial.flush();
+  if (anyPumpRunning()) { Serial.println("[OTA] Pump started, reboot postponed"); return; }
+  ESP.restart();
+}
+
+/**
+ * @brief Polls the manifest and installs a newer build staged for this device:
+ * delta first when one is listed for the running build, full image otherwise
+ * or if the delta fails. Reboots into the new image on success.
+ */
+void checkForOtaUpdate() {
+  static char text[OTA_MANIFEST_MAX];
+  uint32_t manifestBytes = 0;
+  int len;
+  {
+    WiFiClient net;
+    HttpClient http(net, OTA_MANIFEST_HOST, OTA_MANIFEST_PORT);
+    len = otaGet(http, OTA_MANIFEST_PATH);
+    if (len <= 0 || len >= (int)sizeof text || !otaReadExact(http, (uint8_t*)text, len, manifestBytes)) len = -1;
+    http.stop();
+  }
+  if (len < 0) return;
+  text[len] = '\0';
+
+  StaticJsonDocument<1024> doc;
+  if (deserializeJson(doc, text)) { Serial.println("[OTA] Manifest is not valid JSON"); return; }
+  uint32_t build = doc["build"] | 0u;
+  if (build <= FIRMWARE_BUILD) return;
+  for (const char* held : doc["hold"].as<JsonArray>()) {
+    if (held && !strcmp(held, THING_UID_NAME)) { Serial.printf("[OTA] Build %u available, this device is on hold\n", (unsigned)build); return; }
+  }
+  int rollout = doc["rollout"] | 100;
+  if (otaRolloutBucket(build) >= rollout) {
+    Serial.printf("[OTA] Build %u staged for %d%% of devices, not this one yet\n", (unsigned)build, rollout);
+    return;
+  }
+  const char* deltaPath = nullptr;
+  for (JsonObject d : doc["deltas"].as<JsonArray>()) {
+    if ((d["fromBuild"] | 0u) == FIRMWARE_BUILD) deltaPath = d["url"];
+  }
+  const char* fullPath = doc["full"]["url"];
+  uint32_t    fullSize = doc["full"]["size"] | 0u;
+  uint32_t    fullCrc  = doc["full"]["crc"] | 0u;
+
+  // An earlier check may have installed this build and postponed the reboot
+  OtaOutcome staged;
+  portENTER_CRITICAL(&otaMux);
+  staged = otaOutcome;
+  portEXIT_CRITICAL(&otaMux);
+  if (!strcmp(staged.result, "staged") && staged.toBuild == build &&
+      esp_ota_get_boot_partition() != esp_ota_get_running_partition()) {
+    Serial.printf("[OTA] Build %u already staged\n", (unsigned)build);
+    rebootIntoStagedImage();
+    return;
+  }
+
+  // Never reboot under a running pump
+  if (!waitForOtaIdle()) { Serial.println("[OTA] Update postponed"); return; }
+
+  // A new attempt overwrites the inactive partition: nothing is in flight until it is staged
+  Preferences p;
+  p.begin(OTA_NVS_NAMESPACE, false);
+  p.putUChar("inflight", 0);
+  p.end();
+
+  Serial.printf("[OTA] Updating build %u -> %u (%s)\n", (unsigned)FIRMWARE_BUILD, (unsigned)build, deltaPath ? "delta" : "full");
+  OtaOutcome o = {};
+  o.fromBuild = FIRMWARE_BUILD;
+  o.toBuild   = build;
+  unsigned long t0 = millis();
+  bool ok = false;
+  if (deltaPath) {
+    snprintf(o.kind, sizeof o.kind, "delta");
+    ok = applyOtaDelta(deltaPath, o.bytes);
+  }
+  if (!ok && fullPath && fullSize > 0) {
+    snprintf(o.kind, sizeof o.kind, "full");
+    ok = applyOtaFull(fullPath, fullSize, fullCrc, o.bytes);
+  }
+  o.ms = millis() - t0;
+  o.pending = !ok;               // a staged image is reported by the new build once it runs
+  snprintf(o.result, sizeof o.result, ok ? "staged" : "failed");
+  saveOtaOutcome(o);
+  Serial.printf("[OTA] %s: %s, %u bytes transferred in %u ms\n", ok ? "Installed" : "Update failed", o.kind,
+                (unsigned)o.bytes, (unsigned)o.ms);
+  if (!ok) return;
+
+  p.begin(OTA_NVS_NAMESPACE, false);
+  p.putUChar("inflight", 1);     // initOta() on the next boot tells a rollback from success
+  p.end();
+  rebootIntoStagedImage();
+}
+
+/**
+ * @brief OTA task: health supervision of a new image, then periodic manifest checks.
+ */
+void otaTaskMain(void*) {
+  if (otaPendingVerify) superviseOtaHealth();
+  if (!OTA_ENABLED) { vTaskDelete(nullptr); return; }
+  vTaskDelay(pdMS_TO_TICKS(OTA_FIRST_CHECK_MS));
+  for (;;) {
+    if (WiFi.status() == WL_CONNECTED) {
+      // Watched only while checking: the task sleeps for hours in between
+      watchdogSubscribe(WATCH_OTA);
+      markStage(WATCH_OTA, STAGE_OTA_MANIFEST);
+      checkForOtaUpdate();
+      watchdogUnsubscribe(WATCH_OTA);
+    }
+    vTaskDelay(pdMS_TO_TICKS(OTA_CHECK_INTERVAL_MS));
+  }
+}
+
+// ===================================================================================
+//          Cloud variable change callbacks
+// ===================================================================================
+
+/**
+ * @brief Callback function when the 'storagePump' variable changes in the Arduino Cloud.
+ * Controls the pump relay and records when it was turned on by the cloud.
+ */
+void onStoragePumpChange() {
+    unsigned long nowMillis = millis();
+    traceEvent(KPTRACE_INSTANT, WATCH_LOOP, TRACE_EV_CLOUD_PUMP, storagePump);
+    if (storagePump && isTankBelowReserve()) {
+        storagePump = false; // Refuse: running dry burns out the pump
+        Serial.printf("[Cloud Callback] Pump ON refused: tank %.1f L below reserve %.1f L\n", sensorSnapshot.read().value[SENSOR_TANK], tankReserveLiters);
+    }
+    relayWrite(RELAY_PUMP_PIN, storagePump); // Update physical relay immediately
+
+    if (storagePump) { // Pump is turning ON via Cloud dashboard
+        pumpTurnedOnMillis = nowMillis; // Start the auto-off timer
+        pumpLastOnMillis = nowMillis; // Start duration tracking
+        Serial.printf("[Cloud Callback] Pump ON. pumpTurnedOnMillis set to %lu. pumpLastOnMillis set to %lu.\n", pumpTurnedOnMillis, pumpLastOnMillis);
+    } else { // Pump is turning OFF via Cloud dashboard
+        if (pumpLastOnMillis != 0) { // Only calculate duration if it was previously ON
+            hourly->pumpSeconds += (nowMillis - pumpLastOnMillis) / 1000;
+            Serial.printf("[Cloud Callback] Pump OFF. Added %lu seconds. Total: %lu s\n", (nowMillis - pumpLastOnMillis) / 1000, hourly->pumpSeconds);
+            pumpLastOnMillis = 0; // Reset start time for duration tracking
+        }
+        pumpTurnedOnMillis = 0; // Reset auto-off timer when pump goes off
+    }
+    Serial.printf("[Cloud] StoragePump now %s\n", storagePump ? "ON" : "OFF");
+}
+
+/**
+ * @brief Callback function when the 'siren' variable changes in the Arduino Cloud.
+ * Controls the siren relay and records its ON/OFF duration.
+ */
+void onSirenChange() {
+  unsigned long nowMillis = millis();
+  traceEvent(KPTRACE_INSTANT, WATCH_LOOP, TRACE_EV_CLOUD_SIREN, siren);
+  if (siren) { // Siren is turning ON
+    sirenLastOnMillis = nowMillis;
+    Serial.printf("[Cloud Callback] Siren ON at %lu ms\n", sirenLastOnMillis);
+  } else { // Siren is turning OFF
+    if (sirenLastOnMillis != 0) { // Only calculate if it was previously ON
+      hourly->sirenSeconds += (nowMillis - sirenLastOnMillis) / 1000;
+      Serial.printf("[Cloud Callback] Siren OFF. Added %lu seconds. Total: %lu s\n", (nowMillis - sirenLastOnMillis) / 1000, hourly->sirenSeconds);
+      sirenLastOnMillis = 0; // Reset start time
+    }
+  }
+  relayWrite(RELAY_SIREN_PIN, siren);
+  Serial.printf("[Cloud] Siren now %s\n", siren ? "ON" : "OFF");
+}
+
+/**
+ * @brief Callback function when the 'cctv' variable changes in the Arduino Cloud.
+ * Controls the CCTV relay and records its ON/OFF duration.
+ */
+void onCCTVChange() {
+  unsigned long nowMillis = millis();
+  traceEvent(KPTRACE_INSTANT, WATCH_LOOP, TRACE_EV_CLOUD_CCTV, cCTV);
+  if (cCTV) { // CCTV is turning ON
+    cctvLastOnMillis = nowMillis;
+    Serial.printf("[Cloud Callback] CCTV ON at %lu ms\n", cctvLastOnMillis);
+  } else { // CCTV is turning OFF
+    if (cctvLastOnMillis != 0) { // Only calculate if it was previously ON
+      hourly->cctvSeconds += (nowMillis - cctvLastOnMillis) / 1000;
+      Serial.printf("[Cloud Callback] CCTV OFF. Added %lu seconds. Total: %lu s\n", (nowMillis - cctvLastOnMillis) / 1000, hourly->cctvSeconds);
+      cctvLastOnMillis = 0; // Reset start time
+    }
+  }
+  relayWrite(RELAY_CCTV_PIN, cCTV);
+  Serial.printf("[Cloud] CCTV now %s\n", cCTV ? "ON" : "OFF");
+}
+
+/**
+ * @brief Callback function when the 'auxilliarySocket' variable changes in the Arduino Cloud.
+ * Controls the auxiliary relay and records its ON/OFF duration.
+ */
+void onAuxilliarySocketChange() {
+  unsigned long nowMillis = millis();
+  traceEvent(KPTRACE_INSTANT, WATCH_LOOP, TRACE_EV_CLOUD_AUX, auxilliarySocket);
+  if (auxilliarySocket) { // Auxiliary Socket is turning ON
+    auxLastOnMillis = nowMillis;
+    Serial.printf("[Cloud Callback] Aux Socket ON at %lu ms\n", auxLastOnMillis);
+  } else { // Auxiliary Socket is turning OFF
+    if (auxLastOnMillis != 0) { // Only calculate if it was previously ON
+      hourly->auxSeconds += (nowMillis - auxLastOnMillis) / 1000;
+      Serial.printf("[Cloud Callback] Aux Socket OFF. Added %lu seconds. Total: %lu s\n", (nowMillis - auxLastOnMillis) / 1000, hourly->auxSeconds);
+      auxLastOnMillis = 0; // Reset start time
+    }
+  }
+  relayWrite(RELAY_AUX_PIN, auxilliarySocket);
+  Serial.printf("[Cloud] Auxiliary Socket now %s\n", auxilliarySocket ? "ON" : "OFF");
+}
+
+/**
+ * @brief Cloud String parameterCommand: "key=value" sets a runtime parameter,
+ * "key=default" restores it, "key" reads it. The reply replaces the command.
+ */
+void onParameterCommandChange() {
+  char cmd[PARAM_REPLY_MAX];
+  char reply[PARAM_REPLY_MAX];
+  snprintf(cmd, sizeof cmd, "%s", parameterCommand.c_str());
+  char* value = strchr(cmd, '=');
+  if (value) *value++ = '\0';
+  int id = findParam(cmd);
+  if (id < 0)                          snprintf(reply, sizeof reply, "error: unknown parameter '%s'", cmd);
+  else if (!value)                     formatParam((ParamId)id, reply, sizeof reply);
+  else if (!strcmp(value, "default"))  resetParam((ParamId)id, reply, sizeof reply);
+  else                                 setParamText((ParamId)id, value, reply, sizeof reply);
+  parameterCommand = reply;
 }
 
 /**
  * @brief Callback function when the 'flushInterval' variable changes in the Arduino Cloud.
- * Resets the auto-flush timer to apply the new interval immediately.
+ * The flush planner re-plans the remaining slots of the day on the next loop.
  */
 void onFlushIntervalChange() {
+  traceEvent(KPTRACE_INSTANT, WATCH_LOOP, TRACE_EV_CLOUD_INTERVAL, flushInterval);
   if (flushInterval > 0) {
-    Serial.printf("[Cloud] Flush interval updated to %d minutes. Resetting auto-flush timer.\n", flushInterval);
-    lastAutoFlushMillis = millis(); // Reset the timer to start the new interval countdown from now
+    Serial.printf("[Cloud] Flush interval updated to %d minutes. Re-planning remaining slots.\n", flushInterval);
+    // The planner notices flushPlanInterval != flushInterval on the next loop and
+    // re-plans the rest of the day; slots stay aligned to the wall clock.
+    lastAutoFlushMillis = millis(); // Fallback timer used only while the clock is not set
   } else {
     Serial.println("[Cloud] Automatic flushing is now DISABLED.");
   }
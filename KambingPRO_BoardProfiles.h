@@ -0,0 +1,145 @@
+// ----------------------------------------------------------------------------------
+//  KambingPRO – per-barn board profiles
+//  Everything that differs between barn builds: device name, pins, relay module
+//  polarity, tank geometry and MQ-137 calibration. The sketch selects one profile
+//  at compile time, so there is no runtime configuration cost.
+// ----------------------------------------------------------------------------------
+//
+//  Selecting a board (default BOARD_RAB001):
+//    arduino-cli compile --build-property "build.extra_flags=-DKAMBINGPRO_BOARD=BOARD_RAB002" ...
+//  or add  #define KAMBINGPRO_BOARD BOARD_RAB002  above the includes in the sketch.
+//
+//  Adding a barn: copy a profile below, adjust it and give it a new name. The
+//  static_asserts in the sketch reject pin clashes, flash/input-only pins used as
+//  outputs and analog inputs outside ADC1 (ADC2 is unusable while WiFi is on).
+// ----------------------------------------------------------------------------------
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+
+struct TankGeometry {              // frustum of a cone, wide end up
+  float heightCm;
+  float radiusTopCm;
+  float radiusBottomCm;
+};
+
+struct Mq137Calibration {
+  float loadResistorKohm;
+  float ammoniaOffsetPpm;
+  float ammoniaScalingDiv;
+};
+
+struct BoardProfile {
+  const char*      thingName;      // must match the Google Sheet tab
+  int              relayPumpPin;
+  int              relayAuxPin;
+  int              relayCctvPin;
+  int              relaySirenPin;
+  bool             relayActiveLow; // true for opto-isolated modules that switch on LOW
+  int              dhtPin;
+  uint8_t          dhtType;        // 11, 21 or 22 (same values as DHT11/DHT21/DHT22)
+  int              ultrasonicTrigPin;
+  int              ultrasonicEchoPin;
+  int              mq137Pin;       // must be an ADC1 pin (GPIO 32–39)
+  TankGeometry     tank;
+  Mq137Calibration mq137;
+};
+
+constexpr BoardProfile BOARD_RAB001 = {
+  "RAB001",
+  5, 25, 33, 32, false,
+  15, 22,
+  13, 14,
+  34,
+  { 38.0f, 18.5f, 14.0f },
+  { 22.0f, 7.0f, 10.0f },
+};
+
+// Larger barn: 200 L drum tank and an active-LOW relay board.
+constexpr BoardProfile BOARD_RAB002 = {
+  "RAB002",
+  5, 25, 33, 32, true,
+  15, 22,
+  13, 14,
+  35,
+  { 85.0f, 29.0f, 27.0f },
+  { 22.0f, 7.0f, 10.0f },
+};
+
+#ifndef KAMBINGPRO_BOARD
+#define KAMBINGPRO_BOARD BOARD_RAB001
+#endif
+
+constexpr const BoardProfile& BOARD = KAMBINGPRO_BOARD;
+
+// ---- Compile-time helpers (tank volume, pin validation) ----
+
+/**
+ * @brief Frustum volume filled to h_cm, usable in constant expressions.
+ * @param t Tank geometry.
+ * @param h_cm Water height in centimeters, 0..t.heightCm.
+ * @return Volume in liters.
+ */
+constexpr float frustumVolumeLiters(const TankGeometry& t, float h_cm) {
+  float r = t.radiusBottomCm + (h_cm / t.heightCm) * (t.radiusTopCm - t.radiusBottomCm);
+  return (float)(3.14159265358979 * h_cm / 3.0) * (r * r + r * t.radiusBottomCm + t.radiusBottomCm * t.radiusBottomCm) / 1000.0f;
+}
+
+/**
+ * @brief Height → volume table with N entries spaced step_cm apart (last entries clamp to full).
+ */
+template <int N>
+constexpr std::array<float, N> tankVolumeTable(const TankGeometry& t, float step_cm) {
+  std::array<float, N> table{};
+  for (int i = 0; i < N; i++) {
+    float h = i * step_cm;
+    table[i] = frustumVolumeLiters(t, h < t.heightCm ? h : t.heightCm);
+  }
+  return table;
+}
+
+constexpr bool isAdc1Pin(int pin)        { return pin >= 32 && pin <= 39; }
+constexpr bool isFlashPin(int pin)       { return pin >= 6 && pin <= 11; }
+constexpr bool isValidOutputPin(int pin) {  // ESP32: 34–39 are input-only, 20/24/28–31 don't exist
+  return pin >= 0 && pin <= 33 && !isFlashPin(pin) && pin != 20 && pin != 24 && !(pin >= 28 && pin <= 31);
+}
+
+/**
+ * @brief True if no pin appears twice in the list.
+ */
+template <size_t N>
+constexpr bool pinsDistinct(const int (&pins)[N]) {
+  for (size_t i = 0; i < N; i++)
+    for (size_t j = i + 1; j < N; j++)
+      if (pins[i] == pins[j]) return false;
+  return true;
+}
+
+/**
+ * @brief Checks extra relay outputs (index 1..) of a { name, relayPin } table:
+ * output-capable, not among the board pins, not repeated.
+ */
+template <typename Relay, size_t N, size_t M>
+constexpr bool extraRelayPinsValid(const Relay (&relays)[N], const int (&boardPins)[M]) {
+  for (size_t z = 1; z < N; z++) {
+    if (!isValidOutputPin(relays[z].relayPin)) return false;
+    for (size_t p = 0; p < M; p++) if (boardPins[p] == relays[z].relayPin) return false;
+    for (size_t y = 1; y < z; y++) if (relays[y].relayPin == relays[z].relayPin) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief GPIO mask of the board's relays and a { name, relayPin } table in one
+ * register bank (0: GPIO 0-31, 1: GPIO 32-39).
+ */
+template <typename Relay, size_t N>
+constexpr uint32_t relayBankMask(const BoardProfile& b, const Relay (&relays)[N], int bank) {
+  uint32_t mask = 0;
+  const int pins[] = { b.relayPumpPin, b.relayAuxPin, b.relayCctvPin, b.relaySirenPin };
+  for (int pin : pins) if (pin / 32 == bank) mask |= 1UL << (pin % 32);
+  for (size_t z = 0; z < N; z++) if (relays[z].relayPin / 32 == bank) mask |= 1UL << (relays[z].relayPin % 32);
+  return mask;
+}
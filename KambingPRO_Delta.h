@@ -0,0 +1,136 @@
+// ----------------------------------------------------------------------------------
+//  KambingPRO – firmware delta patch format
+//  Shared by the ESP32 sketch (applies patches during OTA) and tools/kpdelta.cpp
+//  (creates and test-applies them). Plain C++ with fixed-width types only.
+// ----------------------------------------------------------------------------------
+//
+//  A patch rebuilds the new firmware image from the image currently running:
+//
+//    [KpDeltaHeader] op op op ... KPDELTA_OP_END
+//
+//    KPDELTA_OP_COPY  u32 offset, u32 length   copy bytes from the old image
+//    KPDELTA_OP_ADD   u32 length, bytes...     literal bytes carried in the patch
+//
+//  All integers are little-endian. Ops are applied strictly in order and the
+//  output is written sequentially, so the device streams the patch from the
+//  network straight into the inactive OTA partition while reading the old image
+//  from the running one; no full copy of either image is held in RAM.
+//
+//  The header carries size and CRC-32 of both images: a patch is refused unless
+//  the running image matches oldCrc, and the result must match newCrc before the
+//  new partition is made bootable.
+// ----------------------------------------------------------------------------------
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "KambingPRO_LogFormat.h"   // kplogCrc32
+
+#define KPDELTA_MAGIC   0x3144504BUL  // "KPD1" little-endian
+#define KPDELTA_VERSION 1
+
+enum KpDeltaOp : uint8_t {
+  KPDELTA_OP_END  = 0,
+  KPDELTA_OP_COPY = 1,
+  KPDELTA_OP_ADD  = 2,
+};
+
+struct KpDeltaHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t oldSize;
+  uint32_t oldCrc;
+  uint32_t newSize;
+  uint32_t newCrc;
+};
+
+enum KpDeltaResult {
+  KPDELTA_OK = 0,
+  KPDELTA_ERR_HEADER,       // bad magic/version
+  KPDELTA_ERR_OLD_IMAGE,    // running image does not match oldSize/oldCrc
+  KPDELTA_ERR_READ,         // patch stream or old image read failed
+  KPDELTA_ERR_WRITE,        // output write failed
+  KPDELTA_ERR_BOUNDS,       // op outside the old image or past newSize
+  KPDELTA_ERR_OP,           // unknown op
+  KPDELTA_ERR_NEW_IMAGE,    // output size or CRC mismatch
+};
+
+static inline const char* kpdeltaResultName(KpDeltaResult r) {
+  static const char* const names[] = { "ok", "bad header", "old image mismatch", "read failed",
+                                       "write failed", "out of bounds", "bad op", "new image mismatch" };
+  return (unsigned)r < sizeof names / sizeof names[0] ? names[r] : "?";
+}
+
+static inline uint32_t kpdeltaGetU32(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline bool kpdeltaHeaderValid(const KpDeltaHeader& h) {
+  return h.magic == KPDELTA_MAGIC && h.version == KPDELTA_VERSION;
+}
+
+/**
+ * @brief CRC-32 of the first 'size' bytes of an image read in scratch-sized pieces.
+ * @param readOld bool(uint32_t offset, uint8_t* dst, size_t n)
+ * @return True if every read succeeded; crc receives the checksum.
+ */
+template <typename ReadOld>
+bool kpdeltaImageCrc(ReadOld&& readOld, uint32_t size, uint8_t* scratch, size_t scratchSize, uint32_t& crc) {
+  crc = 0;
+  for (uint32_t off = 0; off < size; ) {
+    size_t n = size - off < scratchSize ? size - off : scratchSize;
+    if (!readOld(off, scratch, n)) return false;
+    crc = kplogCrc32(scratch, n, crc);
+    off += n;
+  }
+  return true;
+}
+
+/**
+ * @brief Applies the op stream that follows a header (already read and validated).
+ * @param h Patch header.
+ * @param readOld bool(uint32_t offset, uint8_t* dst, size_t n) – old image.
+ * @param readPatch bool(uint8_t* dst, size_t n) – next bytes of the patch, exactly n.
+ * @param write bool(const uint8_t* src, size_t n) – appends to the new image.
+ * @param scratch Work buffer; its size bounds every read and write.
+ * @param scratchSize At least 16 bytes.
+ * @return KPDELTA_OK if the output has newSize bytes with CRC newCrc.
+ */
+template <typename ReadOld, typename ReadPatch, typename Write>
+KpDeltaResult kpdeltaApply(const KpDeltaHeader& h, ReadOld&& readOld, ReadPatch&& readPatch, Write&& write,
+                           uint8_t* scratch, size_t scratchSize) {
+  uint32_t written = 0, crc = 0;
+  for (;;) {
+    uint8_t op;
+    if (!readPatch(&op, 1)) return KPDELTA_ERR_READ;
+    if (op == KPDELTA_OP_END) break;
+    uint8_t args[8];
+    if (op == KPDELTA_OP_COPY) {
+      if (!readPatch(args, 8)) return KPDELTA_ERR_READ;
+      uint32_t off = kpdeltaGetU32(args), len = kpdeltaGetU32(args + 4);
+      if (off > h.oldSize || len > h.oldSize - off || len > h.newSize - written) return KPDELTA_ERR_BOUNDS;
+      while (len > 0) {
+        size_t n = len < scratchSize ? len : scratchSize;
+        if (!readOld(off, scratch, n)) return KPDELTA_ERR_READ;
+        if (!write(scratch, n)) return KPDELTA_ERR_WRITE;
+        crc = kplogCrc32(scratch, n, crc);
+        off += n; len -= n; written += n;
+      }
+    } else if (op == KPDELTA_OP_ADD) {
+      if (!readPatch(args, 4)) return KPDELTA_ERR_READ;
+      uint32_t len = kpdeltaGetU32(args);
+      if (len > h.newSize - written) return KPDELTA_ERR_BOUNDS;
+      while (len > 0) {
+        size_t n = len < scratchSize ? len : scratchSize;
+        if (!readPatch(scratch, n)) return KPDELTA_ERR_READ;
+        if (!write(scratch, n)) return KPDELTA_ERR_WRITE;
+        crc = kplogCrc32(scratch, n, crc);
+        len -= n; written += n;
+      }
+    } else {
+      return KPDELTA_ERR_OP;
+    }
+  }
+  return (written == h.newSize && crc == h.newCrc) ? KPDELTA_OK : KPDELTA_ERR_NEW_IMAGE;
+}
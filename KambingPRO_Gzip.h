@@ -0,0 +1,175 @@
+// ----------------------------------------------------------------------------------
+//  KambingPRO – small-window gzip encoder for upload payloads
+//  Shared by the ESP32 sketch (uploads) and host tools; plain C++ with fixed-width
+//  types and no allocation, so it compiles unchanged on both.
+// ----------------------------------------------------------------------------------
+//
+//  Output is a standard gzip member (RFC 1952) holding one fixed-Huffman deflate
+//  block (RFC 1951), readable by Utilities.ungzip, zlib and `gzip -d`.
+//
+//  Matching is LZ77 over a KPZ_WINDOW-byte window with hash chains capped at
+//  KPZ_MAX_CHAIN probes. The caller owns the work area (KpGzipWork, ~5 KB), so
+//  memory is bounded and static. Repetitive JSON (batched hourly reports) shrinks
+//  to roughly a third; short unique payloads gain little, which is why the sketch
+//  only compresses above a size threshold.
+// ----------------------------------------------------------------------------------
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "KambingPRO_LogFormat.h"   // kplogCrc32 (same CRC-32 as gzip)
+
+#define KPZ_WINDOW      2048        // match distance limit, power of two
+#define KPZ_HASH_BITS   9
+#define KPZ_MAX_CHAIN   16
+#define KPZ_MIN_MATCH   3
+#define KPZ_MAX_MATCH   258
+#define KPZ_MAX_INPUT   65534       // positions are stored as uint16_t + 1
+
+struct KpGzipWork {
+  uint16_t head[1 << KPZ_HASH_BITS]; // last position + 1 per hash, 0 = none
+  uint16_t prev[KPZ_WINDOW];         // previous position + 1 with the same hash
+};
+
+// LSB-first bit writer into a bounded buffer; overflow latches and is reported at the end.
+struct KpBitWriter {
+  uint8_t* out;
+  size_t   cap;
+  size_t   pos;
+  uint32_t bits;
+  int      count;
+  bool     overflow;
+};
+
+static inline void kpzPutBits(KpBitWriter& w, uint32_t value, int n) {
+  w.bits |= value << w.count;
+  w.count += n;
+  while (w.count >= 8) {
+    if (w.pos < w.cap) w.out[w.pos++] = (uint8_t)w.bits; else w.overflow = true;
+    w.bits >>= 8;
+    w.count -= 8;
+  }
+}
+
+// Huffman codes go out most-significant bit first.
+static inline void kpzPutCode(KpBitWriter& w, uint32_t code, int n) {
+  uint32_t rev = 0;
+  for (int i = 0; i < n; i++) { rev = (rev << 1) | (code & 1); code >>= 1; }
+  kpzPutBits(w, rev, n);
+}
+
+// Fixed literal/length alphabet (RFC 1951 §3.2.6).
+static inline void kpzPutSymbol(KpBitWriter& w, int sym) {
+  if (sym < 144)      kpzPutCode(w, 0x30 + sym, 8);
+  else if (sym < 256) kpzPutCode(w, 0x190 + (sym - 144), 9);
+  else if (sym < 280) kpzPutCode(w, sym - 256, 7);
+  else                kpzPutCode(w, 0xC0 + (sym - 280), 8);
+}
+
+static inline void kpzPutMatch(KpBitWriter& w, int len, int dist) {
+  static const uint16_t lenBase[29]  = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                         35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+  static const uint8_t  lenExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                         3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+  static const uint16_t distBase[24]  = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                          257, 385, 513, 769, 1025, 1537, 2049, 3073 };
+  static const uint8_t  distExtra[24] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                          7, 7, 8, 8, 9, 9, 10, 10 };
+  int l = 28;
+  while (lenBase[l] > len) l--;
+  kpzPutSymbol(w, 257 + l);
+  kpzPutBits(w, len - lenBase[l], lenExtra[l]);
+  int d = 23;
+  while (distBase[d] > dist) d--;
+  kpzPutCode(w, d, 5);
+  kpzPutBits(w, dist - distBase[d], distExtra[d]);
+}
+
+static inline uint32_t kpzHash(const uint8_t* p) {
+  return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << KPZ_HASH_BITS) - 1);
+}
+
+/**
+ * @brief Gzip-compresses a buffer in one pass.
+ * @param in Input bytes.
+ * @param n Input length, at most KPZ_MAX_INPUT.
+ * @param out Output buffer.
+ * @param outCap Output capacity.
+ * @param work Caller-provided work area (reinitialised here).
+ * @return Compressed length, or 0 if it did not fit in outCap (send uncompressed).
+ */
+static inline size_t kpGzip(const uint8_t* in, size_t n, uint8_t* out, size_t outCap, KpGzipWork& work) {
+  if (n > KPZ_MAX_INPUT || outCap < 18) return 0;
+  static const uint8_t header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF }; // deflate, no name/mtime, OS unknown
+  memcpy(out, header, sizeof header);
+  memset(work.head, 0, sizeof work.head);
+
+  KpBitWriter w = { out, outCap - 8, sizeof header, 0, 0, false };  // 8 bytes kept for the trailer
+  kpzPutBits(w, 1, 1);  // BFINAL
+  kpzPutBits(w, 1, 2);  // BTYPE = fixed Huffman
+
+  size_t i = 0;
+  while (i < n && !w.overflow) {
+    int bestLen = 0, bestDist = 0;
+    if (i + KPZ_MIN_MATCH <= n) {
+      uint32_t h = kpzHash(in + i);
+      uint16_t cand = work.head[h];
+      int maxLen = (int)(n - i < KPZ_MAX_MATCH ? n - i : KPZ_MAX_MATCH);
+      for (int chain = 0; cand && chain < KPZ_MAX_CHAIN; chain++) {
+        size_t j = cand - 1u;
+        if (i - j > KPZ_WINDOW - 1) break;
+        if (in[j + bestLen] == in[i + bestLen]) {
+          int len = 0;
+          while (len < maxLen && in[j + len] == in[i + len]) len++;
+          if (len > bestLen) { bestLen = len; bestDist = (int)(i - j); if (len == maxLen) break; }
+        }
+        uint16_t next = work.prev[j & (KPZ_WINDOW - 1)];
+        if (next >= cand) break;  // slot reused by a newer position: chain ended
+        cand = next;
+      }
+    }
+    int step = bestLen >= KPZ_MIN_MATCH ? bestLen : 1;
+    if (step > 1) kpzPutMatch(w, bestLen, bestDist);
+    else          kpzPutSymbol(w, in[i]);
+    for (int k = 0; k < step; k++, i++) {  // insert every covered position into the chains
+      if (i + KPZ_MIN_MATCH > n) continue;
+      uint32_t h = kpzHash(in + i);
+      work.prev[i & (KPZ_WINDOW - 1)] = work.head[h];
+      work.head[h] = (uint16_t)(i + 1);
+    }
+  }
+  kpzPutSymbol(w, 256);        // end of block
+  kpzPutBits(w, 0, 7);         // flush to a byte boundary
+  if (w.overflow) return 0;
+
+  uint32_t crc = kplogCrc32(in, n);
+  size_t pos = w.pos;
+  for (int b = 0; b < 4; b++) out[pos++] = (uint8_t)(crc >> (8 * b));
+  for (int b = 0; b < 4; b++) out[pos++] = (uint8_t)((uint32_t)n >> (8 * b));
+  return pos;
+}
+
+/** @brief Length of the base64 encoding of n bytes (without NUL). */
+static inline size_t kpBase64Length(size_t n) { return 4 * ((n + 2) / 3); }
+
+/**
+ * @brief Standard base64 (with padding). out must hold kpBase64Length(n) + 1 bytes;
+ * the result is NUL-terminated.
+ * @return Encoded length.
+ */
+static inline size_t kpBase64Encode(const uint8_t* in, size_t n, char* out) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t o = 0;
+  for (size_t i = 0; i < n; i += 3) {
+    uint32_t v = (uint32_t)in[i] << 16;
+    if (i + 1 < n) v |= (uint32_t)in[i + 1] << 8;
+    if (i + 2 < n) v |= in[i + 2];
+    out[o++] = alphabet[(v >> 18) & 63];
+    out[o++] = alphabet[(v >> 12) & 63];
+    out[o++] = i + 1 < n ? alphabet[(v >> 6) & 63] : '=';
+    out[o++] = i + 2 < n ? alphabet[v & 63] : '=';
+  }
+  out[o] = '\0';
+  return o;
+}
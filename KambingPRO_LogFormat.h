@@ -0,0 +1,111 @@
+// ----------------------------------------------------------------------------------
+//  KambingPRO – columnar on-flash log format
+//  Shared by the ESP32 sketch (writer) and the host tools in tools/ (readers).
+//  Plain C++ with fixed-width types only, so it compiles unchanged on both.
+// ----------------------------------------------------------------------------------
+//
+//  Log file (/kplog.bin): append-only sequence of blocks, one per hour.
+//
+//    [KpLogBlockHeader][column 0: rows × int16][column 1: rows × int16] ...
+//
+//  Every value is fixed-point int16 (value × KPLOG_COLUMN_SCALE[c]); a missing
+//  row holds KPLOG_MISSING. Row r of a block is the minute startEpoch + r × 60.
+//  The header carries per-column min/max (for skipping blocks without decoding)
+//  and CRC32s of both the header and the payload, so a block torn by a power
+//  loss is detected and cut off on the next boot.
+//
+//  Index file (/kplog.idx): one KpLogIndexEntry per block, in epoch order, so a
+//  time range is located with a binary search over fixed-size entries.
+// ----------------------------------------------------------------------------------
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define KPLOG_MAGIC          0x474C504BUL   // "KPLG" little-endian
+#define KPLOG_VERSION        1
+#define KPLOG_ROWS_PER_BLOCK 60             // one row per minute, one block per hour
+#define KPLOG_ROW_SECONDS    60
+#define KPLOG_MISSING        INT16_MIN
+
+enum KpLogColumn {
+  KPLOG_COL_AMMONIA,      // ppm
+  KPLOG_COL_TEMPERATURE,  // °C
+  KPLOG_COL_HUMIDITY,     // %RH
+  KPLOG_COL_STORAGE_TANK, // liters
+  KPLOG_COL_PUMP_DUTY,    // seconds ON within the minute
+  KPLOG_COL_AUX_DUTY,
+  KPLOG_COL_CCTV_DUTY,
+  KPLOG_COL_SIREN_DUTY,
+  KPLOG_COLUMN_COUNT
+};
+
+static const char* const KPLOG_COLUMN_NAMES[KPLOG_COLUMN_COUNT] = {
+  "ammonia", "temperature", "humidity", "storageTank",
+  "pumpDutyS", "auxDutyS", "cctvDutyS", "sirenDutyS"
+};
+
+// Fixed-point scale per column: stored = round(value × scale).
+static const float KPLOG_COLUMN_SCALE[KPLOG_COLUMN_COUNT] = {
+  10.0f, 10.0f, 10.0f, 10.0f, 1.0f, 1.0f, 1.0f, 1.0f
+};
+
+struct KpLogBlockHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t rowCount;                      // always KPLOG_ROWS_PER_BLOCK in version 1
+  uint32_t startEpoch;                    // UTC seconds of row 0 (top of the hour)
+  uint16_t columnCount;
+  uint16_t reserved;
+  int16_t  colMin[KPLOG_COLUMN_COUNT];    // over non-missing rows; KPLOG_MISSING if none
+  int16_t  colMax[KPLOG_COLUMN_COUNT];
+  uint32_t payloadCrc;                    // CRC32 of the column data that follows
+  uint32_t headerCrc;                     // CRC32 of this header up to (not including) this field
+};
+
+struct KpLogIndexEntry {
+  uint32_t startEpoch;
+  uint32_t offset;                        // byte offset of the block header in the log file
+};
+
+static const size_t KPLOG_PAYLOAD_BYTES = (size_t)KPLOG_COLUMN_COUNT * KPLOG_ROWS_PER_BLOCK * sizeof(int16_t);
+static const size_t KPLOG_BLOCK_BYTES   = sizeof(KpLogBlockHeader) + KPLOG_PAYLOAD_BYTES;
+
+/**
+ * @brief Standard CRC-32 (IEEE 802.3, reflected 0xEDB88320), nibble-table variant.
+ * Small enough for the ESP32 and fast enough for host-side dumps.
+ * @param data Bytes to checksum.
+ * @param len Number of bytes.
+ * @param crc Running CRC from a previous call, 0 to start.
+ * @return Updated CRC.
+ */
+static inline uint32_t kplogCrc32(const void* data, size_t len, uint32_t crc = 0) {
+  static const uint32_t table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+  };
+  const uint8_t* p = (const uint8_t*)data;
+  crc = ~crc;
+  while (len--) {
+    crc = table[(crc ^ *p) & 0x0F] ^ (crc >> 4);
+    crc = table[(crc ^ (*p >> 4)) & 0x0F] ^ (crc >> 4);
+    p++;
+  }
+  return ~crc;
+}
+
+/**
+ * @brief Computes the header CRC over every field before headerCrc.
+ */
+static inline uint32_t kplogHeaderCrc(const KpLogBlockHeader& h) {
+  return kplogCrc32(&h, offsetof(KpLogBlockHeader, headerCrc));
+}
+
+/**
+ * @brief Checks magic, version, shape and header CRC (not the payload).
+ */
+static inline bool kplogHeaderValid(const KpLogBlockHeader& h) {
+  return h.magic == KPLOG_MAGIC && h.version == KPLOG_VERSION &&
+         h.rowCount == KPLOG_ROWS_PER_BLOCK && h.columnCount == KPLOG_COLUMN_COUNT &&
+         h.headerCrc == kplogHeaderCrc(h);
+}
@@ -0,0 +1,88 @@
+// ----------------------------------------------------------------------------------
+//  KambingPRO – event trace ring and dump format
+//  Shared by the ESP32 sketch (records and dumps) and tools/kptrace2json.cpp
+//  (converts a dump to Chrome/Perfetto trace JSON). Plain C++, no allocation.
+// ----------------------------------------------------------------------------------
+//
+//  The sketch keeps the last N fixed-size events in RAM. Recording is one atomic
+//  increment, one micros() and a 12-byte store, so it is safe from any task on
+//  either core. A dump is self-describing:
+//
+//    [KpTraceDumpHeader] track names, stage names, event names (NUL-terminated,
+//    in that order) [KpTraceEvent × eventCount, oldest first]
+//
+//  Over HTTP the dump is sent as is; over serial it is base64 in 76-character
+//  lines between "KPTRACE BEGIN <bytes>" and "KPTRACE END", so it survives a
+//  terminal capture with log lines around it.
+//
+//  Timestamps are the low 32 bits of micros() and wrap every ~71 minutes; the
+//  converter unwraps them from one event to the next.
+// ----------------------------------------------------------------------------------
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define KPTRACE_MAGIC   0x3154504BUL  // "KPT1" little-endian
+#define KPTRACE_VERSION 1
+
+enum KpTraceKind : uint8_t {
+  KPTRACE_STAGE   = 1,  // track entered stage 'id'; the previous stage of the track ends here
+  KPTRACE_INSTANT = 2,  // named event 'id' on a track, value 'arg'
+  KPTRACE_RELAY   = 3,  // relay on GPIO 'id' switched to 'arg' (0/1)
+};
+
+struct KpTraceEvent {
+  uint32_t us;
+  uint8_t  kind;
+  uint8_t  track;
+  uint16_t id;
+  int32_t  arg;
+};
+static_assert(sizeof(KpTraceEvent) == 12, "trace event layout is part of the dump format");
+
+struct KpTraceDumpHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t eventSize;
+  uint32_t eventCount;   // events that follow
+  uint32_t totalEvents;  // recorded since boot (eventCount of them survive)
+  uint32_t nowUs;        // micros() when the dump was taken
+  uint8_t  trackCount;
+  uint8_t  stageCount;
+  uint8_t  eventNameCount;
+  uint8_t  reserved;
+};
+
+/**
+ * @brief Streams a dump of a trace ring to sink(const uint8_t* p, size_t n).
+ * @param ring Event ring of 'capacity' slots; event i lives at ring[i % capacity].
+ * @param head Number of events recorded so far.
+ * @param tracks, stages, events Name tables written into the dump.
+ * @return Bytes written.
+ */
+template <typename Sink>
+size_t kptraceWriteDump(const KpTraceEvent* ring, uint32_t capacity, uint32_t head, uint32_t nowUs,
+                        const char* const* tracks, uint8_t trackCount,
+                        const char* const* stages, uint8_t stageCount,
+                        const char* const* events, uint8_t eventNameCount, Sink&& sink) {
+  uint32_t count = head < capacity ? head : capacity;
+  KpTraceDumpHeader h = { KPTRACE_MAGIC, KPTRACE_VERSION, (uint16_t)sizeof(KpTraceEvent), count, head, nowUs,
+                          trackCount, stageCount, eventNameCount, 0 };
+  size_t total = 0;
+  sink((const uint8_t*)&h, sizeof h); total += sizeof h;
+  const char* const* tables[3] = { tracks, stages, events };
+  const uint8_t      sizes[3]  = { trackCount, stageCount, eventNameCount };
+  for (int t = 0; t < 3; t++) {
+    for (int i = 0; i < sizes[t]; i++) {
+      size_t n = strlen(tables[t][i]) + 1;
+      sink((const uint8_t*)tables[t][i], n); total += n;
+    }
+  }
+  for (uint32_t i = head - count; i != head; i++) {
+    KpTraceEvent e = ring[i % capacity];  // copy: a writer may be overwriting the oldest slots
+    sink((const uint8_t*)&e, sizeof e); total += sizeof e;
+  }
+  return total;
+}
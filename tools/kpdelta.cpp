@@ -0,0 +1,263 @@
+// ----------------------------------------------------------------------------------
+//  kpdelta – firmware delta patches and OTA manifests for KambingPRO
+//
+//  Build:  g++ -O2 -std=c++17 -o kpdelta tools/kpdelta.cpp
+//
+//  Usage:  kpdelta diff  OLD.bin NEW.bin PATCH.kpd
+//          kpdelta apply OLD.bin PATCH.kpd OUT.bin
+//          kpdelta manifest --build N --version V --full NEW.bin [--url-prefix /fw/]
+//                           [--delta FROMBUILD:PATCH.kpd]... [--rollout PCT] [--hold RAB002,...]
+//
+//  diff writes a patch in the format of KambingPRO_Delta.h: COPY ops for ranges
+//  found in the old image (hash-chain matching over 8-byte keys, preferring the
+//  continuation of the previous copy so shifted code stays one op) and ADD ops for
+//  the rest. apply runs the same decoder as the device, so a patch can be checked
+//  offline before it is published.
+//
+//  manifest prints the JSON the devices poll (see OTA_MANIFEST_* in the sketch).
+//  Serve it with the images from any static server on the barn LAN, e.g.
+//    python3 -m http.server 8080 --directory ota/
+//  and raise --rollout from a small percentage to 100 as the first stage proves
+//  healthy. Devices listed in --hold never update.
+// ----------------------------------------------------------------------------------
+
+#include "../KambingPRO_Delta.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+const int    KEY_BYTES   = 8;     // hashed prefix of a candidate match
+const int    MIN_COPY    = 12;    // shorter matches cost more as an op than as literals
+const int    MAX_CHAIN   = 64;
+const int    HASH_BITS   = 20;
+
+bool readFile(const char* path, std::vector<uint8_t>& out) {
+  FILE* f = fopen(path, "rb");
+  if (!f) return false;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  out.resize(size > 0 ? (size_t)size : 0);
+  bool ok = out.empty() || fread(out.data(), 1, out.size(), f) == out.size();
+  fclose(f);
+  return ok;
+}
+
+bool writeFile(const char* path, const std::vector<uint8_t>& data) {
+  FILE* f = fopen(path, "wb");
+  if (!f) return false;
+  bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+  return fclose(f) == 0 && ok;
+}
+
+void putU32(std::vector<uint8_t>& out, uint32_t v) {
+  for (int b = 0; b < 4; b++) out.push_back((uint8_t)(v >> (8 * b)));
+}
+
+uint32_t hashKey(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof v);
+  return (uint32_t)((v * 0x9E3779B97F4A7C15ULL) >> (64 - HASH_BITS));
+}
+
+struct DiffStats {
+  size_t copies = 0, adds = 0, copyBytes = 0, addBytes = 0;
+};
+
+// Builds the op stream turning 'from' into 'to'.
+std::vector<uint8_t> makePatch(const std::vector<uint8_t>& from, const std::vector<uint8_t>& to, DiffStats& st) {
+  std::vector<uint8_t> patch(sizeof(KpDeltaHeader));
+  KpDeltaHeader h = { KPDELTA_MAGIC, KPDELTA_VERSION, 0,
+                      (uint32_t)from.size(), kplogCrc32(from.data(), from.size()),
+                      (uint32_t)to.size(),   kplogCrc32(to.data(), to.size()) };
+  memcpy(patch.data(), &h, sizeof h);
+
+  // Hash chains over every position of the old image
+  std::vector<int32_t> head((size_t)1 << HASH_BITS, -1), next(from.size(), -1);
+  for (size_t p = 0; p + KEY_BYTES <= from.size(); p++) {
+    uint32_t k = hashKey(&from[p]);
+    next[p] = head[k];
+    head[k] = (int32_t)p;
+  }
+
+  auto matchLen = [&](size_t o, size_t n) {
+    size_t len = 0;
+    while (o + len < from.size() && n + len < to.size() && from[o + len] == to[n + len]) len++;
+    return len;
+  };
+
+  size_t litStart = 0;           // start of pending ADD bytes
+  size_t expect = SIZE_MAX;      // old offset continuing the previous copy
+  auto flushLiterals = [&](size_t end) {
+    if (end <= litStart) return;
+    patch.push_back(KPDELTA_OP_ADD);
+    putU32(patch, (uint32_t)(end - litStart));
+    patch.insert(patch.end(), to.begin() + litStart, to.begin() + end);
+    st.adds++; st.addBytes += end - litStart;
+  };
+
+  size_t i = 0;
+  while (i < to.size()) {
+    size_t bestLen = 0, bestOff = 0;
+    if (expect < from.size()) {                       // shifted code: same delta as last copy
+      bestLen = matchLen(expect, i);
+      bestOff = expect;
+    }
+    if (bestLen < 64 && i + KEY_BYTES <= to.size()) {
+      int chain = 0;
+      for (int32_t c = head[hashKey(&to[i])]; c >= 0 && chain < MAX_CHAIN; c = next[c], chain++) {
+        size_t len = matchLen((size_t)c, i);
+        if (len > bestLen) { bestLen = len; bestOff = (size_t)c; }
+      }
+    }
+    if (bestLen >= (size_t)MIN_COPY) {
+      // Extend backwards over pending literals
+      while (i > litStart && bestOff > 0 && from[bestOff - 1] == to[i - 1]) { i--; bestOff--; bestLen++; }
+      flushLiterals(i);
+      patch.push_back(KPDELTA_OP_COPY);
+      putU32(patch, (uint32_t)bestOff);
+      putU32(patch, (uint32_t)bestLen);
+      st.copies++; st.copyBytes += bestLen;
+      i += bestLen;
+      litStart = i;
+      expect = bestOff + bestLen;
+    } else {
+      i++;
+      if (expect < from.size()) expect++;
+    }
+  }
+  flushLiterals(to.size());
+  patch.push_back(KPDELTA_OP_END);
+  return patch;
+}
+
+// Same decoder as the device, over in-memory buffers.
+KpDeltaResult applyPatch(const std::vector<uint8_t>& from, const std::vector<uint8_t>& patch, std::vector<uint8_t>& out) {
+  if (patch.size() < sizeof(KpDeltaHeader)) return KPDELTA_ERR_HEADER;
+  KpDeltaHeader h;
+  memcpy(&h, patch.data(), sizeof h);
+  if (!kpdeltaHeaderValid(h)) return KPDELTA_ERR_HEADER;
+  if (h.oldSize != from.size() || kplogCrc32(from.data(), from.size()) != h.oldCrc) return KPDELTA_ERR_OLD_IMAGE;
+  size_t pos = sizeof h;
+  uint8_t scratch[1024];
+  out.clear();
+  return kpdeltaApply(h,
+    [&](uint32_t off, uint8_t* dst, size_t n) { memcpy(dst, &from[off], n); return true; },
+    [&](uint8_t* dst, size_t n) {
+      if (n > patch.size() - pos) return false;
+      memcpy(dst, &patch[pos], n); pos += n; return true;
+    },
+    [&](const uint8_t* src, size_t n) { out.insert(out.end(), src, src + n); return true; },
+    scratch, sizeof scratch);
+}
+
+const char* baseName(const char* path) {
+  const char* s = strrchr(path, '/');
+  return s ? s + 1 : path;
+}
+
+int usage() {
+  fprintf(stderr,
+          "usage: kpdelta diff OLD.bin NEW.bin PATCH.kpd\n"
+          "       kpdelta apply OLD.bin PATCH.kpd OUT.bin\n"
+          "       kpdelta manifest --build N --version V --full NEW.bin [--url-prefix /fw/]\n"
+          "                        [--delta FROMBUILD:PATCH.kpd]... [--rollout PCT] [--hold THING,...]\n");
+  return 2;
+}
+
+int runManifest(int argc, char** argv) {
+  long build = -1, rollout = 100;
+  std::string version, fullPath, prefix = "/fw/", hold;
+  std::vector<std::string> deltas;
+  for (int i = 2; i < argc; i++) {
+    std::string a = argv[i];
+    bool hasVal = i + 1 < argc;
+    if (a == "--build" && hasVal)           build = atol(argv[++i]);
+    else if (a == "--version" && hasVal)    version = argv[++i];
+    else if (a == "--full" && hasVal)       fullPath = argv[++i];
+    else if (a == "--url-prefix" && hasVal) prefix = argv[++i];
+    else if (a == "--delta" && hasVal)      deltas.push_back(argv[++i]);
+    else if (a == "--rollout" && hasVal)    rollout = atol(argv[++i]);
+    else if (a == "--hold" && hasVal)       hold = argv[++i];
+    else return usage();
+  }
+  if (build < 0 || fullPath.empty()) return usage();
+  std::vector<uint8_t> full;
+  if (!readFile(fullPath.c_str(), full)) { fprintf(stderr, "cannot read %s\n", fullPath.c_str()); return 1; }
+
+  printf("{\n  \"build\": %ld,\n  \"version\": \"%s\",\n", build, version.c_str());
+  printf("  \"full\": { \"url\": \"%s%s\", \"size\": %zu, \"crc\": %u },\n",
+         prefix.c_str(), baseName(fullPath.c_str()), full.size(), kplogCrc32(full.data(), full.size()));
+  printf("  \"deltas\": [");
+  for (size_t d = 0; d < deltas.size(); d++) {
+    size_t colon = deltas[d].find(':');
+    if (colon == std::string::npos) return usage();
+    std::string path = deltas[d].substr(colon + 1);
+    std::vector<uint8_t> patch;
+    if (!readFile(path.c_str(), patch)) { fprintf(stderr, "cannot read %s\n", path.c_str()); return 1; }
+    KpDeltaHeader h;
+    if (patch.size() < sizeof h) { fprintf(stderr, "%s: not a patch\n", path.c_str()); return 1; }
+    memcpy(&h, patch.data(), sizeof h);
+    if (!kpdeltaHeaderValid(h) || h.newCrc != kplogCrc32(full.data(), full.size())) {
+      fprintf(stderr, "%s does not produce %s\n", path.c_str(), fullPath.c_str());
+      return 1;
+    }
+    printf("%s\n    { \"fromBuild\": %ld, \"url\": \"%s%s\", \"size\": %zu }", d ? "," : "",
+           atol(deltas[d].substr(0, colon).c_str()), prefix.c_str(), baseName(path.c_str()), patch.size());
+  }
+  printf("%s],\n  \"rollout\": %ld,\n  \"hold\": [", deltas.empty() ? "" : "\n  ", rollout);
+  size_t start = 0;
+  for (int n = 0; start < hold.size(); n++) {
+    size_t comma = hold.find(',', start);
+    if (comma == std::string::npos) comma = hold.size();
+    printf("%s\"%s\"", n ? ", " : "", hold.substr(start, comma - start).c_str());
+    start = comma + 1;
+  }
+  printf("]\n}\n");
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) return usage();
+  std::string cmd = argv[1];
+
+  if (cmd == "diff" && argc == 5) {
+    std::vector<uint8_t> from, to;
+    if (!readFile(argv[2], from)) { fprintf(stderr, "cannot read %s\n", argv[2]); return 1; }
+    if (!readFile(argv[3], to))   { fprintf(stderr, "cannot read %s\n", argv[3]); return 1; }
+    auto t0 = std::chrono::steady_clock::now();
+    DiffStats st;
+    std::vector<uint8_t> patch = makePatch(from, to, st);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::vector<uint8_t> check;
+    KpDeltaResult r = applyPatch(from, patch, check);
+    if (r != KPDELTA_OK) { fprintf(stderr, "self-check failed: %s\n", kpdeltaResultName(r)); return 1; }
+    if (!writeFile(argv[4], patch)) { fprintf(stderr, "cannot write %s\n", argv[4]); return 1; }
+    fprintf(stderr, "%zu -> %zu bytes: patch %zu bytes (%.1f%% of full), %zu copies / %zu bytes, %zu adds / %zu bytes, %.2f s\n",
+            from.size(), to.size(), patch.size(), to.empty() ? 0.0 : 100.0 * patch.size() / to.size(),
+            st.copies, st.copyBytes, st.adds, st.addBytes, secs);
+    return 0;
+  }
+
+  if (cmd == "apply" && argc == 5) {
+    std::vector<uint8_t> from, patch, out;
+    if (!readFile(argv[2], from))  { fprintf(stderr, "cannot read %s\n", argv[2]); return 1; }
+    if (!readFile(argv[3], patch)) { fprintf(stderr, "cannot read %s\n", argv[3]); return 1; }
+    KpDeltaResult r = applyPatch(from, patch, out);
+    if (r != KPDELTA_OK) { fprintf(stderr, "apply failed: %s\n", kpdeltaResultName(r)); return 1; }
+    if (!writeFile(argv[4], out)) { fprintf(stderr, "cannot write %s\n", argv[4]); return 1; }
+    fprintf(stderr, "wrote %zu bytes, CRC ok\n", out.size());
+    return 0;
+  }
+
+  if (cmd == "manifest") return runManifest(argc, argv);
+  return usage();
+}
@@ -0,0 +1,146 @@
+// ----------------------------------------------------------------------------------
+//  kplog2csv – convert a KambingPRO columnar flash log dump to CSV
+//
+//  Build:  g++ -O2 -std=c++17 -o kplog2csv tools/kplog2csv.cpp
+//  Fetch:  curl -o kplog.bin "http://<device>/api/log?file=log"
+//          curl -o kplog.idx "http://<device>/api/log?file=index"
+//  Usage:  kplog2csv kplog.bin [--index kplog.idx] [--from EPOCH] [--to EPOCH] > barn.csv
+//
+//  Blocks are verified (header and payload CRC). A damaged block is reported on
+//  stderr and skipped by resynchronising on the next block magic. With an index
+//  and --from, the start block is found by binary search instead of a scan.
+// ----------------------------------------------------------------------------------
+
+#include "../KambingPRO_LogFormat.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace {
+
+bool readFile(const char* path, std::vector<uint8_t>& out) {
+  FILE* f = fopen(path, "rb");
+  if (!f) return false;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  out.resize(size > 0 ? (size_t)size : 0);
+  bool ok = out.empty() || fread(out.data(), 1, out.size(), f) == out.size();
+  fclose(f);
+  return ok;
+}
+
+// Appends a fixed-point value with the given number of decimals (0 or 1).
+char* putFixed(char* p, int16_t v, bool oneDecimal) {
+  if (v == KPLOG_MISSING) return p;
+  int x = v;
+  if (x < 0) { *p++ = '-'; x = -x; }
+  int whole = oneDecimal ? x / 10 : x;
+  char tmp[8]; int n = 0;
+  do { tmp[n++] = (char)('0' + whole % 10); whole /= 10; } while (whole);
+  while (n) *p++ = tmp[--n];
+  if (oneDecimal) { *p++ = '.'; *p++ = (char)('0' + x % 10); }
+  return p;
+}
+
+// Appends "YYYY-MM-DDTHH:MM:00Z".
+char* putIsoMinute(char* p, uint32_t epoch) {
+  time_t t = (time_t)epoch;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  return p + strftime(p, 24, "%Y-%m-%dT%H:%M:00Z", &tm);
+}
+
+// Returns the offset of the first indexed block that may hold rows >= from.
+size_t seekWithIndex(const std::vector<uint8_t>& idx, uint32_t from) {
+  size_t n = idx.size() / sizeof(KpLogIndexEntry);
+  const KpLogIndexEntry* e = reinterpret_cast<const KpLogIndexEntry*>(idx.data());
+  size_t lo = 0, hi = n;
+  while (lo < hi) {  // first entry whose block ends after 'from'
+    size_t mid = (lo + hi) / 2;
+    if (e[mid].startEpoch + KPLOG_ROWS_PER_BLOCK * KPLOG_ROW_SECONDS <= from) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo < n ? e[lo].offset : 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* logPath = nullptr;
+  const char* idxPath = nullptr;
+  uint32_t from = 0, to = UINT32_MAX;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--index") && i + 1 < argc)     idxPath = argv[++i];
+    else if (!strcmp(argv[i], "--from") && i + 1 < argc) from = (uint32_t)strtoul(argv[++i], nullptr, 10);
+    else if (!strcmp(argv[i], "--to") && i + 1 < argc)   to   = (uint32_t)strtoul(argv[++i], nullptr, 10);
+    else if (argv[i][0] != '-' && !logPath)              logPath = argv[i];
+    else { fprintf(stderr, "usage: %s kplog.bin [--index kplog.idx] [--from EPOCH] [--to EPOCH]\n", argv[0]); return 2; }
+  }
+  if (!logPath) { fprintf(stderr, "usage: %s kplog.bin [--index kplog.idx] [--from EPOCH] [--to EPOCH]\n", argv[0]); return 2; }
+
+  std::vector<uint8_t> log, idx;
+  if (!readFile(logPath, log)) { fprintf(stderr, "cannot read %s\n", logPath); return 1; }
+  size_t off = 0;
+  if (idxPath && from > 0) {
+    if (!readFile(idxPath, idx)) { fprintf(stderr, "cannot read %s\n", idxPath); return 1; }
+    off = seekWithIndex(idx, from);
+  }
+
+  std::string out;
+  out.reserve(1 << 20);
+  out += "timestamp,epoch";
+  for (int c = 0; c < KPLOG_COLUMN_COUNT; c++) { out += ','; out += KPLOG_COLUMN_NAMES[c]; }
+  out += '\n';
+
+  size_t blocks = 0, rows = 0, damaged = 0;
+  char line[256];
+  while (off + KPLOG_BLOCK_BYTES <= log.size()) {
+    KpLogBlockHeader h;
+    memcpy(&h, log.data() + off, sizeof h);
+    const uint8_t* payload = log.data() + off + sizeof h;
+    if (!kplogHeaderValid(h) || kplogCrc32(payload, KPLOG_PAYLOAD_BYTES) != h.payloadCrc) {
+      damaged++;
+      fprintf(stderr, "damaged block at offset %zu, resyncing\n", off);
+      uint32_t magic = KPLOG_MAGIC;
+      const uint8_t* hit = nullptr;
+      for (size_t p = off + 1; p + sizeof magic <= log.size(); p++) {
+        if (!memcmp(log.data() + p, &magic, sizeof magic)) { hit = log.data() + p; break; }
+      }
+      if (!hit) break;
+      off = (size_t)(hit - log.data());
+      continue;
+    }
+    off += KPLOG_BLOCK_BYTES;
+    if (h.startEpoch > to) break;
+    blocks++;
+
+    int16_t cols[KPLOG_COLUMN_COUNT][KPLOG_ROWS_PER_BLOCK];
+    memcpy(cols, payload, sizeof cols);
+    for (int r = 0; r < KPLOG_ROWS_PER_BLOCK; r++) {
+      uint32_t t = h.startEpoch + r * KPLOG_ROW_SECONDS;
+      if (t < from || t > to) continue;
+      bool any = false;
+      for (int c = 0; c < KPLOG_COLUMN_COUNT && !any; c++) any = cols[c][r] != KPLOG_MISSING;
+      if (!any) continue;
+
+      char* p = putIsoMinute(line, t);
+      p += snprintf(p, 16, ",%u", t);
+      for (int c = 0; c < KPLOG_COLUMN_COUNT; c++) {
+        *p++ = ',';
+        p = putFixed(p, cols[c][r], KPLOG_COLUMN_SCALE[c] == 10.0f);
+      }
+      *p++ = '\n';
+      out.append(line, p - line);
+      rows++;
+    }
+    if (out.size() > (1 << 20) - 4096) { fwrite(out.data(), 1, out.size(), stdout); out.clear(); }
+  }
+  fwrite(out.data(), 1, out.size(), stdout);
+  fprintf(stderr, "%zu blocks, %zu rows, %zu damaged\n", blocks, rows, damaged);
+  return 0;
+}
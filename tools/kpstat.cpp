@@ -0,0 +1,645 @@
+// ----------------------------------------------------------------------------------
+//  kpstat – host-side analytics for exported KambingPRO barn data
+//
+//  Build:  g++ -O3 -march=native -std=c++17 -pthread -o kpstat tools/kpstat.cpp
+//
+//  Usage:  kpstat rollup    [--by day|month]  FILES...
+//          kpstat corr      [--maxlag HOURS]  FILES...
+//          kpstat anomalies [--z SIGMA]       FILES...
+//          kpstat bench     [--barns N] [--years Y]
+//          (all commands accept --threads N; default = hardware threads,
+//           and --tz HOURS, the barn's UTC offset; default 8)
+//
+//  FILES are Google Sheet CSV exports (one RAB### tab per file, column layout of
+//  "KambingPRO (AppsScript).js", header row optional, local timestamps) or raw
+//  device log dumps (*.bin from /api/log, UTC, see KambingPRO_LogFormat.h). Both
+//  are held in UTC; days and months are bucketed and labelled in barn local
+//  time. The barn name is taken
+//  from the file name. Data is held column-wise per barn; scans run one barn
+//  per worker thread, and the per-column kernels use AVX2 when compiled for it.
+// ----------------------------------------------------------------------------------
+
+#include "../KambingPRO_LogFormat.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// ---- Columnar dataset ------------------------------------------------------------
+
+enum Column { COL_AMMONIA, COL_TEMPERATURE, COL_HUMIDITY, COL_TANK, COL_PUMP_S, COL_COUNT };
+const char* const COLUMN_NAMES[COL_COUNT] = { "ammonia", "temperature", "humidity", "storageTank", "pumpDutyS" };
+
+struct Barn {
+  std::string           name;
+  std::vector<uint32_t> epoch;          // sorted ascending
+  std::vector<float>    col[COL_COUNT]; // NaN = missing
+
+  size_t rows() const { return epoch.size(); }
+};
+
+unsigned threadCount = std::max(1u, std::thread::hardware_concurrency());
+int      barnUtcOffsetS = 8 * 3600;  // barn local time (GMT_OFFSET_SECONDS in the sketch): sheet timestamps, report periods
+
+// Runs fn(i) for i in [0, n) across threadCount workers.
+void parallelFor(size_t n, const std::function<void(size_t)>& fn) {
+  std::atomic<size_t> next{0};
+  std::vector<std::thread> pool;
+  unsigned workers = (unsigned)std::min<size_t>(threadCount, n);
+  for (unsigned w = 0; w < workers; w++) {
+    pool.emplace_back([&] { for (size_t i; (i = next++) < n; ) fn(i); });
+  }
+  for (auto& t : pool) t.join();
+}
+
+// ---- Kernels ---------------------------------------------------------------------
+
+struct Moments {
+  double n = 0, sum = 0, sumsq = 0;
+  float  min = INFINITY, max = -INFINITY;
+  double mean() const { return n > 0 ? sum / n : NAN; }
+  double stddev() const { return n > 1 ? std::sqrt(std::max(0.0, (sumsq - sum * sum / n) / (n - 1))) : NAN; }
+};
+
+struct PairMoments {
+  double n = 0, sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+  double pearson() const {
+    double va = saa - sa * sa / n, vb = sbb - sb * sb / n;
+    return (n > 2 && va > 0 && vb > 0) ? (sab - sa * sb / n) / std::sqrt(va * vb) : NAN;
+  }
+};
+
+Moments momentsScalar(const float* x, size_t n) {
+  Moments m;
+  for (size_t i = 0; i < n; i++) {
+    float v = x[i];
+    if (v != v) continue;
+    m.n++; m.sum += v; m.sumsq += (double)v * v;
+    m.min = std::min(m.min, v); m.max = std::max(m.max, v);
+  }
+  return m;
+}
+
+PairMoments pairMomentsScalar(const float* a, const float* b, size_t n) {
+  PairMoments p;
+  for (size_t i = 0; i < n; i++) {
+    float x = a[i], y = b[i];
+    if (x != x || y != y) continue;
+    p.n++; p.sa += x; p.sb += y; p.saa += (double)x * x; p.sbb += (double)y * y; p.sab += (double)x * y;
+  }
+  return p;
+}
+
+#if defined(__AVX2__)
+double hsum(__m256d v) {
+  __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+// NaN-skipping moments: 8 floats per step, double accumulators for the sums.
+Moments momentsAvx2(const float* x, size_t n) {
+  __m256d cnt = _mm256_setzero_pd(), s0 = cnt, s1 = cnt, q0 = cnt, q1 = cnt;
+  __m256  mn = _mm256_set1_ps(INFINITY), mx = _mm256_set1_ps(-INFINITY);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v    = _mm256_loadu_ps(x + i);
+    __m256 ok   = _mm256_cmp_ps(v, v, _CMP_ORD_Q);
+    __m256 vz   = _mm256_and_ps(v, ok);                  // NaN → 0
+    mn = _mm256_min_ps(mn, _mm256_blendv_ps(_mm256_set1_ps(INFINITY), v, ok));
+    mx = _mm256_max_ps(mx, _mm256_blendv_ps(_mm256_set1_ps(-INFINITY), v, ok));
+    __m256d lo = _mm256_cvtps_pd(_mm256_castps256_ps128(vz));
+    __m256d hi = _mm256_cvtps_pd(_mm256_extractf128_ps(vz, 1));
+    s0 = _mm256_add_pd(s0, lo);                q1 = _mm256_add_pd(q1, _mm256_mul_pd(hi, hi));
+    s1 = _mm256_add_pd(s1, hi);                q0 = _mm256_add_pd(q0, _mm256_mul_pd(lo, lo));
+    __m256 c = _mm256_and_ps(ok, one);
+    cnt = _mm256_add_pd(cnt, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(c)), _mm256_cvtps_pd(_mm256_extractf128_ps(c, 1))));
+  }
+  Moments m = momentsScalar(x + i, n - i);
+  m.n += hsum(cnt); m.sum += hsum(_mm256_add_pd(s0, s1)); m.sumsq += hsum(_mm256_add_pd(q0, q1));
+  float lanes[8];
+  _mm256_storeu_ps(lanes, mn); for (float v : lanes) m.min = std::min(m.min, v);
+  _mm256_storeu_ps(lanes, mx); for (float v : lanes) m.max = std::max(m.max, v);
+  return m;
+}
+
+// Joint-valid pair sums for Pearson correlation, 4 pairs per step in double.
+PairMoments pairMomentsAvx2(const float* a, const float* b, size_t n) {
+  __m256d cnt = _mm256_setzero_pd(), sa = cnt, sb = cnt, saa = cnt, sbb = cnt, sab = cnt;
+  const __m256d one = _mm256_set1_pd(1.0);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x  = _mm256_cvtps_pd(_mm_loadu_ps(a + i));
+    __m256d y  = _mm256_cvtps_pd(_mm_loadu_ps(b + i));
+    __m256d ok = _mm256_and_pd(_mm256_cmp_pd(x, x, _CMP_ORD_Q), _mm256_cmp_pd(y, y, _CMP_ORD_Q));
+    x = _mm256_and_pd(x, ok); y = _mm256_and_pd(y, ok);
+    cnt = _mm256_add_pd(cnt, _mm256_and_pd(ok, one));
+    sa  = _mm256_add_pd(sa, x);                  sb  = _mm256_add_pd(sb, y);
+    saa = _mm256_add_pd(saa, _mm256_mul_pd(x, x)); sbb = _mm256_add_pd(sbb, _mm256_mul_pd(y, y));
+    sab = _mm256_add_pd(sab, _mm256_mul_pd(x, y));
+  }
+  PairMoments p = pairMomentsScalar(a + i, b + i, n - i);
+  p.n += hsum(cnt); p.sa += hsum(sa); p.sb += hsum(sb); p.saa += hsum(saa); p.sbb += hsum(sbb); p.sab += hsum(sab);
+  return p;
+}
+#endif
+
+bool useSimd = true;
+
+Moments moments(const float* x, size_t n) {
+#if defined(__AVX2__)
+  if (useSimd) return momentsAvx2(x, n);
+#endif
+  return momentsScalar(x, n);
+}
+
+PairMoments pairMoments(const float* a, const float* b, size_t n) {
+#if defined(__AVX2__)
+  if (useSimd) return pairMomentsAvx2(a, b, n);
+#endif
+  return pairMomentsScalar(a, b, n);
+}
+
+// ---- Ingest ----------------------------------------------------------------------
+
+int64_t daysFromCivil(int y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  const int64_t era = (y >= 0 ? y : y - 399) / 400;
+  const unsigned yoe = (unsigned)(y - era * 400);
+  const unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (int64_t)doe - 719468;
+}
+
+const char* parseUInt(const char* p, const char* end, int& v) {
+  v = 0;
+  const char* start = p;
+  while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+  return p == start ? nullptr : p;
+}
+
+// "YYYY-MM-DD[ T]HH:MM[:SS]" or Sheets' "M/D/YYYY H:MM:SS". Returns false otherwise.
+bool parseTimestamp(const char* p, const char* end, uint32_t& epoch) {
+  int a, b, c, hh = 0, mm = 0, ss = 0, y, mo, d;
+  if (!(p = parseUInt(p, end, a)) || p >= end) return false;
+  char sep = *p++;
+  if (!(p = parseUInt(p, end, b)) || p >= end || *p++ != sep) return false;
+  if (!(p = parseUInt(p, end, c))) return false;
+  if (sep == '-') { y = a; mo = b; d = c; } else if (sep == '/') { mo = a; d = b; y = c; } else return false;
+  if (p < end && (*p == ' ' || *p == 'T')) {
+    p++;
+    if (!(p = parseUInt(p, end, hh)) || p >= end || *p++ != ':' || !(p = parseUInt(p, end, mm))) return false;
+    if (p < end && *p == ':') { p++; if (!(p = parseUInt(p, end, ss))) return false; }
+  }
+  if (mo < 1 || mo > 12 || d < 1 || d > 31) return false;
+  epoch = (uint32_t)(daysFromCivil(y, mo, d) * 86400 + hh * 3600 + mm * 60 + ss);
+  return true;
+}
+
+// Minimal decimal parser; empty or malformed fields give NaN.
+float parseFloat(const char* p, const char* end) {
+  while (p < end && *p == ' ') p++;
+  if (p < end && *p == '"') { p++; if (end > p && end[-1] == '"') end--; }
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+  double v = 0, scale = 1; bool digits = false;
+  while (p < end && *p >= '0' && *p <= '9') { v = v * 10 + (*p++ - '0'); digits = true; }
+  if (p < end && (*p == '.' || *p == ',')) {
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') { v = v * 10 + (*p++ - '0'); scale *= 10; digits = true; }
+  }
+  if (!digits) return NAN;
+  return (float)((neg ? -v : v) / scale);
+}
+
+std::string barnNameFromPath(const std::string& path) {
+  size_t slash = path.find_last_of("/\\");
+  std::string base = path.substr(slash == std::string::npos ? 0 : slash + 1);
+  size_t dot = base.find_last_of('.');
+  return dot == std::string::npos ? base : base.substr(0, dot);
+}
+
+bool readFile(const std::string& path, std::string& out) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) return false;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  out.resize(size > 0 ? (size_t)size : 0);
+  bool ok = out.empty() || fread(&out[0], 1, out.size(), f) == out.size();
+  fclose(f);
+  return ok;
+}
+
+// Column positions in the Apps Script sheet layout (A=0): timestamp, B..E metrics, K = pumpDuration.
+const int SHEET_DEFAULT_FIELD[COL_COUNT] = { 1, 2, 3, 4, 10 };
+
+void parseSheetCsv(const std::string& text, Barn& barn) {
+  int field[COL_COUNT];
+  std::copy(SHEET_DEFAULT_FIELD, SHEET_DEFAULT_FIELD + COL_COUNT, field);
+  const char* p = text.data();
+  const char* end = p + text.size();
+  bool firstLine = true;
+
+  std::vector<std::pair<const char*, const char*>> cells;
+  while (p < end) {
+    const char* eol = (const char*)memchr(p, '\n', end - p);
+    if (!eol) eol = end;
+    const char* lineEnd = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+
+    cells.clear();
+    const char* c = p;
+    bool quoted = false;
+    for (const char* q = p; q <= lineEnd; q++) {
+      if (q < lineEnd && *q == '"') quoted = !quoted;
+      if (q == lineEnd || (*q == ',' && !quoted)) { cells.emplace_back(c, q); c = q + 1; }
+    }
+    p = eol + 1;
+    if (cells.empty()) continue;
+
+    const char* t0 = cells[0].first;
+    const char* t1 = cells[0].second;
+    if (t0 < t1 && *t0 == '"') { t0++; if (t1 > t0 && t1[-1] == '"') t1--; }
+    uint32_t epoch;
+    if (!parseTimestamp(t0, t1, epoch)) {
+      if (firstLine) {  // header row: locate columns by exact name, first match wins ("ammoniaP50" is not "ammonia")
+        // Payload key (ROW_KEYS) or the sheet's own label, lower case without spaces and unit
+        static const char* const keys[COL_COUNT][2] = {
+          { "ammonia", "" }, { "temperature", "" }, { "humidity", "" },
+          { "storagetank", "storagetankvolume" }, { "pumpduration", "" } };
+        bool found[COL_COUNT] = {};
+        for (size_t i = 0; i < cells.size(); i++) {
+          std::string h(cells[i].first, cells[i].second);
+          h = h.substr(0, h.find('('));  // "Ammonia (ppm)"
+          std::transform(h.begin(), h.end(), h.begin(), ::tolower);
+          h.erase(std::remove_if(h.begin(), h.end(), [](char ch) { return ch == ' ' || ch == '"'; }), h.end());
+          for (int k = 0; k < COL_COUNT; k++) {
+            if (!found[k] && !h.empty() && (h == keys[k][0] || h == keys[k][1])) { field[k] = (int)i; found[k] = true; }
+          }
+        }
+      }
+      firstLine = false;
+      continue;
+    }
+    firstLine = false;
+    barn.epoch.push_back(epoch - barnUtcOffsetS);
+    for (int k = 0; k < COL_COUNT; k++) {
+      barn.col[k].push_back(field[k] < (int)cells.size() ? parseFloat(cells[field[k]].first, cells[field[k]].second) : NAN);
+    }
+  }
+}
+
+void parseLogDump(const std::string& data, Barn& barn) {
+  static const int map[COL_COUNT] = { KPLOG_COL_AMMONIA, KPLOG_COL_TEMPERATURE, KPLOG_COL_HUMIDITY, KPLOG_COL_STORAGE_TANK, KPLOG_COL_PUMP_DUTY };
+  for (size_t off = 0; off + KPLOG_BLOCK_BYTES <= data.size(); off += KPLOG_BLOCK_BYTES) {
+    KpLogBlockHeader h;
+    memcpy(&h, data.data() + off, sizeof h);
+    const char* payload = data.data() + off + sizeof h;
+    if (!kplogHeaderValid(h) || kplogCrc32(payload, KPLOG_PAYLOAD_BYTES) != h.payloadCrc) {
+      fprintf(stderr, "%s: damaged block at offset %zu skipped\n", barn.name.c_str(), off);
+      continue;
+    }
+    int16_t cols[KPLOG_COLUMN_COUNT][KPLOG_ROWS_PER_BLOCK];
+    memcpy(cols, payload, sizeof cols);
+    for (int r = 0; r < KPLOG_ROWS_PER_BLOCK; r++) {
+      bool any = false;
+      for (int k = 0; k < COL_COUNT; k++) any |= cols[map[k]][r] != KPLOG_MISSING;
+      if (!any) continue;
+      barn.epoch.push_back(h.startEpoch + r * KPLOG_ROW_SECONDS);
+      for (int k = 0; k < COL_COUNT; k++) {
+        int16_t v = cols[map[k]][r];
+        barn.col[k].push_back(v == KPLOG_MISSING ? NAN : v / KPLOG_COLUMN_SCALE[map[k]]);
+      }
+    }
+  }
+}
+
+// Sorts rows by epoch (exports are usually sorted already).
+void sortBarn(Barn& b) {
+  if (std::is_sorted(b.epoch.begin(), b.epoch.end())) return;
+  std::vector<uint32_t> order(b.rows());
+  std::iota(order.begin(), order.end(), 0u);
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) { return b.epoch[x] < b.epoch[y]; });
+  std::vector<uint32_t> e(b.rows());
+  for (size_t i = 0; i < order.size(); i++) e[i] = b.epoch[order[i]];
+  b.epoch.swap(e);
+  for (auto& col : b.col) {
+    std::vector<float> c(b.rows());
+    for (size_t i = 0; i < order.size(); i++) c[i] = col[order[i]];
+    col.swap(c);
+  }
+}
+
+std::vector<Barn> loadFiles(const std::vector<std::string>& paths) {
+  std::vector<Barn> parts(paths.size());
+  parallelFor(paths.size(), [&](size_t i) {
+    std::string text;
+    parts[i].name = barnNameFromPath(paths[i]);
+    if (!readFile(paths[i], text)) { fprintf(stderr, "cannot read %s\n", paths[i].c_str()); return; }
+    bool binary = paths[i].size() > 4 && paths[i].compare(paths[i].size() - 4, 4, ".bin") == 0;
+    if (binary) parseLogDump(text, parts[i]); else parseSheetCsv(text, parts[i]);
+  });
+
+  // Merge several exports of the same barn.
+  std::vector<Barn> barns;
+  for (auto& part : parts) {
+    auto it = std::find_if(barns.begin(), barns.end(), [&](const Barn& b) { return b.name == part.name; });
+    if (it == barns.end()) { barns.push_back(std::move(part)); continue; }
+    it->epoch.insert(it->epoch.end(), part.epoch.begin(), part.epoch.end());
+    for (int k = 0; k < COL_COUNT; k++) it->col[k].insert(it->col[k].end(), part.col[k].begin(), part.col[k].end());
+  }
+  parallelFor(barns.size(), [&](size_t i) { sortBarn(barns[i]); });
+  std::sort(barns.begin(), barns.end(), [](const Barn& a, const Barn& b) { return a.name < b.name; });
+  return barns;
+}
+
+// ---- Analyses --------------------------------------------------------------------
+
+std::string fmt(const char* f, ...) __attribute__((format(printf, 1, 2)));
+std::string fmt(const char* f, ...) {
+  char buf[512];
+  va_list ap; va_start(ap, f);
+  int n = vsnprintf(buf, sizeof buf, f, ap);
+  va_end(ap);
+  return std::string(buf, n < 0 ? 0 : std::min<size_t>(n, sizeof buf - 1));
+}
+
+// Barn-local calendar date of a UTC epoch.
+std::string isoDate(uint32_t epoch, bool monthOnly) {
+  time_t t = (int64_t)epoch + barnUtcOffsetS; struct tm tm; gmtime_r(&t, &tm);
+  char buf[16];
+  strftime(buf, sizeof buf, monthOnly ? "%Y-%m" : "%Y-%m-%d", &tm);
+  return buf;
+}
+
+// First epoch after the barn-local day or calendar month containing 'epoch'.
+uint32_t periodEnd(uint32_t epoch, bool byMonth) {
+  int64_t local = (int64_t)epoch + barnUtcOffsetS;
+  if (!byMonth) return (uint32_t)((local / 86400 + 1) * 86400 - barnUtcOffsetS);
+  time_t t = local; struct tm tm; gmtime_r(&t, &tm);
+  int y = tm.tm_year + 1900, m = tm.tm_mon + 2;
+  if (m > 12) { m = 1; y++; }
+  return (uint32_t)(daysFromCivil(y, m, 1) * 86400 - barnUtcOffsetS);
+}
+
+// Per barn and period: mean/min/max of each metric plus total pump seconds.
+std::vector<std::string> runRollup(const std::vector<Barn>& barns, bool byMonth) {
+  std::vector<std::string> out(barns.size());
+  parallelFor(barns.size(), [&](size_t bi) {
+    const Barn& b = barns[bi];
+    std::string& s = out[bi];
+    for (size_t i = 0; i < b.rows(); ) {
+      uint32_t end = periodEnd(b.epoch[i], byMonth);
+      size_t j = i;
+      while (j < b.rows() && b.epoch[j] < end) j++;
+      s += b.name + "," + isoDate(b.epoch[i], byMonth) + fmt(",%zu", j - i);
+      for (int k = 0; k < COL_TANK + 1; k++) {
+        Moments m = moments(b.col[k].data() + i, j - i);
+        if (m.n > 0) s += fmt(",%.2f,%.1f,%.1f", m.mean(), m.min, m.max);
+        else s += ",,,";
+      }
+      Moments pump = moments(b.col[COL_PUMP_S].data() + i, j - i);
+      s += fmt(",%.0f\n", pump.sum);
+      i = j;
+    }
+  });
+  return out;
+}
+
+const uint32_t LAG_TOLERANCE_S = 15 * 60;  // hourly sheet rows drift by a few minutes
+
+// Column k re-sampled at each row's epoch + lagS: the value of the nearest row
+// within LAG_TOLERANCE_S, NaN if there is none (gap, or past the end).
+std::vector<float> laggedColumn(const Barn& b, int k, uint32_t lagS) {
+  std::vector<float> out(b.rows(), NAN);
+  auto dist = [](uint32_t a, uint32_t t) { return a > t ? a - t : t - a; };
+  size_t j = 0;
+  for (size_t i = 0; i < b.rows(); i++) {
+    uint32_t target = b.epoch[i] + lagS;
+    while (j + 1 < b.rows() && b.epoch[j + 1] <= target) j++;
+    size_t best = j;
+    if (j + 1 < b.rows() && dist(b.epoch[j + 1], target) < dist(b.epoch[j], target)) best = j + 1;
+    if (dist(b.epoch[best], target) <= LAG_TOLERANCE_S) out[i] = b.col[k][best];
+  }
+  return out;
+}
+
+// Pearson correlation of ammonia with pump duty, at lags 0..maxLag hours (pump
+// at t vs ammonia at t+lag, matched by time so hourly sheets and minute logs
+// agree): a negative value at lag ≥1 means flushing lowers ammonia.
+std::vector<std::string> runCorrelation(const std::vector<Barn>& barns, int maxLag) {
+  std::vector<std::string> out(barns.size());
+  parallelFor(barns.size(), [&](size_t bi) {
+    const Barn& b = barns[bi];
+    std::string& s = out[bi];
+    s += b.name + fmt(",%zu", b.rows());
+    PairMoments th = pairMoments(b.col[COL_AMMONIA].data(), b.col[COL_TEMPERATURE].data(), b.rows());
+    PairMoments hh = pairMoments(b.col[COL_AMMONIA].data(), b.col[COL_HUMIDITY].data(), b.rows());
+    s += fmt(",%.3f,%.3f", th.pearson(), hh.pearson());
+    for (int lag = 0; lag <= maxLag; lag++) {
+      std::vector<float> nh3 = laggedColumn(b, COL_AMMONIA, (uint32_t)lag * 3600);
+      PairMoments p = pairMoments(b.col[COL_PUMP_S].data(), nh3.data(), b.rows());
+      s += fmt(",%.3f", p.pearson());
+    }
+    s += '\n';
+  });
+  return out;
+}
+
+// Rows whose ammonia deviates more than z·σ from the barn mean, values repeated
+// for ≥6 rows (stuck sensor), and gaps longer than 3 h in the time series.
+std::vector<std::string> runAnomalies(const std::vector<Barn>& barns, double z) {
+  std::vector<std::string> out(barns.size());
+  parallelFor(barns.size(), [&](size_t bi) {
+    const Barn& b = barns[bi];
+    std::string& s = out[bi];
+    for (int k = 0; k < COL_TANK + 1; k++) {
+      const float* x = b.col[k].data();
+      Moments m = moments(x, b.rows());
+      double mean = m.mean(), sd = m.stddev();
+      size_t run = 1;
+      for (size_t i = 0; i < b.rows(); i++) {
+        if (x[i] != x[i]) { run = 1; continue; }
+        if (sd > 0 && std::fabs(x[i] - mean) > z * sd) {
+          s += b.name + "," + isoDate(b.epoch[i], false) + fmt(",%u,%s,spike,%.2f,%.1f\n", b.epoch[i], COLUMN_NAMES[k], x[i], (x[i] - mean) / sd);
+        }
+        run = (i > 0 && x[i] == x[i - 1]) ? run + 1 : 1;
+        if (run == 6) s += b.name + "," + isoDate(b.epoch[i], false) + fmt(",%u,%s,stuck,%.2f,\n", b.epoch[i], COLUMN_NAMES[k], x[i]);
+      }
+    }
+    for (size_t i = 1; i < b.rows(); i++) {
+      if (b.epoch[i] - b.epoch[i - 1] > 3 * 3600) {
+        s += b.name + "," + isoDate(b.epoch[i - 1], false) + fmt(",%u,all,gap,%.1f,\n", b.epoch[i - 1], (b.epoch[i] - b.epoch[i - 1]) / 3600.0);
+      }
+    }
+  });
+  return out;
+}
+
+void printResults(const char* header, const std::vector<std::string>& parts) {
+  fputs(header, stdout);
+  for (const auto& p : parts) fwrite(p.data(), 1, p.size(), stdout);
+}
+
+// ---- Benchmark -------------------------------------------------------------------
+
+// Hourly synthetic barn: diurnal temperature/humidity, ammonia that builds up
+// and drops after each flush, noise, and occasional sensor dropouts.
+void synthesizeBarn(Barn& b, int years, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> noise(0.0f, 1.0f);
+  std::uniform_real_distribution<float> u(0.0f, 1.0f);
+  size_t rows = (size_t)years * 365 * 24;
+  uint32_t start = 1577836800u;  // 2020-01-01
+  b.epoch.resize(rows);
+  for (auto& c : b.col) c.resize(rows);
+  float nh3 = 8.0f;
+  for (size_t i = 0; i < rows; i++) {
+    float hourOfDay = (float)(i % 24);
+    float diurnal = std::sin((hourOfDay - 9.0f) / 24.0f * 6.2831853f);
+    bool flush = i % 6 == 0;
+    nh3 = flush ? nh3 * 0.6f : nh3 + 1.2f + 0.3f * noise(rng);
+    b.epoch[i] = start + (uint32_t)i * 3600u;
+    b.col[COL_AMMONIA][i]     = std::max(0.0f, nh3 + 0.5f * noise(rng));
+    b.col[COL_TEMPERATURE][i] = 28.0f + 4.0f * diurnal + 0.3f * noise(rng);
+    b.col[COL_HUMIDITY][i]    = 75.0f - 12.0f * diurnal + noise(rng);
+    b.col[COL_TANK][i]        = 20.0f + 5.0f * u(rng);
+    b.col[COL_PUMP_S][i]      = flush ? 20.0f : 0.0f;
+    if (u(rng) < 0.002f) for (auto& c : b.col) c[i] = NAN;
+  }
+}
+
+double secondsSince(std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+int runBench(int barnCount, int years) {
+  auto t0 = std::chrono::steady_clock::now();
+  std::vector<Barn> barns(barnCount);
+  parallelFor(barns.size(), [&](size_t i) { barns[i].name = fmt("RAB%03zu", i + 1); synthesizeBarn(barns[i], years, (uint32_t)i + 1); });
+  size_t rows = 0;
+  for (auto& b : barns) rows += b.rows();
+  fprintf(stderr, "generated %d barns x %d years = %zu rows (%.0f MB) in %.2f s\n", barnCount, years, rows,
+          rows * (sizeof(uint32_t) + COL_COUNT * sizeof(float)) / 1e6, secondsSince(t0));
+
+  // CSV ingest throughput on one barn rendered in the sheet layout.
+  std::string csv = "Timestamp,Ammonia,Temperature,Humidity,Storage Tank,Pump,Siren,CCTV,AUX,flushInterval,pumpDuration\n";
+  for (size_t i = 0; i < barns[0].rows(); i++) {
+    const Barn& b = barns[0];
+    csv += isoDate(b.epoch[i], false) + fmt(" %02u:00:00,%.1f,%.1f,%.1f,%.1f,,,,,60,%.0f\n", ((b.epoch[i] + barnUtcOffsetS) / 3600) % 24,
+                                            b.col[0][i], b.col[1][i], b.col[2][i], b.col[3][i], b.col[4][i]);
+  }
+  t0 = std::chrono::steady_clock::now();
+  Barn parsed;
+  parseSheetCsv(csv, parsed);
+  double tp = secondsSince(t0);
+  fprintf(stderr, "csv ingest      : %zu rows, %.1f MB in %.3f s (%.0f MB/s per thread)\n", parsed.rows(), csv.size() / 1e6, tp, csv.size() / 1e6 / tp);
+
+  struct Case { const char* name; std::function<void()> fn; };
+  std::vector<Case> cases = {
+    { "rollup day     ", [&] { runRollup(barns, false); } },
+    { "rollup month   ", [&] { runRollup(barns, true); } },
+    { "corr lag 0..6  ", [&] { runCorrelation(barns, 6); } },
+    { "anomalies z=4  ", [&] { runAnomalies(barns, 4.0); } },
+  };
+  unsigned hw = threadCount;
+  std::vector<unsigned> threadSet = { 1u };
+  if (hw > 1) threadSet.push_back(hw);
+#if defined(__AVX2__)
+  const int simdModes[] = { 1, 0 };
+#else
+  const int simdModes[] = { 0 };
+#endif
+  for (auto& c : cases) {
+    for (int simd : simdModes) {
+      for (unsigned th : threadSet) {
+        useSimd = simd; threadCount = th;
+        t0 = std::chrono::steady_clock::now();
+        c.fn();
+        double s = secondsSince(t0);
+        fprintf(stderr, "%s: %-6s %2u thread(s) %7.3f s  %6.1f Mrows/s\n", c.name, simd ? "simd" : "scalar", th, s, rows / s / 1e6);
+      }
+    }
+  }
+  useSimd = true; threadCount = hw;
+  return 0;
+}
+
+int usage() {
+  fprintf(stderr,
+          "usage: kpstat rollup    [--by day|month] FILES...\n"
+          "       kpstat corr      [--maxlag HOURS] FILES...\n"
+          "       kpstat anomalies [--z SIGMA] FILES...\n"
+          "       kpstat bench     [--barns N] [--years Y]\n"
+          "       common: --threads N, --no-simd, --tz HOURS (barn UTC offset, default 8)\n");
+  return 2;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) return usage();
+  std::string cmd = argv[1];
+  std::string by = "day";
+  int maxLag = 3, barnCount = 200, years = 10;
+  double z = 4.0;
+  std::vector<std::string> files;
+  for (int i = 2; i < argc; i++) {
+    std::string a = argv[i];
+    bool hasVal = i + 1 < argc;
+    if (a == "--by" && hasVal)           by = argv[++i];
+    else if (a == "--maxlag" && hasVal)  maxLag = atoi(argv[++i]);
+    else if (a == "--z" && hasVal)       z = atof(argv[++i]);
+    else if (a == "--barns" && hasVal)   barnCount = atoi(argv[++i]);
+    else if (a == "--years" && hasVal)   years = atoi(argv[++i]);
+    else if (a == "--threads" && hasVal) threadCount = std::max(1, atoi(argv[++i]));
+    else if (a == "--tz" && hasVal)      barnUtcOffsetS = (int)lround(atof(argv[++i]) * 3600);
+    else if (a == "--no-simd")           useSimd = false;
+    else if (a.size() > 1 && a[0] == '-') return usage();
+    else files.push_back(a);
+  }
+
+  if (cmd == "bench") return runBench(std::max(1, barnCount), std::max(1, years));
+  if (files.empty()) return usage();
+
+  auto t0 = std::chrono::steady_clock::now();
+  std::vector<Barn> barns = loadFiles(files);
+  size_t rows = 0;
+  for (auto& b : barns) rows += b.rows();
+  fprintf(stderr, "loaded %zu barns, %zu rows in %.2f s\n", barns.size(), rows, secondsSince(t0));
+
+  if (cmd == "rollup") {
+    std::string header = "barn,period,rows";
+    for (int k = 0; k < COL_TANK + 1; k++) header += fmt(",%s_mean,%s_min,%s_max", COLUMN_NAMES[k], COLUMN_NAMES[k], COLUMN_NAMES[k]);
+    header += ",pump_seconds\n";
+    printResults(header.c_str(), runRollup(barns, by == "month"));
+  } else if (cmd == "corr") {
+    std::string header = "barn,rows,r_nh3_temp,r_nh3_hum";
+    for (int lag = 0; lag <= maxLag; lag++) header += fmt(",r_pump_nh3_lag%d", lag);
+    header += "\n";
+    printResults(header.c_str(), runCorrelation(barns, std::max(0, maxLag)));
+  } else if (cmd == "anomalies") {
+    printResults("barn,date,epoch,metric,kind,value,zscore\n", runAnomalies(barns, z));
+  } else {
+    return usage();
+  }
+  return 0;
+}
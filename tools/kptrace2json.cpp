@@ -0,0 +1,189 @@
+// ----------------------------------------------------------------------------------
+//  kptrace2json – convert a KambingPRO event trace dump to Chrome trace JSON
+//
+//  Build:  g++ -O2 -std=c++17 -o kptrace2json tools/kptrace2json.cpp
+//  Fetch:  curl -o trace.bin "http://<device>/api/trace"
+//          or capture the serial console while the sketch prints a dump
+//  Usage:  kptrace2json trace.bin|console.log > trace.json
+//
+//  Open the result in chrome://tracing or https://ui.perfetto.dev. Each watched
+//  task is a thread whose stages are slices (a slice ends where the next stage
+//  of that task begins), events are instants on the task that raised them, and
+//  every relay GPIO is a 0/1 counter track.
+//
+//  A serial capture may contain log lines around and between the base64 lines;
+//  only lines made of base64 characters between the KPTRACE markers are used.
+// ----------------------------------------------------------------------------------
+
+#include "../KambingPRO_Trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+bool readFile(const char* path, std::vector<uint8_t>& out) {
+  FILE* f = fopen(path, "rb");
+  if (!f) return false;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  out.resize(size > 0 ? (size_t)size : 0);
+  bool ok = out.empty() || fread(out.data(), 1, out.size(), f) == out.size();
+  fclose(f);
+  return ok;
+}
+
+int base64Value(char c) {
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+// Decodes the last KPTRACE BEGIN/END block of a serial capture.
+bool extractSerialDump(const std::vector<uint8_t>& text, std::vector<uint8_t>& out) {
+  std::string s(text.begin(), text.end());
+  size_t begin = s.rfind("KPTRACE BEGIN");
+  if (begin == std::string::npos) return false;
+  size_t end = s.find("KPTRACE END", begin);
+  if (end == std::string::npos) return false;
+  size_t pos = s.find('\n', begin);
+  out.clear();
+  while (pos != std::string::npos && pos < end) {
+    size_t next = s.find('\n', pos + 1);
+    std::string line = s.substr(pos + 1, (next == std::string::npos ? s.size() : next) - pos - 1);
+    while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+    bool valid = !line.empty() && line.size() % 4 == 0;
+    for (char c : line) if (base64Value(c) < 0 && c != '=') valid = false;
+    if (valid) {
+      for (size_t i = 0; i < line.size(); i += 4) {
+        uint32_t v = 0;
+        int pad = 0;
+        for (int k = 0; k < 4; k++) {
+          char c = line[i + k];
+          if (c == '=') { pad++; v <<= 6; } else v = (v << 6) | base64Value(c);
+        }
+        out.push_back((uint8_t)(v >> 16));
+        if (pad < 2) out.push_back((uint8_t)(v >> 8));
+        if (pad < 1) out.push_back((uint8_t)v);
+      }
+    }
+    pos = next;
+  }
+  return true;
+}
+
+bool readNames(const std::vector<uint8_t>& d, size_t& off, int count, std::vector<std::string>& names) {
+  for (int i = 0; i < count; i++) {
+    const void* nul = off < d.size() ? memchr(d.data() + off, 0, d.size() - off) : nullptr;
+    if (!nul) return false;
+    names.emplace_back((const char*)d.data() + off);
+    off = (const uint8_t*)nul - d.data() + 1;
+  }
+  return true;
+}
+
+std::string nameOr(const std::vector<std::string>& names, unsigned i, const char* prefix) {
+  if (i < names.size()) return names[i];
+  return std::string(prefix) + std::to_string(i);
+}
+
+void appendEscaped(std::string& out, const std::string& s) {
+  for (char c : s) {
+    if (c == '"' || c == '\\') out += '\\';
+    if ((unsigned char)c >= 0x20) out += c;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 2) { fprintf(stderr, "usage: %s trace.bin|console.log > trace.json\n", argv[0]); return 2; }
+  std::vector<uint8_t> raw, dump;
+  if (!readFile(argv[1], raw)) { fprintf(stderr, "cannot read %s\n", argv[1]); return 1; }
+
+  uint32_t magic = 0;
+  if (raw.size() >= 4) memcpy(&magic, raw.data(), 4);
+  if (magic == KPTRACE_MAGIC) dump.swap(raw);
+  else if (!extractSerialDump(raw, dump)) { fprintf(stderr, "%s: no trace dump found\n", argv[1]); return 1; }
+
+  KpTraceDumpHeader h;
+  if (dump.size() < sizeof h) { fprintf(stderr, "truncated dump\n"); return 1; }
+  memcpy(&h, dump.data(), sizeof h);
+  if (h.magic != KPTRACE_MAGIC || h.version != KPTRACE_VERSION || h.eventSize != sizeof(KpTraceEvent)) {
+    fprintf(stderr, "unsupported dump (magic %08x, version %u)\n", h.magic, h.version);
+    return 1;
+  }
+  size_t off = sizeof h;
+  std::vector<std::string> tracks, stages, events;
+  if (!readNames(dump, off, h.trackCount, tracks) || !readNames(dump, off, h.stageCount, stages) ||
+      !readNames(dump, off, h.eventNameCount, events)) {
+    fprintf(stderr, "truncated name tables\n");
+    return 1;
+  }
+  size_t available = (dump.size() - off) / sizeof(KpTraceEvent);
+  if (available < h.eventCount) fprintf(stderr, "warning: %u events announced, %zu present\n", h.eventCount, available);
+  size_t count = available < h.eventCount ? available : h.eventCount;
+
+  std::string out;
+  out.reserve(count * 96 + 4096);
+  out += "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"totalEvents\":";
+  out += std::to_string(h.totalEvents);
+  out += "},\"traceEvents\":[\n";
+  out += "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"args\":{\"name\":\"KambingPRO\"}}";
+  for (size_t t = 0; t < tracks.size(); t++) {
+    out += ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" + std::to_string(t) + ",\"args\":{\"name\":\"";
+    appendEscaped(out, tracks[t]);
+    out += "\"}}";
+  }
+
+  // Timestamps: 32-bit micros(), unwrapped by signed deltas so that small
+  // cross-core reorderings do not look like a wrap.
+  std::vector<int> openStage(256, -1);
+  int64_t  ts = 0;
+  uint32_t prevUs = 0;
+  char line[256];
+  for (size_t i = 0; i < count; i++) {
+    KpTraceEvent e;
+    memcpy(&e, dump.data() + off + i * sizeof e, sizeof e);
+    if (i > 0) ts += (int32_t)(e.us - prevUs);
+    prevUs = e.us;
+    std::string name;
+    if (e.kind == KPTRACE_STAGE) {
+      if (openStage[e.track] >= 0) {
+        snprintf(line, sizeof line, ",\n{\"ph\":\"E\",\"pid\":1,\"tid\":%u,\"ts\":%lld}", e.track, (long long)ts);
+        out += line;
+      }
+      openStage[e.track] = e.id;
+      out += ",\n{\"ph\":\"B\",\"name\":\"";
+      appendEscaped(out, nameOr(stages, e.id, "stage "));
+      snprintf(line, sizeof line, "\",\"cat\":\"stage\",\"pid\":1,\"tid\":%u,\"ts\":%lld}", e.track, (long long)ts);
+      out += line;
+    } else if (e.kind == KPTRACE_INSTANT) {
+      out += ",\n{\"ph\":\"i\",\"s\":\"t\",\"name\":\"";
+      appendEscaped(out, nameOr(events, e.id, "event "));
+      snprintf(line, sizeof line, "\",\"cat\":\"event\",\"pid\":1,\"tid\":%u,\"ts\":%lld,\"args\":{\"value\":%d}}",
+               e.track, (long long)ts, e.arg);
+      out += line;
+    } else if (e.kind == KPTRACE_RELAY) {
+      snprintf(line, sizeof line, ",\n{\"ph\":\"C\",\"name\":\"relay gpio%u\",\"pid\":1,\"ts\":%lld,\"args\":{\"on\":%d}}",
+               e.id, (long long)ts, e.arg ? 1 : 0);
+      out += line;
+    }
+  }
+  for (size_t t = 0; t < openStage.size(); t++) {  // close stages still running at the dump
+    if (openStage[t] < 0) continue;
+    snprintf(line, sizeof line, ",\n{\"ph\":\"E\",\"pid\":1,\"tid\":%zu,\"ts\":%lld}", t, (long long)ts);
+    out += line;
+  }
+  out += "\n]}\n";
+  fwrite(out.data(), 1, out.size(), stdout);
+  fprintf(stderr, "%zu events (%u recorded since boot), %.3f s\n", count, h.totalEvents, ts / 1e6);
+  return 0;
+}